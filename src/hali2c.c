@@ -22,9 +22,12 @@
 
 #include "hali2c.h"
 #include "helpers.h"
+#include "halsched.h"
 #include "hali2c_kernel.h"
+#include "hali2c_uring.h"
 
 const char* hali2c_kernel_id = "kernel";
+const char* hali2c_uring_id = "uring";
 
 static int is_nack(int v)
 {
@@ -36,26 +39,101 @@ static int is_nack(int v)
 	return (v == -ENXIO || v == -ETIMEDOUT || v == -EREMOTEIO);
 }
 
+/*
+ * Remaining time until delay_us (at least the guard time)
+ * have passed since the end of the last transaction.
+ */
+static size_t hali2c_remaining_us(struct hali2c_dev* dev, size_t delay_us)
+{
+	uint64_t elapsed;
+
+	if (delay_us < dev->guard_us)
+		delay_us = dev->guard_us;
+
+	if (!delay_us || !dev->last_us)
+		return delay_us;
+
+	elapsed = monotonic_us() - dev->last_us;
+	return elapsed >= delay_us ? 0 : delay_us - elapsed;
+}
+
+int hali2c_read_delayed(struct hali2c_dev* dev,
+		unsigned char* buf, size_t len, size_t delay_us)
+{
+	int ret;
+
+	if (!dev)
+		return 0;
+
+	delay_us = hali2c_remaining_us(dev, delay_us);
+
+	/*
+	 * Let the provider combine the delay and the transfer,
+	 * unless we run in a task, which has to yield while waiting.
+	 */
+	if (delay_us && dev->read_delayed && !halsched_in_task()) {
+		ret = dev->read_delayed(dev, buf, len, delay_us);
+	} else {
+		if (delay_us) {
+			ret = halsched_sleep_us(delay_us);
+			if (ret) {
+				Log2(PCSC_LOG_ERROR, "Sleeping failed: %d", ret);
+				return ret;
+			}
+		}
+
+		ret = hali2c_read(dev, buf, len);
+	}
+
+	dev->last_us = monotonic_us();
+	return ret;
+}
+
+int hali2c_write_delayed(struct hali2c_dev* dev,
+		const unsigned char* buf, size_t len, size_t delay_us)
+{
+	int ret;
+
+	if (!dev)
+		return 0;
+
+	delay_us = hali2c_remaining_us(dev, delay_us);
+
+	if (delay_us && dev->write_delayed && !halsched_in_task()) {
+		ret = dev->write_delayed(dev, buf, len, delay_us);
+	} else {
+		if (delay_us) {
+			ret = halsched_sleep_us(delay_us);
+			if (ret) {
+				Log2(PCSC_LOG_ERROR, "Sleeping failed: %d", ret);
+				return ret;
+			}
+		}
+
+		ret = hali2c_write(dev, buf, len);
+	}
+
+	dev->last_us = monotonic_us();
+	return ret;
+}
+
 int hali2c_read_with_retry(struct hali2c_dev* dev,
 		unsigned char* buf, size_t len,
 		size_t max_attempts, size_t guard_time_us)
 {
 	size_t counter = 0;
+	size_t delay = 0;
 
 	if (!dev)
 		return 0;
 
 	do {
-		int ret = dev->read(dev, buf, len);
+		int ret = hali2c_read_delayed(dev, buf, len, delay);
 		if (ret == (int)len) {
 			/* Done */
 			return 0;
 		} else if (is_nack(ret)) {
-			ret = usleep(guard_time_us);
-			if (ret) {
-				Log2(PCSC_LOG_ERROR, "Calling usleep failed: %d", ret);
-				return ret;
-			}
+			delay = guard_time_us;
 		} else if (ret < 0) {
 			Log2(PCSC_LOG_ERROR, "Reading from I2C device failed: %d", ret);
 			return ret;
@@ -71,26 +149,70 @@ int hali2c_read_with_retry(struct hali2c_dev* dev,
 	return -ETIMEDOUT;
 }
 
+int hali2c_read_poll(struct hali2c_dev* dev,
+		unsigned char* buf, size_t len,
+		const struct hali2c_poll *poll)
+{
+	uint64_t start = monotonic_us();
+	uint64_t now;
+	size_t interval = poll->interval_us ? poll->interval_us : 1;
+	size_t delay = 0;
+
+	if (!dev)
+		return 0;
+
+	for (;;) {
+		int ret = hali2c_read_delayed(dev, buf, len, delay);
+		if (ret == (int)len) {
+			/* Done */
+			return 0;
+		} else if (!is_nack(ret)) {
+			if (ret < 0) {
+				Log2(PCSC_LOG_ERROR, "Reading from I2C device failed: %d", ret);
+			} else {
+				Log3(PCSC_LOG_ERROR, "Read only %i of %zu bytes", ret, len);
+			}
+			return ret;
+		}
+
+		now = monotonic_us();
+		if (now >= poll->deadline_us)
+			break;
+
+		/* Back off after the expected response time. */
+		if (now - start > poll->dense_us && interval < poll->max_interval_us) {
+			interval *= 2;
+			if (interval > poll->max_interval_us)
+				interval = poll->max_interval_us;
+		}
+
+		delay = interval;
+		if (now + delay > poll->deadline_us)
+			delay = poll->deadline_us - now;
+	}
+
+	Log1(PCSC_LOG_ERROR, "Read timed out");
+
+	return -ETIMEDOUT;
+}
+
 int hali2c_write_with_retry(struct hali2c_dev* dev,
 	const unsigned char* buf, size_t len,
 	size_t max_attempts, size_t guard_time_us)
 {
 	size_t counter = 0;
+	size_t delay = 0;
 
 	if (!dev)
 		return 0;
 
 	do {
-		int ret = dev->write(dev, buf, len);
+		int ret = hali2c_write_delayed(dev, buf, len, delay);
 		if (ret == (int)len) {
 			/* Done */
 			return 0;
 		} else if (is_nack(ret)) {
-			ret = usleep(guard_time_us);
-			if (ret) {
-				Log2(PCSC_LOG_ERROR, "Calling usleep failed: %d", ret);
-				return errno;
-			}
+			delay = guard_time_us;
 		} else if (ret < 0) {
 			Log2(PCSC_LOG_ERROR, "Writing to I2C device failed: %d", ret);
 			return ret;
@@ -120,6 +242,11 @@ struct hali2c_dev* hali2c_open(char* config)
 	if (starts_with(hali2c_kernel_id, config)) {
 		return hali2c_open_kernel(args);
 	}
+#if defined(HAVE_IO_URING) && !defined(HALI2C_ONLY_KERNEL)
+	else if (starts_with(hali2c_uring_id, config)) {
+		return hali2c_open_uring(args);
+	}
+#endif
 
 	Log2(PCSC_LOG_ERROR, "Unknown I2C provider: '%s'!", config);
 	return NULL;
@@ -19,14 +19,41 @@
 #define HALI2C_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <errno.h>
 
 struct hali2c_dev {
 	int (*read)(struct hali2c_dev* device, unsigned char* buf, size_t len);
 	int (*write)(struct hali2c_dev* device, const unsigned char* buf, size_t len);
 	void (*close)(struct hali2c_dev* device);
+	/* Optional: transfer after a delay (e.g. as one linked submission). */
+	int (*read_delayed)(struct hali2c_dev* device, unsigned char* buf, size_t len, size_t delay_us);
+	int (*write_delayed)(struct hali2c_dev* device, const unsigned char* buf, size_t len, size_t delay_us);
+	/* Guard time tracking (see hali2c_set_guard_time()) */
+	size_t guard_us;
+	uint64_t last_us; /* End of the last transaction (see monotonic_us()) */
 };
 
+/*
+ * Builds with HALI2C_ONLY_KERNEL only support the "kernel" provider,
+ * which is called directly (and can be inlined with LTO).
+ */
+#ifdef HALI2C_ONLY_KERNEL
+#include "hali2c_kernel.h"
+#endif
+
+/*
+ * Set the minimum time between two transactions.
+ * hali2c_read_delayed() and hali2c_write_delayed() (and therefore
+ * all retry and poll helpers) only wait for the remainder of the
+ * guard time (or delay) since the end of the last transaction.
+ */
+static inline void hali2c_set_guard_time(struct hali2c_dev* dev, size_t guard_us)
+{
+	if (dev)
+		dev->guard_us = guard_us;
+}
+
 /*
  * Read from I2C device.
  *
@@ -38,9 +65,13 @@ static inline int hali2c_read(struct hali2c_dev* dev,
 {
 	if (!dev)
 		return 0;
+#ifdef HALI2C_ONLY_KERNEL
+	return hali2c_kernel_read(dev, buf, len);
+#else
 	if (!dev->read)
 		return -ENODEV;
 	return dev->read(dev, buf, len);
+#endif
 }
 
 /*
@@ -54,9 +85,13 @@ static inline int hali2c_write(struct hali2c_dev* dev,
 {
 	if (!dev)
 		return 0;
+#ifdef HALI2C_ONLY_KERNEL
+	return hali2c_kernel_write(dev, buf, len);
+#else
 	if (!dev->write)
 		return -ENODEV;
 	return dev->write(dev, buf, len);
+#endif
 }
 
 /*
@@ -68,6 +103,26 @@ static inline void hali2c_close(struct hali2c_dev* dev)
 		dev->close(dev);
 }
 
+/*
+ * Read from I2C device delay_us (at least the guard time)
+ * after the end of the last transaction.
+ *
+ * Return 0 on success, or -ve on error,
+ * or n<len if not all bytes have been read.
+ */
+int hali2c_read_delayed(struct hali2c_dev* dev,
+	unsigned char* buf, size_t len, size_t delay_us);
+
+/*
+ * Write to I2C device delay_us (at least the guard time)
+ * after the end of the last transaction.
+ *
+ * Return 0 on success, or -ve on error,
+ * or n<len if not all bytes have been written.
+ */
+int hali2c_write_delayed(struct hali2c_dev* dev,
+	const unsigned char* buf, size_t len, size_t delay_us);
+
 /*
  * Read with retry on NACK.
  * This will call read up to max_attempts times with a delay
@@ -92,6 +147,29 @@ int hali2c_write_with_retry(struct hali2c_dev* dev,
 	const unsigned char* buf, size_t len,
 	size_t max_attempts, size_t guard_time_us);
 
+/*
+ * Poll schedule for reads, which wait for the device to respond.
+ * The device is polled every interval_us during the first dense_us
+ * (where the response is expected), afterwards the interval doubles
+ * on every NACK up to max_interval_us.
+ */
+struct hali2c_poll {
+	uint64_t deadline_us; /* Absolute deadline (see monotonic_us()) */
+	size_t dense_us; /* Duration of dense polling */
+	size_t interval_us; /* Poll interval during dense polling */
+	size_t max_interval_us; /* Upper bound of the poll interval */
+};
+
+/*
+ * Read with retry on NACK until the deadline of the poll schedule.
+ *
+ * Returns 0 on success, -ETIMEDOUT if timed out, or -ve on error,
+ * or n<len if not all bytes have been read.
+ */
+int hali2c_read_poll(struct hali2c_dev* dev,
+	unsigned char* buf, size_t len,
+	const struct hali2c_poll *poll);
+
 /*
  * Create a new hali2c_dev device based the configuration string.
  * Returns the new object on success, or NULL otherwise.
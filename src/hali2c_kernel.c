@@ -22,22 +22,45 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 
 #include <debuglog.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include "helpers.h"
 #include "hali2c.h"
 
+#define MAX_I2C_BUSES 8
+
+/* Max. length of the path of an I2C device (e.g. "/dev/i2c-0"). */
+#define MAX_I2C_DEVICE_LEN 64
+
+/*
+ * An opened I2C device, shared by all slaves on the bus.
+ * The transfers carry the slave address (I2C_RDWR), so no
+ * per-slave state (I2C_SLAVE) is attached to the file descriptor.
+ */
+struct hali2c_kernel_bus
+{
+	char i2c_device[MAX_I2C_DEVICE_LEN];
+	int i2c_fd;
+	size_t refs;
+};
+
+/* Protects the bus array. */
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hali2c_kernel_bus buses[MAX_I2C_BUSES];
+
 struct hali2c_kernel_dev
 {
 	/* Embed halgpio device */
 	struct hali2c_dev device;
 	/* I2C related state. */
-	char *i2c_device; /* I2C device (e.g. "/dev/i2c-0") */
+	char i2c_device[MAX_I2C_DEVICE_LEN]; /* I2C device (e.g. "/dev/i2c-0") */
 	int i2c_addr; /* I2C slave addr (e.g. 0x20) */
-	int i2c_fd; /* File descriptor to I2C device */
+	struct hali2c_kernel_bus *bus;
 };
 
 /*
@@ -56,7 +79,12 @@ static int hali2c_kernel_parse(struct hali2c_kernel_dev *dev, char* config)
 		Log2(PCSC_LOG_ERROR, "No I2C slave address defined in '%s'", config);
 		return -EINVAL;
 	}
-	dev->i2c_device = strndup(config, p - config);
+	if ((size_t)(p - config) >= sizeof(dev->i2c_device)) {
+		Log2(PCSC_LOG_ERROR, "I2C device path too long in '%s'", config);
+		return -EINVAL;
+	}
+	memcpy(dev->i2c_device, config, p - config);
+	dev->i2c_device[p - config] = '\0';
 	Log2(PCSC_LOG_DEBUG, "i2c_device: %s", dev->i2c_device);
 	p++;
 
@@ -73,65 +101,147 @@ static int hali2c_kernel_parse(struct hali2c_kernel_dev *dev, char* config)
 	return 0;
 }
 
-static int hali2c_kernel_open(struct hali2c_kernel_dev *dev)
+static struct hali2c_kernel_bus* hali2c_kernel_bus_get(const char *i2c_device)
 {
-	int ret;
+	struct hali2c_kernel_bus *bus = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&bus_lock);
+
+	for (i = 0; i < MAX_I2C_BUSES; i++) {
+		if (buses[i].refs && strcmp(buses[i].i2c_device, i2c_device) == 0) {
+			bus = &buses[i];
+			bus->refs++;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < MAX_I2C_BUSES; i++) {
+		if (!buses[i].refs) {
+			bus = &buses[i];
+			break;
+		}
+	}
+
+	if (!bus) {
+		Log1(PCSC_LOG_ERROR, "Too many I2C buses!");
+		goto out;
+	}
 
 	/* Open I2C device */
-	dev->i2c_fd = open(dev->i2c_device, O_RDWR);
-	if (dev->i2c_fd < 0) {
+	bus->i2c_fd = open(i2c_device, O_RDWR | O_CLOEXEC);
+	if (bus->i2c_fd < 0) {
 		Log3(PCSC_LOG_ERROR, "Could not open I2C device %s (%d)",
-			dev->i2c_device, dev->i2c_fd);
-		return dev->i2c_fd;
+			i2c_device, errno);
+		bus = NULL;
+		goto out;
 	}
 
-	Log3(PCSC_LOG_DEBUG, "I2C fd (%s): %d", dev->i2c_device, dev->i2c_fd);
+	/* Both have the same size. */
+	strcpy(bus->i2c_device, i2c_device);
+	bus->refs = 1;
 
-	/* Set the slave address */
-	ret = ioctl(dev->i2c_fd, I2C_SLAVE, dev->i2c_addr);
-	if (ret < 0) {
-		Log2(PCSC_LOG_ERROR, "Could not set I2C address: %d",
-			dev->i2c_addr);
-		close(dev->i2c_fd);
-		dev->i2c_fd = -1;
-		return -errno;
+	Log3(PCSC_LOG_DEBUG, "I2C fd (%s): %d", i2c_device, bus->i2c_fd);
+
+out:
+	pthread_mutex_unlock(&bus_lock);
+	return bus;
+}
+
+static void hali2c_kernel_bus_put(struct hali2c_kernel_bus *bus)
+{
+	pthread_mutex_lock(&bus_lock);
+
+	if (--bus->refs == 0) {
+		close(bus->i2c_fd);
+		bus->i2c_fd = -1;
+		bus->i2c_device[0] = '\0';
 	}
 
+	pthread_mutex_unlock(&bus_lock);
+}
+
+static int hali2c_kernel_open(struct hali2c_kernel_dev *dev)
+{
+	dev->bus = hali2c_kernel_bus_get(dev->i2c_device);
+	if (!dev->bus)
+		return -ENODEV;
+
 	return 0;
 }
 
-static int hali2c_kernel_read(struct hali2c_dev* device, unsigned char* buf, size_t len)
+/*
+ * Single message transfer to the slave.
+ * Returns len on success, or -ve on error.
+ */
+static int hali2c_kernel_xfer(struct hali2c_kernel_dev *dev, unsigned char* buf,
+	size_t len, uint16_t flags)
 {
-	struct hali2c_kernel_dev *dev = container_of(device, struct hali2c_kernel_dev, device);
+	struct i2c_msg msg = {
+		.addr = (uint16_t)dev->i2c_addr,
+		.flags = flags,
+		.len = (uint16_t)len,
+		.buf = buf,
+	};
+	struct i2c_rdwr_ioctl_data data = {
+		.msgs = &msg,
+		.nmsgs = 1,
+	};
 
-	ssize_t sret = read(dev->i2c_fd, buf, len);
-	if (sret < 0)
+	if (ioctl(dev->bus->i2c_fd, I2C_RDWR, &data) < 0)
 		return -errno;
 
-	return (int)sret;
+	return (int)len;
 }
 
-static int hali2c_kernel_write(struct hali2c_dev* device, const unsigned char* buf, size_t len)
+int hali2c_kernel_read(struct hali2c_dev* device, unsigned char* buf, size_t len)
 {
 	struct hali2c_kernel_dev *dev = container_of(device, struct hali2c_kernel_dev, device);
 
-	ssize_t sret = write(dev->i2c_fd, buf, len);
-	if (sret < 0)
-		return -errno;
+	return hali2c_kernel_xfer(dev, buf, len, I2C_M_RD);
+}
 
-	return (int)sret;
+int hali2c_kernel_write(struct hali2c_dev* device, const unsigned char* buf, size_t len)
+{
+	struct hali2c_kernel_dev *dev = container_of(device, struct hali2c_kernel_dev, device);
+
+	return hali2c_kernel_xfer(dev, (unsigned char*)buf, len, 0);
 }
 
 void hali2c_kernel_close(struct hali2c_dev* device)
 {
 	struct hali2c_kernel_dev *dev = container_of(device, struct hali2c_kernel_dev, device);
 
-	if (dev->i2c_fd >= 0) {
-		close(dev->i2c_fd);
-		dev->i2c_fd = -1;
+	if (dev->bus) {
+		hali2c_kernel_bus_put(dev->bus);
+		dev->bus = NULL;
 	}
 }
 
+int hali2c_kernel_slave_fd(struct hali2c_dev* device)
+{
+	struct hali2c_kernel_dev *dev = container_of(device, struct hali2c_kernel_dev, device);
+	int fd;
+
+	fd = open(dev->i2c_device, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		Log3(PCSC_LOG_ERROR, "Could not open I2C device %s (%d)",
+			dev->i2c_device, errno);
+		return -errno;
+	}
+
+	/* Set the slave address */
+	if (ioctl(fd, I2C_SLAVE, dev->i2c_addr) < 0) {
+		int ret = -errno;
+		Log2(PCSC_LOG_ERROR, "Could not set I2C address: %d",
+			dev->i2c_addr);
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
 struct hali2c_dev* hali2c_open_kernel(char* config)
 {
 	int ret;
@@ -18,6 +18,24 @@
 #ifndef HALI2C_KERNEL_H_
 #define HALI2C_KERNEL_H_
 
+#include <stddef.h>
+
+struct hali2c_dev;
+
 struct hali2c_dev* hali2c_open_kernel(char* config);
 
+/*
+ * Read and write callbacks of the provider (called directly by
+ * hali2c_read() and hali2c_write() in HALI2C_ONLY_KERNEL builds).
+ */
+int hali2c_kernel_read(struct hali2c_dev* device, unsigned char* buf, size_t len);
+int hali2c_kernel_write(struct hali2c_dev* device, const unsigned char* buf, size_t len);
+
+/*
+ * Open a new file descriptor of the I2C device, which is bound to the
+ * slave address (for read()/write()). The caller has to close it.
+ * Returns the fd on success, or -ve on error.
+ */
+int hali2c_kernel_slave_fd(struct hali2c_dev* device);
+
 #endif /* HALI2C_KERNEL_H_ */
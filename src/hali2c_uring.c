@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * I2C access via /dev/i2c-N like the "kernel" provider, but delayed
+ * transfers (guard times and poll intervals followed by a transfer)
+ * are submitted to an io_uring as one linked chain:
+ *
+ *   TIMEOUT(delay) --hardlink--> READ/WRITE
+ *
+ * This needs a single syscall instead of a sleep plus a transfer.
+ * The ring is set up with the raw syscalls (no liburing needed).
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <debuglog.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "helpers.h"
+#include "hali2c.h"
+#include "hali2c_kernel.h"
+#include "hali2c_uring.h"
+
+#define RING_ENTRIES 4
+
+struct hali2c_uring_dev
+{
+	/* Embed hali2c device */
+	struct hali2c_dev device;
+	/* Underlying kernel device (plain transfers) */
+	struct hali2c_dev *kernel_dev;
+	int i2c_fd; /* Bound to the slave address (delayed transfers) */
+	/* Ring state */
+	int ring_fd;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
+
+static void hali2c_uring_unmap(struct hali2c_uring_dev *dev)
+{
+	if (dev->sqes)
+		munmap(dev->sqes, dev->sqes_size);
+	if (dev->cq_ptr && dev->cq_ptr != dev->sq_ptr)
+		munmap(dev->cq_ptr, dev->cq_size);
+	if (dev->sq_ptr)
+		munmap(dev->sq_ptr, dev->sq_size);
+	if (dev->ring_fd >= 0)
+		close(dev->ring_fd);
+
+	dev->sqes = NULL;
+	dev->cq_ptr = NULL;
+	dev->sq_ptr = NULL;
+	dev->ring_fd = -1;
+}
+
+static int hali2c_uring_setup(struct hali2c_uring_dev *dev)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	dev->ring_fd = io_uring_setup(RING_ENTRIES, &p);
+	if (dev->ring_fd < 0) {
+		Log2(PCSC_LOG_ERROR, "Could not set up io_uring: %d", errno);
+		return -errno;
+	}
+
+	dev->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	dev->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (dev->cq_size > dev->sq_size)
+			dev->sq_size = dev->cq_size;
+		dev->cq_size = dev->sq_size;
+	}
+
+	dev->sq_ptr = mmap(NULL, dev->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, dev->ring_fd, IORING_OFF_SQ_RING);
+	if (dev->sq_ptr == MAP_FAILED) {
+		dev->sq_ptr = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		dev->cq_ptr = dev->sq_ptr;
+	} else {
+		dev->cq_ptr = mmap(NULL, dev->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, dev->ring_fd, IORING_OFF_CQ_RING);
+		if (dev->cq_ptr == MAP_FAILED) {
+			dev->cq_ptr = NULL;
+			goto err;
+		}
+	}
+
+	dev->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	dev->sqes = mmap(NULL, dev->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, dev->ring_fd, IORING_OFF_SQES);
+	if (dev->sqes == MAP_FAILED) {
+		dev->sqes = NULL;
+		goto err;
+	}
+
+	dev->sq_tail = (unsigned *)((char *)dev->sq_ptr + p.sq_off.tail);
+	dev->sq_mask = (unsigned *)((char *)dev->sq_ptr + p.sq_off.ring_mask);
+	dev->sq_array = (unsigned *)((char *)dev->sq_ptr + p.sq_off.array);
+	dev->cq_head = (unsigned *)((char *)dev->cq_ptr + p.cq_off.head);
+	dev->cq_tail = (unsigned *)((char *)dev->cq_ptr + p.cq_off.tail);
+	dev->cq_mask = (unsigned *)((char *)dev->cq_ptr + p.cq_off.ring_mask);
+	dev->cqes = (struct io_uring_cqe *)((char *)dev->cq_ptr + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	Log2(PCSC_LOG_ERROR, "Could not map io_uring: %d", errno);
+	hali2c_uring_unmap(dev);
+	return -ENOMEM;
+}
+
+static struct io_uring_sqe* hali2c_uring_push(struct hali2c_uring_dev *dev,
+	unsigned *tail)
+{
+	unsigned idx = *tail & *dev->sq_mask;
+	struct io_uring_sqe *sqe = &dev->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	dev->sq_array[idx] = idx;
+	(*tail)++;
+
+	return sqe;
+}
+
+/*
+ * Submit TIMEOUT(delay_us) hardlinked to the transfer and wait for both.
+ * Returns the result of the transfer.
+ */
+static int hali2c_uring_xfer(struct hali2c_uring_dev *dev, uint8_t opcode,
+	void *buf, size_t len, size_t delay_us)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = delay_us / 1000000,
+		.tv_nsec = (delay_us % 1000000) * 1000,
+	};
+	struct io_uring_sqe *sqe;
+	unsigned tail = *dev->sq_tail;
+	unsigned n_done = 0;
+	int res = -EIO;
+
+	sqe = hali2c_uring_push(dev, &tail);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&ts;
+	sqe->len = 1;
+	/* An expired timeout fails with -ETIME, so a soft link would break. */
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->user_data = 0;
+
+	sqe = hali2c_uring_push(dev, &tail);
+	sqe->opcode = opcode;
+	sqe->fd = dev->i2c_fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = 1;
+
+	__atomic_store_n(dev->sq_tail, tail, __ATOMIC_RELEASE);
+
+	int ret = io_uring_enter(dev->ring_fd, 2, 2, IORING_ENTER_GETEVENTS);
+	while (n_done < 2) {
+		if (ret < 0 && errno != EINTR) {
+			Log2(PCSC_LOG_ERROR, "io_uring_enter failed: %d", errno);
+			return -errno;
+		}
+
+		unsigned head = *dev->cq_head;
+		while (head != __atomic_load_n(dev->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &dev->cqes[head & *dev->cq_mask];
+			if (cqe->user_data == 1)
+				res = cqe->res;
+			head++;
+			n_done++;
+		}
+		__atomic_store_n(dev->cq_head, head, __ATOMIC_RELEASE);
+
+		if (n_done < 2)
+			ret = io_uring_enter(dev->ring_fd, 0, 2 - n_done, IORING_ENTER_GETEVENTS);
+	}
+
+	return res;
+}
+
+static int hali2c_uring_read(struct hali2c_dev* device, unsigned char* buf, size_t len)
+{
+	struct hali2c_uring_dev *dev = container_of(device, struct hali2c_uring_dev, device);
+
+	return hali2c_read(dev->kernel_dev, buf, len);
+}
+
+static int hali2c_uring_write(struct hali2c_dev* device, const unsigned char* buf, size_t len)
+{
+	struct hali2c_uring_dev *dev = container_of(device, struct hali2c_uring_dev, device);
+
+	return hali2c_write(dev->kernel_dev, buf, len);
+}
+
+static int hali2c_uring_read_delayed(struct hali2c_dev* device, unsigned char* buf,
+	size_t len, size_t delay_us)
+{
+	struct hali2c_uring_dev *dev = container_of(device, struct hali2c_uring_dev, device);
+
+	return hali2c_uring_xfer(dev, IORING_OP_READ, buf, len, delay_us);
+}
+
+static int hali2c_uring_write_delayed(struct hali2c_dev* device, const unsigned char* buf,
+	size_t len, size_t delay_us)
+{
+	struct hali2c_uring_dev *dev = container_of(device, struct hali2c_uring_dev, device);
+
+	return hali2c_uring_xfer(dev, IORING_OP_WRITE, (void *)buf, len, delay_us);
+}
+
+static void hali2c_uring_close(struct hali2c_dev* device)
+{
+	struct hali2c_uring_dev *dev = container_of(device, struct hali2c_uring_dev, device);
+
+	hali2c_uring_unmap(dev);
+	close(dev->i2c_fd);
+	hali2c_close(dev->kernel_dev);
+}
+
+struct hali2c_dev* hali2c_open_uring(char* config)
+{
+	int ret;
+	struct hali2c_uring_dev *dev;
+
+	if (!config)
+		return NULL;
+
+	Log2(PCSC_LOG_DEBUG, "Trying to create device with config: '%s'", config);
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+	dev->ring_fd = -1;
+
+	/* Same configuration string as the "kernel" provider. */
+	dev->kernel_dev = hali2c_open_kernel(config);
+	if (!dev->kernel_dev) {
+		free(dev);
+		return NULL;
+	}
+	dev->i2c_fd = hali2c_kernel_slave_fd(dev->kernel_dev);
+	if (dev->i2c_fd < 0) {
+		hali2c_close(dev->kernel_dev);
+		free(dev);
+		return NULL;
+	}
+
+	ret = hali2c_uring_setup(dev);
+	if (ret) {
+		Log1(PCSC_LOG_ERROR, "device can't be opened!");
+		close(dev->i2c_fd);
+		hali2c_close(dev->kernel_dev);
+		free(dev);
+		return NULL;
+	}
+
+	dev->device.read = hali2c_uring_read;
+	dev->device.write = hali2c_uring_write;
+	dev->device.close = hali2c_uring_close;
+	dev->device.read_delayed = hali2c_uring_read_delayed;
+	dev->device.write_delayed = hali2c_uring_write_delayed;
+
+	return &dev->device;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+
+#include <debuglog.h>
+
+#include "halsched.h"
+#include "helpers.h"
+
+#define TASK_STACK_SIZE (64 * 1024)
+
+/* Task, which is currently running on this thread (if any). */
+static __thread struct halsched_task *current_task;
+
+/* Timer slack of this thread in us (-1: not yet queried). */
+static __thread long timer_slack_us = -1;
+
+static int halsched_nanosleep_us(size_t us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	while (nanosleep(&ts, &ts)) {
+		if (errno != EINTR)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Sleep precisely (used for short waits like I2C guard times).
+ * nanosleep() may oversleep by the timer slack (50us by default),
+ * so we sleep until one slack before the end and spin for the rest.
+ * Waits below HALSCHED_SPIN_MAX_US are spun completely.
+ */
+static int halsched_precise_sleep_us(size_t us)
+{
+	uint64_t end = monotonic_us() + us;
+	int ret;
+
+	if (timer_slack_us < 0) {
+		int slack_ns = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+		timer_slack_us = slack_ns > 0 ? slack_ns / 1000 : 0;
+	}
+
+	if (us > HALSCHED_SPIN_MAX_US + (size_t)timer_slack_us) {
+		ret = halsched_nanosleep_us(us - timer_slack_us);
+		if (ret)
+			return ret;
+	}
+
+	while (monotonic_us() < end)
+		;
+
+	return 0;
+}
+
+int halsched_sleep_us(size_t us)
+{
+	struct halsched_task *task = current_task;
+
+	if (!us)
+		return 0;
+
+	if (us < HALSCHED_PRECISE_MAX_US && (!task || us < HALSCHED_YIELD_MIN_US))
+		return halsched_precise_sleep_us(us);
+
+	if (!task)
+		return halsched_nanosleep_us(us);
+
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = us / 1000000,
+			.tv_nsec = (us % 1000000) * 1000,
+		},
+	};
+
+	if (timerfd_settime(task->timer_fd, 0, &its, NULL)) {
+		Log2(PCSC_LOG_ERROR, "Arming timer failed: %d", errno);
+		return -errno;
+	}
+
+	/* Return to the event loop until the timer expires. */
+	current_task = NULL;
+	swapcontext(&task->ctx, &task->caller);
+
+	return 0;
+}
+
+bool halsched_in_task(void)
+{
+	return current_task != NULL;
+}
+
+int halsched_task_init(struct halsched_task *task)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	memset(task, 0, sizeof(*task));
+	task->timer_fd = -1;
+
+	task->stack_size = TASK_STACK_SIZE;
+	task->stack = mmap(NULL, task->stack_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (task->stack == MAP_FAILED) {
+		task->stack = NULL;
+		Log1(PCSC_LOG_ERROR, "Could not allocate task stack!");
+		return -ENOMEM;
+	}
+
+	/* Guard page to catch stack overflows. */
+	if (mprotect(task->stack, page_size, PROT_NONE)) {
+		Log2(PCSC_LOG_ERROR, "Could not protect guard page: %d", errno);
+		halsched_task_release(task);
+		return -errno;
+	}
+
+	task->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (task->timer_fd < 0) {
+		Log2(PCSC_LOG_ERROR, "Could not create timer: %d", errno);
+		halsched_task_release(task);
+		return -errno;
+	}
+
+	return 0;
+}
+
+int halsched_task_lock(struct halsched_task *task)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (mlock((char *)task->stack + page_size, task->stack_size - page_size))
+		return -errno;
+
+	return 0;
+}
+
+void halsched_task_release(struct halsched_task *task)
+{
+	if (task->timer_fd >= 0) {
+		close(task->timer_fd);
+		task->timer_fd = -1;
+	}
+
+	if (task->stack) {
+		munmap(task->stack, task->stack_size);
+		task->stack = NULL;
+	}
+}
+
+static void halsched_task_entry(void)
+{
+	struct halsched_task *task = current_task;
+
+	task->fn(task);
+
+	/* Returns to task->caller (uc_link). */
+	task->finished = true;
+	current_task = NULL;
+}
+
+int halsched_task_resume(struct halsched_task *task)
+{
+	uint64_t expirations;
+
+	/* Acknowledge the timer. */
+	if (read(task->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		Log2(PCSC_LOG_ERROR, "Reading timer failed: %d", errno);
+
+	current_task = task;
+	swapcontext(&task->caller, &task->ctx);
+	current_task = NULL;
+
+	return task->finished;
+}
+
+int halsched_task_start(struct halsched_task *task,
+	void (*fn)(struct halsched_task *task))
+{
+	getcontext(&task->ctx);
+	task->ctx.uc_stack.ss_sp = task->stack;
+	task->ctx.uc_stack.ss_size = task->stack_size;
+	task->ctx.uc_link = &task->caller;
+	task->fn = fn;
+	task->finished = false;
+	makecontext(&task->ctx, halsched_task_entry, 0);
+
+	current_task = task;
+	swapcontext(&task->caller, &task->ctx);
+	current_task = NULL;
+
+	return task->finished;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSCHED_H_
+#define HALSCHED_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <ucontext.h>
+
+/*
+ * All waits of the protocol drivers (poll intervals, guard times,...)
+ * go through halsched_sleep_us(). When the code runs inside a task,
+ * the task is suspended and its timer fd is armed instead, so that an
+ * event loop can drive many tasks from a single thread.
+ */
+
+/* Waits shorter than this are done in place (also inside a task). */
+#define HALSCHED_YIELD_MIN_US 100
+
+/* Waits shorter than this are timed precisely (timer slack compensated). */
+#define HALSCHED_PRECISE_MAX_US 1000
+
+/* Waits shorter than this are busy-waited. */
+#define HALSCHED_SPIN_MAX_US 50
+
+struct halsched_task {
+	ucontext_t ctx; /* Context of the task */
+	ucontext_t caller; /* Context which resumed the task */
+	void *stack;
+	size_t stack_size;
+	int timer_fd; /* Armed while the task is suspended */
+	bool finished;
+	void (*fn)(struct halsched_task *task);
+};
+
+/*
+ * Wait for the given time.
+ * Inside a task this suspends the task until its timer fd expires,
+ * otherwise the calling thread sleeps.
+ *
+ * Returns 0 on success, or -ve on error.
+ */
+int halsched_sleep_us(size_t us);
+
+/* Returns true if the caller runs inside a task. */
+bool halsched_in_task(void);
+
+/*
+ * Allocate the stack and the timer fd of a task.
+ *
+ * Returns 0 on success, or -ve on error.
+ */
+int halsched_task_init(struct halsched_task *task);
+
+/*
+ * Lock the stack of the task (without its guard page) into memory.
+ *
+ * Returns 0 on success, or -ve on error.
+ */
+int halsched_task_lock(struct halsched_task *task);
+
+/*
+ * Free all resources of a (not running) task.
+ */
+void halsched_task_release(struct halsched_task *task);
+
+/*
+ * Start fn in the task and run it until it waits or finishes.
+ *
+ * Returns 1 if the task has finished, 0 if it is suspended.
+ */
+int halsched_task_start(struct halsched_task *task,
+	void (*fn)(struct halsched_task *task));
+
+/*
+ * Resume a suspended task (after its timer fd expired)
+ * and run it until it waits again or finishes.
+ *
+ * Returns 1 if the task has finished, 0 if it is suspended.
+ */
+int halsched_task_resume(struct halsched_task *task);
+
+#endif /* HALSCHED_H_ */
@@ -16,26 +16,190 @@
  */
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include <debuglog.h>
 
 #include "halse.h"
+#include "halse_async.h"
+#include "halse_reactor.h"
+#include "halse_cache.h"
+#include "halse_select.h"
+#include "halse_slots.h"
+#include "halse_presence.h"
+#include "halse_health.h"
+#include "halse_reset.h"
 #include "helpers.h"
 #include "halse_kerkey.h"
 #include "halse_se05x.h"
+#include "halse_pool.h"
+#include "halse_broker_dev.h"
 
+/*
+ * Builds with HALSE_ONLY_SE05X or HALSE_ONLY_KERKEY
+ * only contain the given protocol (see src/Makefile).
+ */
+#ifndef HALSE_ONLY_SE05X
 static const char* halse_kerkey_id = "kerkey";
+#endif
+#ifndef HALSE_ONLY_KERKEY
 static const char* halse_se05x_id = "se05x";
+#endif
+static const char* halse_pool_id = "pool";
+static const char* halse_broker_id = "broker";
+
+/* Max. number of slots of a reader. */
+#define MAX_READER_SLOTS 8
+
+/* Interval, after which a failed SE is reported as present again. */
+#define RECOVERY_INTERVAL_MS 1000
 
 struct lun_se {
 	bool in_use;
+	bool closed; /* Waits for the other slots of the reader to be closed */
 	DWORD lun;
 	struct halse_dev *dev;
+	struct halse_dev *primary; /* Slot 0 of the reader */
+	bool owner; /* dev has been created by halse_create() */
+	size_t n_slots; /* Slots of the reader */
 };
 
 static struct lun_se lun_se_array[MAX_SE_DEVICES];
 
-static struct halse_dev* halse_parse(char* config)
+/* Provider independent options. */
+struct halse_opts {
+	size_t reactor_threads; /* 0...no reactor */
+	struct halse_rt rt;
+	struct halse_cache *cache; /* NULL...no response cache */
+	bool elide_select;
+	size_t slots; /* 0...one slot */
+	size_t health_ms; /* 0...no health monitor */
+	size_t reset_window_ms; /* 0...no coalescing of resets */
+	bool reset_by_atr;
+};
+
+/*
+ * Parse a single provider independent option.
+ * Returns 1 if the token was consumed, 0 if not, or -ve on error.
+ */
+static int halse_parse_opt(char *p, struct halse_opts *opts)
+{
+	if (strcmp("reactor", p) == 0) {
+		opts->reactor_threads = 1;
+	} else if (starts_with("reactor:", p)) {
+		char *endptr;
+		p = strchr(p, ':');
+		p++;
+		errno = 0;
+		opts->reactor_threads = strtoul(p, &endptr, 0);
+		if (errno != 0 || p == endptr || opts->reactor_threads == 0 ||
+		    opts->reactor_threads > MAX_REACTOR_THREADS) {
+			Log2(PCSC_LOG_ERROR, "Invalid reactor threads: '%s'", p);
+			return -1;
+		}
+	} else if (starts_with("prio:", p)) {
+		char *endptr;
+		p = strchr(p, ':');
+		p++;
+		errno = 0;
+		opts->rt.prio = (int)strtol(p, &endptr, 0);
+		if (errno != 0 || p == endptr || opts->rt.prio < 1 || opts->rt.prio > 99) {
+			Log2(PCSC_LOG_ERROR, "Invalid priority: '%s'", p);
+			return -1;
+		}
+	} else if (starts_with("cpus:", p)) {
+		p = strchr(p, ':');
+		p++;
+		if (halse_rt_parse_cpus(p, &opts->rt.cpumask)) {
+			Log2(PCSC_LOG_ERROR, "Invalid CPU list: '%s'", p);
+			return -1;
+		}
+	} else if (strcmp("mlock", p) == 0) {
+		opts->rt.mlock = true;
+	} else if (starts_with("slots:", p)) {
+		char *endptr;
+		p = strchr(p, ':');
+		p++;
+		errno = 0;
+		opts->slots = strtoul(p, &endptr, 0);
+		if (errno != 0 || p == endptr || opts->slots == 0 ||
+		    opts->slots > MAX_SE_SLOTS) {
+			Log2(PCSC_LOG_ERROR, "Invalid number of slots: '%s'", p);
+			return -1;
+		}
+	} else if (starts_with("health:", p)) {
+		char *endptr;
+		p = strchr(p, ':');
+		p++;
+		errno = 0;
+		opts->health_ms = strtoul(p, &endptr, 0);
+		if (errno != 0 || p == endptr || opts->health_ms == 0) {
+			Log2(PCSC_LOG_ERROR, "Invalid health monitor idle time: '%s'", p);
+			return -1;
+		}
+	} else if (starts_with("reset-window:", p)) {
+		char *endptr;
+		p = strchr(p, ':');
+		p++;
+		errno = 0;
+		opts->reset_window_ms = strtoul(p, &endptr, 0);
+		if (errno != 0 || p == endptr || opts->reset_window_ms == 0) {
+			Log2(PCSC_LOG_ERROR, "Invalid reset window: '%s'", p);
+			return -1;
+		}
+	} else if (strcmp("reset-by-atr", p) == 0) {
+		opts->reset_by_atr = true;
+	} else if (strcmp("elide-select", p) == 0) {
+		opts->elide_select = true;
+	} else if (starts_with("cache:", p)) {
+		p = strchr(p, ':');
+		p++;
+		if (!opts->cache)
+			opts->cache = halse_cache_create();
+		if (!opts->cache || halse_cache_add_pattern(opts->cache, p))
+			return -1;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Parse and remove the provider independent options from args,
+ * so that the providers only see their own tokens.
+ */
+static int halse_parse_opts(char *args, struct halse_opts *opts)
+{
+	char *r = args, *w = args;
+
+	while (r) {
+		char *next = strchr(r, '@');
+		if (next)
+			*next++ = '\0';
+
+		int ret = halse_parse_opt(r, opts);
+		if (ret < 0)
+			return ret;
+
+		if (ret == 0) {
+			size_t len = strlen(r);
+			if (w != args)
+				*w++ = '@';
+			memmove(w, r, len);
+			w += len;
+		}
+
+		r = next;
+	}
+	*w = '\0';
+
+	return 0;
+}
+
+static struct halse_dev* halse_parse(char* config, struct halse_opts *opts)
 {
 	char *p = config;
 
@@ -52,10 +216,23 @@ static struct halse_dev* halse_parse(char* config)
 	if (args)
 		args++;
 
+	/* The members of a pool have their own options. */
+	if (starts_with(halse_pool_id, p))
+		return halse_open_pool(args);
+
+	if (args && halse_parse_opts(args, opts))
+		return NULL;
+
+#ifndef HALSE_ONLY_SE05X
 	if (starts_with(halse_kerkey_id, p))
 		return halse_open_kerkey(args);
-	else if (starts_with(halse_se05x_id, p))
+#endif
+#ifndef HALSE_ONLY_KERKEY
+	if (starts_with(halse_se05x_id, p))
 		return halse_open_se05x(args);
+#endif
+	if (starts_with(halse_broker_id, p))
+		return halse_open_broker(args);
 
 	Log2(PCSC_LOG_ERROR, "Unknown SE provider: '%s'!", p);
 	return NULL;
@@ -67,30 +244,346 @@ bool halse_exists(DWORD lun)
 
 	for (i=0; i<MAX_SE_DEVICES; i++) {
 		struct lun_se* ls = &lun_se_array[i];
-		if (ls->in_use && ls->lun == lun)
+		if (ls->in_use && !ls->closed && ls->lun == lun)
 			return true;
 	}
 
 	return false;
 }
 
+static struct halse_dev* halse_create_opts(char* config, struct halse_opts *opts)
+{
+	struct halse_dev *dev;
+
+	dev = halse_parse(config, opts);
+	if (!dev) {
+		halse_cache_destroy(opts->cache);
+		return NULL;
+	}
+	dev->rt = opts->rt;
+	dev->cache = opts->cache;
+
+	if (opts->elide_select) {
+		dev->select = halse_select_create();
+		if (!dev->select)
+			goto err;
+	}
+
+	if (opts->reset_by_atr && !dev->refresh_atr) {
+		Log1(PCSC_LOG_ERROR, "SE can't get the ATR without a reset!");
+		goto err;
+	}
+
+	if (opts->reset_window_ms || opts->reset_by_atr) {
+		dev->reset = halse_reset_create(opts->reset_window_ms, opts->reset_by_atr);
+		if (!dev->reset)
+			goto err;
+	}
+
+	if (opts->health_ms) {
+		dev->health = halse_health_create(dev, opts->health_ms);
+		if (!dev->health)
+			goto err;
+	}
+
+	/*
+	 * Never change the scheduling of the calling (pcscd) thread,
+	 * but run the I/O of the SE on a reactor thread instead.
+	 */
+	if (halse_rt_enabled(&dev->rt) && !opts->reactor_threads)
+		opts->reactor_threads = 1;
+
+	/* Only the memory of the SE, not all of pcscd. */
+	halse_rt_lock(&dev->rt, dev->mem, dev->mem_len);
+
+	if (opts->reactor_threads &&
+	    halse_reactor_attach(dev, opts->reactor_threads)) {
+		Log1(PCSC_LOG_ERROR, "Could not attach device to reactor!");
+		goto err;
+	}
+
+	return dev;
+
+err:
+	halse_health_destroy(dev->health);
+	halse_reset_destroy(dev->reset);
+	halse_select_destroy(dev->select);
+	halse_cache_destroy(dev->cache);
+	dev->close(dev);
+	return NULL;
+}
+
+struct halse_dev* halse_create(char* config)
+{
+	struct halse_opts opts = {0};
+	struct halse_dev *dev;
+
+	if (!config)
+		return NULL;
+
+	dev = halse_create_opts(config, &opts);
+	if (dev && opts.slots > 1) {
+		Log1(PCSC_LOG_ERROR, "Slots are only supported for readers!");
+		halse_destroy(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+void halse_destroy(struct halse_dev *dev)
+{
+	halse_health_destroy(dev->health);
+	halse_reset_destroy(dev->reset);
+	halse_reactor_detach(dev);
+	halse_async_release(dev);
+	halse_select_destroy(dev->select);
+	halse_cache_destroy(dev->cache);
+	dev->close(dev);
+}
+
+/* Keep the health monitor (if any) away from the SE. */
+static void halse_begin(struct halse_dev *dev)
+{
+	if (dev->health)
+		halse_health_begin(dev->health);
+}
+
+static void halse_end(struct halse_dev *dev)
+{
+	if (dev->health)
+		halse_health_end(dev->health);
+}
+
+/* Forget the state of the SE before a power or reset action. */
+static void halse_forget_state(struct halse_dev *dev)
+{
+	if (dev->cache)
+		halse_cache_flush(dev->cache);
+	if (dev->select)
+		halse_select_reset(dev->select);
+}
+
+int halse_power_up(struct halse_dev *dev)
+{
+	int ret;
+
+	halse_begin(dev);
+	if (dev->reset && halse_reset_coalesce(dev->reset)) {
+		halse_end(dev);
+		return 0;
+	}
+	halse_forget_state(dev);
+	ret = dev->power_up(dev);
+	if (dev->reset)
+		halse_reset_done(dev->reset, ret, false);
+	if (dev->presence)
+		halse_presence_power(dev->presence, ret);
+	if (dev->health)
+		halse_health_powered(dev->health, ret == 0);
+	halse_end(dev);
+
+	return ret;
+}
+
+int halse_power_down(struct halse_dev *dev)
+{
+	int ret;
+
+	halse_begin(dev);
+	halse_forget_state(dev);
+	ret = dev->power_down(dev);
+	if (dev->reset)
+		halse_reset_used(dev->reset);
+	if (dev->health)
+		halse_health_powered(dev->health, false);
+	halse_end(dev);
+
+	return ret;
+}
+
+static int halse_warm_reset_policy(struct halse_dev *dev, bool policy)
+{
+	bool by_atr = false;
+	int ret = -1;
+
+	halse_begin(dev);
+
+	if (policy && dev->reset) {
+		if (halse_reset_coalesce(dev->reset)) {
+			halse_end(dev);
+			return 0;
+		}
+
+		/* The SE keeps its state, so do the cache and the tracker. */
+		if (halse_reset_by_atr(dev->reset)) {
+			ret = dev->refresh_atr(dev);
+			by_atr = ret == 0;
+		}
+	}
+
+	if (!by_atr) {
+		halse_forget_state(dev);
+		ret = dev->warm_reset(dev);
+	}
+
+	if (dev->reset)
+		halse_reset_done(dev->reset, ret, by_atr);
+	if (dev->presence)
+		halse_presence_power(dev->presence, ret);
+	if (dev->health)
+		halse_health_powered(dev->health, ret == 0);
+	halse_end(dev);
+
+	return ret;
+}
+
+int halse_warm_reset(struct halse_dev *dev)
+{
+	return halse_warm_reset_policy(dev, true);
+}
+
+int halse_force_reset(struct halse_dev *dev)
+{
+	return halse_warm_reset_policy(dev, false);
+}
+
+bool halse_present(struct halse_dev *dev)
+{
+	return !dev->presence || halse_presence_present(dev->presence);
+}
+
+void halse_wait_event(struct halse_dev *dev, int timeout_ms)
+{
+	if (!dev->presence)
+		return;
+
+	if (halse_presence_present(dev->presence)) {
+		halse_presence_wait(dev->presence, timeout_ms);
+		return;
+	}
+
+	if (timeout_ms <= 0 || timeout_ms > RECOVERY_INTERVAL_MS)
+		timeout_ms = RECOVERY_INTERVAL_MS;
+
+	/*
+	 * This runs in PCSC lite's polling thread, which doesn't hold the
+	 * reader lock, so don't touch the SE here. Instead, report it as
+	 * present again, so that PCSC lite powers it up (which recovers it
+	 * or marks it as failed again).
+	 */
+	if (halse_presence_wait(dev->presence, timeout_ms) == 0)
+		halse_presence_retry(dev->presence);
+}
+
+void halse_stop_wait(struct halse_dev *dev)
+{
+	if (dev->presence)
+		halse_presence_stop(dev->presence);
+}
+
+/*
+ * Create the SE described by config and append its slots.
+ * Returns 0 on success, or -ve on error.
+ */
+static int halse_open_slots(char* config, struct halse_dev **slots,
+	bool *owner, size_t *n_slots)
+{
+	struct halse_opts opts = {0};
+	struct halse_dev *dev;
+	size_t n;
+
+	dev = halse_create_opts(config, &opts);
+	if (!dev)
+		return -ENODEV;
+
+	n = opts.slots ? opts.slots : 1;
+	if (*n_slots + n > MAX_READER_SLOTS) {
+		Log1(PCSC_LOG_ERROR, "Too many slots!");
+		halse_destroy(dev);
+		return -ENOSPC;
+	}
+
+	if (n > 1) {
+		if (halse_slots_create(dev, n, &slots[*n_slots])) {
+			halse_destroy(dev);
+			return -ENOMEM;
+		}
+	} else {
+		slots[*n_slots] = dev;
+	}
+
+	/* The first slot owns the SE (and the further slots of it). */
+	owner[*n_slots] = true;
+	*n_slots += n;
+
+	return 0;
+}
+
 struct halse_dev* halse_open(DWORD lun, char* config)
 {
-	size_t i;
+	struct halse_dev *slots[MAX_READER_SLOTS];
+	bool owner[MAX_READER_SLOTS] = {0};
+	size_t n_slots = 0, i, j;
+	char *p = config;
 
 	if (!config)
 		return NULL;
 
-	for (i=0; i<MAX_SE_DEVICES; i++) {
+	/* The SEs of the reader are separated by ';'. */
+	while (p) {
+		char *next = strchr(p, ';');
+		if (next)
+			*next++ = '\0';
+
+		if (halse_open_slots(p, slots, owner, &n_slots))
+			goto err;
+
+		p = next;
+	}
+
+	for (j=0; j<n_slots; j++) {
+		slots[j]->presence = halse_presence_create();
+		if (!slots[j]->presence)
+			goto err;
+	}
+
+	/* Slot j of the reader uses the lun (lun & 0xFFFF0000) + j. */
+	for (i=0, j=0; i<MAX_SE_DEVICES && j<n_slots; i++) {
 		struct lun_se* ls = &lun_se_array[i];
 		if (!ls->in_use) {
 			ls->in_use = 1;
-			ls->lun = lun;
-			ls->dev = halse_parse(config);
-			return ls->dev;
+			ls->lun = j ? (lun & 0xFFFF0000) + j : lun;
+			ls->dev = slots[j];
+			ls->primary = slots[0];
+			ls->owner = owner[j];
+			ls->n_slots = n_slots;
+			j++;
+		}
+	}
+
+	if (j < n_slots) {
+		Log1(PCSC_LOG_ERROR, "Too many SEs!");
+		for (i=0; i<MAX_SE_DEVICES; i++) {
+			struct lun_se* ls = &lun_se_array[i];
+			if (ls->in_use && ls->primary == slots[0])
+				ls->in_use = 0;
 		}
+		goto err;
 	}
 
+	if (n_slots > 1)
+		Log3(PCSC_LOG_INFO, "Reader 0x%lx has %zu slots", lun, n_slots);
+
+	return slots[0];
+
+err:
+	for (i=n_slots; i-->0;) {
+		halse_presence_destroy(slots[i]->presence);
+		slots[i]->presence = NULL;
+		if (owner[i])
+			halse_destroy(slots[i]);
+	}
 	return NULL;
 }
 
@@ -100,23 +593,223 @@ struct halse_dev* halse_get(DWORD lun)
 
 	for (i=0; i<MAX_SE_DEVICES; i++) {
 		struct lun_se* ls = &lun_se_array[i];
-		if (ls->in_use && ls->lun == lun)
+		if (ls->in_use && !ls->closed && ls->lun == lun)
 			return ls->dev;
 	}
 
 	return NULL;
 }
 
-void halse_free(DWORD lun)
+size_t halse_slots_number(DWORD lun)
 {
 	size_t i;
 
 	for (i=0; i<MAX_SE_DEVICES; i++) {
 		struct lun_se* ls = &lun_se_array[i];
-		if (ls->lun == lun) {
-			ls->in_use = 0;
+		if (ls->in_use && !ls->closed && ls->lun == lun)
+			return ls->n_slots;
+	}
+
+	return 0;
+}
+
+void halse_close(DWORD lun)
+{
+	struct lun_se *slot = NULL;
+	size_t i;
+
+	for (i=0; i<MAX_SE_DEVICES; i++) {
+		struct lun_se* ls = &lun_se_array[i];
+		if (ls->in_use && !ls->closed && ls->lun == lun) {
+			slot = ls;
+			break;
+		}
+	}
+
+	if (!slot)
+		return;
+
+	/*
+	 * The other slots may still be in use (e.g. PCSC lite stops the
+	 * polling thread of a slot right before closing it), so the reader
+	 * is freed with its last slot.
+	 */
+	slot->closed = true;
+	for (i=0; i<MAX_SE_DEVICES; i++) {
+		struct lun_se* ls = &lun_se_array[i];
+		if (ls->in_use && !ls->closed && ls->primary == slot->primary)
 			return;
+	}
+
+	for (i=MAX_SE_DEVICES; i-->0;) {
+		struct lun_se* ls = &lun_se_array[i];
+		if (!ls->in_use || ls->primary != slot->primary || ls->dev == ls->primary)
+			continue;
+		halse_presence_destroy(ls->dev->presence);
+		ls->dev->presence = NULL;
+		/* Further slots of a SE are closed by its owner. */
+		if (ls->owner)
+			halse_destroy(ls->dev);
+		ls->in_use = 0;
+		ls->closed = false;
+	}
+
+	/* Slot 0 last, it is the primary of the others. */
+	for (i=0; i<MAX_SE_DEVICES; i++) {
+		struct lun_se* ls = &lun_se_array[i];
+		if (ls->in_use && ls->dev == slot->primary) {
+			halse_presence_destroy(ls->dev->presence);
+			ls->dev->presence = NULL;
+			halse_destroy(ls->dev);
+			ls->in_use = 0;
+			ls->closed = false;
 		}
 	}
 }
 
+/*
+ * Read a parameter of the provider independent options.
+ * Returns -ENOENT if the tag isn't handled here.
+ */
+static int halse_get_opt(struct halse_dev *dev, DWORD tag,
+	unsigned char *buf, size_t *len)
+{
+	switch (tag) {
+		case TAG_IFDSE_CACHE_ENTRIES:
+			if (!dev->cache)
+				return -ENOENT;
+			return put_param_u32(buf, len, halse_cache_entries(dev->cache));
+		case TAG_IFDSE_RESET_WINDOW_MS:
+			if (!dev->reset)
+				return -ENOENT;
+			return put_param_u32(buf, len, halse_reset_window(dev->reset));
+		case TAG_IFDSE_HEALTH_IDLE_MS:
+			if (!dev->health)
+				return -ENOENT;
+			return put_param_u32(buf, len, halse_health_idle(dev->health));
+		default:
+			return -ENOENT;
+	}
+}
+
+/*
+ * Change a parameter of the provider independent options.
+ * Returns -ENOENT if the tag isn't handled here.
+ */
+static int halse_set_opt(struct halse_dev *dev, DWORD tag,
+	const unsigned char *buf, size_t len)
+{
+	uint32_t v;
+	int ret;
+
+	if (tag != TAG_IFDSE_CACHE_ENTRIES && tag != TAG_IFDSE_RESET_WINDOW_MS &&
+	    tag != TAG_IFDSE_HEALTH_IDLE_MS)
+		return -ENOENT;
+
+	ret = get_param_u32(buf, len, &v);
+	if (ret)
+		return ret;
+
+	switch (tag) {
+		case TAG_IFDSE_CACHE_ENTRIES:
+			if (!dev->cache)
+				return -ENOENT;
+			return halse_cache_set_entries(dev->cache, v);
+		case TAG_IFDSE_RESET_WINDOW_MS:
+			if (!dev->reset)
+				return -ENOENT;
+			halse_reset_set_window(dev->reset, v);
+			return 0;
+		default:
+			if (!dev->health)
+				return -ENOENT;
+			if (v == 0)
+				return -EINVAL;
+			halse_health_set_idle(dev->health, v);
+			return 0;
+	}
+}
+
+int halse_get_param(struct halse_dev *dev, DWORD tag,
+	unsigned char *buf, size_t *len)
+{
+	int ret;
+
+	ret = halse_get_opt(dev, tag, buf, len);
+	if (ret != -ENOENT || !dev->get_param)
+		return ret;
+
+	halse_begin(dev);
+	ret = dev->get_param(dev, tag, buf, len);
+	halse_end(dev);
+
+	return ret;
+}
+
+int halse_set_param(struct halse_dev *dev, DWORD tag,
+	const unsigned char *buf, size_t len)
+{
+	int ret;
+
+	ret = halse_set_opt(dev, tag, buf, len);
+	if (ret != -ENOENT || !dev->set_param)
+		return ret;
+
+	/* Not in the middle of an APDU (or a probe). */
+	halse_begin(dev);
+	ret = dev->set_param(dev, tag, buf, len);
+	halse_end(dev);
+
+	return ret;
+}
+
+static int halse_xfer_dev(struct halse_dev *dev, unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len)
+{
+	if (dev->reactor)
+		return halse_reactor_xfer(dev, tx_buf, tx_len, rx_buf, rx_len);
+
+	return dev->xfer(dev, tx_buf, tx_len, rx_buf, rx_len);
+}
+
+static int halse_xfer_cached(struct halse_dev *dev, unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len)
+{
+	int ret;
+
+	if (!dev->cache && !dev->select)
+		return halse_xfer_dev(dev, tx_buf, tx_len, rx_buf, rx_len);
+
+	if (dev->select &&
+	    halse_select_lookup(dev->select, tx_buf, tx_len, rx_buf, rx_len))
+		return 0;
+
+	if (dev->cache &&
+	    halse_cache_lookup(dev->cache, tx_buf, tx_len, rx_buf, rx_len))
+		return 0;
+
+	ret = halse_xfer_dev(dev, tx_buf, tx_len, rx_buf, rx_len);
+
+	if (dev->select)
+		halse_select_update(dev->select, tx_buf, tx_len, rx_buf, ret ? 0 : *rx_len, ret);
+	if (dev->cache)
+		halse_cache_update(dev->cache, tx_buf, tx_len, rx_buf, ret ? 0 : *rx_len, ret);
+
+	return ret;
+}
+
+int halse_xfer(struct halse_dev *dev, unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len)
+{
+	int ret;
+
+	halse_begin(dev);
+	if (dev->reset)
+		halse_reset_used(dev->reset);
+	ret = halse_xfer_cached(dev, tx_buf, tx_len, rx_buf, rx_len);
+	halse_end(dev);
+	if (dev->presence)
+		halse_presence_xfer(dev->presence, ret);
+
+	return ret;
+}
@@ -20,10 +20,57 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <wintypes.h>
+#include <pcsclite.h>
+#include <reader.h>
+
+#include "halse_rt.h"
 
 #define MAX_SE_DEVICES 16
 
+/* Max. length of a (extended length) command or response APDU. */
+#define MAX_APDU_SIZE MAX_BUFFER_SIZE_EXTENDED
+
+/*
+ * Vendor specific capability tags (see IFDHGetCapabilities() and
+ * IFDHSetCapabilities()). Values are unsigned 32-bit integers.
+ * Changes are validated (-EINVAL) and take effect with the next APDU.
+ * Tags, which a SE doesn't support, are rejected (-ENOENT).
+ */
+#define TAG_IFDSE(n) SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x2000 + (n))
+#define TAG_IFDSE_APDU_TIMEOUT_MS TAG_IFDSE(0x01) /* Deadline per APDU (0: none) */
+/* Protocol timing (se05x: overrides the ATR until set again, kerkey: WTX polling) */
+#define TAG_IFDSE_POLL_INTERVAL_US TAG_IFDSE(0x02) /* Poll interval while waiting */
+#define TAG_IFDSE_POLL_MAX_INTERVAL_US TAG_IFDSE(0x03) /* Max. backed off poll interval (kerkey) */
+#define TAG_IFDSE_POLL_DENSE_US TAG_IFDSE(0x04) /* Min. duration of dense polling */
+#define TAG_IFDSE_GUARD_TIME_US TAG_IFDSE(0x05) /* Time between I2C transactions */
+#define TAG_IFDSE_RESPONSE_TIMEOUT_MS TAG_IFDSE(0x06) /* se05x: BWT, kerkey: timeout */
+/* Error recovery and delays (se05x) */
+#define TAG_IFDSE_MAX_RNAK TAG_IFDSE(0x07) /* R-blocks with error per block */
+#define TAG_IFDSE_MAX_RESYNC TAG_IFDSE(0x08) /* S(RESYNCH) attempts per APDU */
+#define TAG_IFDSE_XFER_DELAY_US TAG_IFDSE(0x09) /* Delay before each APDU */
+/* Provider independent options (only if enabled in the config) */
+#define TAG_IFDSE_CACHE_ENTRIES TAG_IFDSE(0x10) /* Max. cached responses (1..32) */
+#define TAG_IFDSE_RESET_WINDOW_MS TAG_IFDSE(0x11) /* See "reset-window" */
+#define TAG_IFDSE_HEALTH_IDLE_MS TAG_IFDSE(0x12) /* See "health" */
+/* SE broker ("broker" provider) */
+#define TAG_IFDSE_BROKER_EXCLUSIVE TAG_IFDSE(0x20) /* 1: begin, 0: end exclusive access */
+
+/*
+ * Vendor specific control codes (see IFDHControl()).
+ */
+#define IOCTL_IFDSE(n) SCARD_CTL_CODE(3600 + (n))
+#define IOCTL_IFDSE_BATCH IOCTL_IFDSE(1) /* Batch of APDUs (see halse_batch.h) */
+
+struct halse_async;
+struct halse_reactor;
+struct halse_cache;
+struct halse_select;
+struct halse_presence;
+struct halse_health;
+struct halse_reset;
+
 struct halse_dev {
 	void (*close)(struct halse_dev* dev);
 	int (*get_atr)(struct halse_dev* dev, unsigned char *buf, size_t *len);
@@ -31,18 +78,107 @@ struct halse_dev {
 	int (*power_down)(struct halse_dev *device);
 	int (*warm_reset)(struct halse_dev *device);
 	int (*xfer)(struct halse_dev *device, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len);
+	int (*get_param)(struct halse_dev *device, DWORD tag, unsigned char *buf, size_t *len);
+	int (*set_param)(struct halse_dev *device, DWORD tag, const unsigned char *buf, size_t len);
+	int (*probe)(struct halse_dev *device); /* Cheap liveness check (optional) */
+	int (*refresh_atr)(struct halse_dev *device); /* Get the ATR without reset (optional) */
+	void *mem; /* State and buffers of the driver (locked with "mlock", optional) */
+	size_t mem_len;
+	struct halse_async *async; /* See halse_async.h (allocated on attach or first submit) */
+	struct halse_reactor *reactor; /* See halse_reactor.h (NULL if not attached) */
+	struct halse_rt rt; /* Settings for the I/O thread (see halse_rt.h) */
+	struct halse_cache *cache; /* See halse_cache.h (NULL if disabled) */
+	struct halse_select *select; /* See halse_select.h (NULL if disabled) */
+	struct halse_presence *presence; /* See halse_presence.h (slots of readers only) */
+	struct halse_health *health; /* See halse_health.h (NULL if disabled) */
+	struct halse_reset *reset; /* See halse_reset.h (NULL if disabled) */
 };
 
+/*
+ * Read a device parameter (IFD capability tag).
+ *
+ * Returns 0 on success, -ENOENT if the tag is not supported,
+ * -ENOSPC if the buffer is too small, or -ve on error.
+ */
+int halse_get_param(struct halse_dev *dev, DWORD tag,
+	unsigned char *buf, size_t *len);
+
+/*
+ * Change a device parameter (IFD capability tag) between two APDUs.
+ *
+ * Returns 0 on success, -ENOENT if the tag is not supported,
+ * -EINVAL if the value is invalid, or -ve on error.
+ */
+int halse_set_param(struct halse_dev *dev, DWORD tag,
+	const unsigned char *buf, size_t len);
+
+/*
+ * Create a new SE from a config string (see the file libifdse).
+ * Returns the new object on success, or NULL otherwise.
+ */
+struct halse_dev* halse_create(char* config);
+
+/* Close a SE created by halse_create() and free all its resources. */
+void halse_destroy(struct halse_dev *dev);
+
+/*
+ * Power and reset actions (invalidate the response cache and the
+ * selection tracker of the SE, and are serialized with the health monitor).
+ * Power ups and resets follow the reset policy of the SE (see halse_reset.h).
+ * Same semantics as the corresponding callbacks.
+ */
+int halse_power_up(struct halse_dev *dev);
+int halse_power_down(struct halse_dev *dev);
+int halse_warm_reset(struct halse_dev *dev);
+
+/* Warm reset, which ignores the reset policy (e.g. to recover a SE). */
+int halse_force_reset(struct halse_dev *dev);
+
 /* Check if SE with given lun exists */
 bool halse_exists(DWORD lun);
 
-/* Creates a new SE with given lun and config */
+/*
+ * Creates a new reader with given lun and config.
+ * The config may describe several SEs (separated by ';') and SEs
+ * may have several slots (see halse_slots.h). The slot j of the
+ * reader is registered with the lun (lun & 0xFFFF0000) + j.
+ * Returns slot 0 on success, or NULL otherwise.
+ */
 struct halse_dev* halse_open(DWORD lun, char* config);
 
 /* Gets (existing) SE with the given lun. */
 struct halse_dev* halse_get(DWORD lun);
 
-/* Free the lun */
-void halse_free(DWORD lun);
+/* Check if the SE of a slot is present (i.e. hasn't failed). */
+bool halse_present(struct halse_dev *dev);
+
+/*
+ * Wait for a state change of the SE of a slot (failure, recovery or
+ * reset) for at most timeout_ms (<= 0: no limit), or until
+ * halse_stop_wait() is called. A failed SE is reported as present
+ * again periodically, so that the next power up can recover it.
+ */
+void halse_wait_event(struct halse_dev *dev, int timeout_ms);
+
+/* Wake up a waiter of halse_wait_event(). */
+void halse_stop_wait(struct halse_dev *dev);
+
+/* Number of slots of the reader of the given lun (0 if not open). */
+size_t halse_slots_number(DWORD lun);
+
+/*
+ * Close the SE with the given lun and free the lun.
+ * The reader (all its SEs) is freed, once all its slots are closed.
+ */
+void halse_close(DWORD lun);
+
+/*
+ * Transfer an APDU (via the selection tracker, the response cache and
+ * the reactor thread of the device, if enabled), serialized with the
+ * health monitor of the device.
+ * Same semantics as the xfer() callback.
+ */
+int halse_xfer(struct halse_dev *dev, unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len);
 
 #endif /* HALSE_H_ */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include <debuglog.h>
+
+#include "halse_async.h"
+#include "halsched.h"
+#include "helpers.h"
+
+#define MAX_EVENTS MAX_SE_DEVICES
+
+struct halse_async {
+	struct halsched_task task;
+	struct halse_loop_watch watch; /* Watches the timer fd of the task */
+	struct halse_dev *dev;
+	struct halse_xfer *xfer; /* Running transfer (or NULL) */
+	struct halse_xfer *queue; /* Transfers submitted behind xfer */
+	struct halse_xfer **queue_tail;
+	struct halse_loop *loop;
+};
+
+struct halse_loop {
+	int epoll_fd;
+};
+
+struct halse_loop* halse_loop_create(void)
+{
+	struct halse_loop *loop = calloc(1, sizeof(*loop));
+	if (!loop) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		Log2(PCSC_LOG_ERROR, "Could not create epoll fd: %d", errno);
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+void halse_loop_destroy(struct halse_loop *loop)
+{
+	if (!loop)
+		return;
+
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+int halse_loop_fd(struct halse_loop *loop)
+{
+	return loop->epoll_fd;
+}
+
+int halse_loop_watch_add(struct halse_loop *loop, struct halse_loop_watch *watch)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = watch,
+	};
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watch->fd, &ev)) {
+		Log2(PCSC_LOG_ERROR, "Could not watch fd: %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+void halse_loop_watch_del(struct halse_loop *loop, struct halse_loop_watch *watch)
+{
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+static void halse_async_body(struct halsched_task *task)
+{
+	struct halse_async *async = container_of(task, struct halse_async, task);
+	struct halse_xfer *xfer = async->xfer;
+
+	xfer->ret = async->dev->xfer(async->dev, xfer->tx_buf, xfer->tx_len,
+			xfer->rx_buf, &xfer->rx_len);
+}
+
+/*
+ * Handle the state of the task after it returned to us. Once the
+ * running transfer has completed, the next queued one is started.
+ * Returns the number of completed transfers.
+ */
+static int halse_async_step(struct halse_async *async, int finished)
+{
+	int completed = 0;
+
+	while (finished) {
+		struct halse_xfer *xfer = async->xfer;
+		struct halse_xfer *next = async->queue;
+
+		if (next) {
+			async->queue = next->next;
+			if (!async->queue)
+				async->queue_tail = &async->queue;
+			async->xfer = next;
+		} else {
+			/* Idle before the callback, which may submit again. */
+			halse_loop_watch_del(async->loop, &async->watch);
+			async->xfer = NULL;
+			async->loop = NULL;
+		}
+
+		if (xfer->done)
+			xfer->done(xfer);
+		completed++;
+
+		if (!next)
+			break;
+
+		finished = halsched_task_start(&async->task, halse_async_body);
+	}
+
+	return completed;
+}
+
+static int halse_async_handler(struct halse_loop_watch *watch)
+{
+	struct halse_async *async = container_of(watch, struct halse_async, watch);
+	int ret = halsched_task_resume(&async->task);
+
+	return halse_async_step(async, ret);
+}
+
+int halse_async_prepare(struct halse_dev *dev)
+{
+	struct halse_async *async;
+	int ret;
+
+	if (dev->async)
+		return 0;
+
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return -ENOMEM;
+	}
+
+	ret = halsched_task_init(&async->task);
+	if (ret) {
+		free(async);
+		return ret;
+	}
+
+	/* The stack is unlocked again, when it is unmapped. */
+	halse_rt_lock(&dev->rt, async, sizeof(*async));
+	if (dev->rt.mlock) {
+		ret = halsched_task_lock(&async->task);
+		if (ret)
+			Log2(PCSC_LOG_ERROR, "Could not lock task stack: %d", ret);
+	}
+
+	async->dev = dev;
+	async->queue_tail = &async->queue;
+	async->watch.fd = async->task.timer_fd;
+	async->watch.handler = halse_async_handler;
+	dev->async = async;
+
+	return 0;
+}
+
+int halse_xfer_submit(struct halse_loop *loop, struct halse_dev *dev,
+	struct halse_xfer *xfer)
+{
+	struct halse_async *async;
+	int ret;
+
+	if (!loop || !dev || !xfer)
+		return -EINVAL;
+
+	ret = halse_async_prepare(dev);
+	if (ret)
+		return ret;
+	async = dev->async;
+
+	/* Queue behind the running transfer. */
+	if (async->xfer) {
+		if (async->loop != loop)
+			return -EBUSY;
+		xfer->next = NULL;
+		*async->queue_tail = xfer;
+		async->queue_tail = &xfer->next;
+		return 0;
+	}
+
+	ret = halse_loop_watch_add(loop, &async->watch);
+	if (ret)
+		return ret;
+
+	async->xfer = xfer;
+	async->loop = loop;
+
+	ret = halsched_task_start(&async->task, halse_async_body);
+	halse_async_step(async, ret);
+
+	return 0;
+}
+
+int halse_loop_dispatch(struct halse_loop *loop, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int completed = 0;
+	int i, n;
+
+	n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		Log2(PCSC_LOG_ERROR, "Waiting for events failed: %d", errno);
+		return -errno;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct halse_loop_watch *watch = events[i].data.ptr;
+		int ret = watch->handler(watch);
+		if (ret > 0)
+			completed += ret;
+	}
+
+	return completed;
+}
+
+void halse_async_release(struct halse_dev *dev)
+{
+	struct halse_async *async = dev->async;
+
+	if (!async)
+		return;
+
+	if (async->xfer || async->queue)
+		Log1(PCSC_LOG_ERROR, "Releasing device with pending transfer!");
+
+	halsched_task_release(&async->task);
+	free(async);
+	dev->async = NULL;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_ASYNC_H_
+#define HALSE_ASYNC_H_
+
+#include <stddef.h>
+
+#include "halse.h"
+
+/*
+ * Asynchronous transfers.
+ *
+ * A submitted transfer runs the (blocking) xfer() callback of the
+ * device in a task (see halsched.h). Each wait of the protocol code
+ * suspends the task and arms its timer fd, which is watched by the
+ * loop. A single thread can therefore keep many SEs busy by calling
+ * halse_loop_dispatch() (or by polling halse_loop_fd() in its own
+ * event loop).
+ */
+
+struct halse_loop;
+
+/*
+ * A file descriptor watched by the loop (e.g. an eventfd or a
+ * GPIO line event fd). The handler is called from
+ * halse_loop_dispatch() when the fd becomes readable and returns
+ * the number of transfers it has completed (or -ve on error).
+ */
+struct halse_loop_watch {
+	int fd;
+	int (*handler)(struct halse_loop_watch *watch);
+};
+
+struct halse_xfer {
+	unsigned char *tx_buf;
+	size_t tx_len;
+	unsigned char *rx_buf;
+	size_t rx_len; /* In: size of rx_buf, out: length of the response */
+	int ret; /* Result of xfer() */
+	void (*done)(struct halse_xfer *xfer); /* Completion callback */
+	void *priv; /* Owned by the submitter */
+	struct halse_xfer *next; /* Queue of the device (internal) */
+};
+
+/* Create a new (empty) event loop. */
+struct halse_loop* halse_loop_create(void);
+
+/* Destroy the event loop (no transfers must be pending). */
+void halse_loop_destroy(struct halse_loop *loop);
+
+/* Returns an fd, which becomes readable when the loop has work to do. */
+int halse_loop_fd(struct halse_loop *loop);
+
+/* Add a watch to the loop. Returns 0 on success, or -ve on error. */
+int halse_loop_watch_add(struct halse_loop *loop, struct halse_loop_watch *watch);
+
+/* Remove a watch from the loop. */
+void halse_loop_watch_del(struct halse_loop *loop, struct halse_loop_watch *watch);
+
+/*
+ * Wait up to timeout_ms (-1: infinite, 0: don't wait) for pending
+ * transfers and advance them. Completion callbacks are called from
+ * within this function.
+ *
+ * Returns the number of completed transfers, or -ve on error.
+ */
+int halse_loop_dispatch(struct halse_loop *loop, int timeout_ms);
+
+/*
+ * Submit a transfer to the device.
+ * The transfer runs until its first wait before this function returns.
+ * If the device has a pending transfer, it is queued and started once
+ * the transfers submitted before it have finished (in order).
+ * xfer->done() is called once the transfer has finished
+ * (possibly before this function returns).
+ *
+ * Returns 0 on success, -EBUSY if the device has a pending transfer
+ * in another loop, or -ve on error.
+ */
+int halse_xfer_submit(struct halse_loop *loop, struct halse_dev *dev,
+	struct halse_xfer *xfer);
+
+/*
+ * Allocate the async state of a device (otherwise done by the first
+ * halse_xfer_submit()), so that submitting doesn't allocate memory.
+ * Returns 0 on success, or -ve on error.
+ */
+int halse_async_prepare(struct halse_dev *dev);
+
+/* Release the async state of a device (no transfer must be pending). */
+void halse_async_release(struct halse_dev *dev);
+
+#endif /* HALSE_ASYNC_H_ */
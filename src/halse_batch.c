@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <debuglog.h>
+
+#include "halse.h"
+#include "halse_batch.h"
+
+static size_t get_be16(const unsigned char *p)
+{
+	return ((size_t)p[0] << 8) | p[1];
+}
+
+static void put_be16(unsigned char *p, size_t v)
+{
+	p[0] = (v >> 8) & 0xFF;
+	p[1] = v & 0xFF;
+}
+
+/*
+ * Check the format of the request, before anything is executed.
+ */
+static int halse_batch_check(const unsigned char *req, size_t req_len)
+{
+	size_t off = 0;
+
+	if (!req_len)
+		return -EINVAL;
+
+	while (off < req_len) {
+		size_t len;
+
+		if (req_len - off < HALSE_BATCH_HDR_LEN)
+			return -EINVAL;
+
+		len = get_be16(&req[off + 1]);
+		off += HALSE_BATCH_HDR_LEN;
+
+		if (len < 4 || len > MAX_APDU_SIZE || req_len - off < len)
+			return -EINVAL;
+		off += len;
+	}
+
+	return 0;
+}
+
+int halse_batch(struct halse_dev *dev, unsigned char *req, size_t req_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	size_t in = 0, out = 0, n = 0;
+	int ret;
+
+	ret = halse_batch_check(req, req_len);
+	if (ret) {
+		Log1(PCSC_LOG_ERROR, "Malformed batch!");
+		return ret;
+	}
+
+	if (*rsp_len < HALSE_BATCH_HDR_LEN)
+		return -ENOSPC;
+
+	while (in < req_len) {
+		unsigned char flags = req[in];
+		size_t tx_len = get_be16(&req[in + 1]);
+		unsigned char *tx_buf = &req[in + HALSE_BATCH_HDR_LEN];
+		unsigned char *item = &rsp[out];
+		size_t rx_len;
+		bool stop = false;
+
+		/* No room for another item. */
+		if (*rsp_len - out < HALSE_BATCH_HDR_LEN)
+			break;
+
+		rx_len = *rsp_len - out - HALSE_BATCH_HDR_LEN;
+		ret = halse_xfer(dev, tx_buf, tx_len, &item[HALSE_BATCH_HDR_LEN], &rx_len);
+		if (ret) {
+			item[0] = ret == -ENOSPC ? HALSE_BATCH_NO_SPACE : HALSE_BATCH_XFER_ERROR;
+			rx_len = 0;
+			stop = true;
+		} else {
+			item[0] = HALSE_BATCH_OK;
+			if ((flags & HALSE_BATCH_STOP_ON_ERROR) &&
+			    (rx_len < 2 || item[HALSE_BATCH_HDR_LEN + rx_len - 2] != 0x90 ||
+			     item[HALSE_BATCH_HDR_LEN + rx_len - 1] != 0x00))
+				stop = true;
+		}
+		put_be16(&item[1], rx_len);
+
+		out += HALSE_BATCH_HDR_LEN + rx_len;
+		in += HALSE_BATCH_HDR_LEN + tx_len;
+		n++;
+
+		if (stop)
+			break;
+	}
+
+	Log3(PCSC_LOG_DEBUG, "Batch: %zu items executed, %zu bytes returned", n, out);
+
+	*rsp_len = out;
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_BATCH_H_
+#define HALSE_BATCH_H_
+
+#include <stddef.h>
+
+#include "halse.h"
+
+/*
+ * Batched APDU execution (see IOCTL_IFDSE_BATCH).
+ *
+ * Request: a sequence of items
+ *   FLAGS (1 byte) | LEN (2 bytes, big endian) | command APDU (LEN bytes)
+ * Response: one item per executed command
+ *   STATUS (1 byte) | LEN (2 bytes, big endian) | response APDU (LEN bytes)
+ *
+ * The commands are executed in order. Execution stops after an item
+ * with a status other than HALSE_BATCH_OK, or after an item with
+ * HALSE_BATCH_STOP_ON_ERROR, whose response doesn't end with 9000.
+ * The size of a response is only known once the command has been
+ * executed: an item with HALSE_BATCH_NO_SPACE has run on the SE, but
+ * its response didn't fit into the rest of the response buffer. Items
+ * without room for their header are not executed (and not reported).
+ */
+
+/* Item flags */
+#define HALSE_BATCH_STOP_ON_ERROR 0x01
+
+/* Item status */
+#define HALSE_BATCH_OK 0x00 /* Response follows */
+#define HALSE_BATCH_XFER_ERROR 0x01 /* Transfer failed (no response) */
+#define HALSE_BATCH_NO_SPACE 0x02 /* Response buffer exhausted (command executed, response lost) */
+
+#define HALSE_BATCH_HDR_LEN 3
+
+/*
+ * Execute a batch on the device.
+ *
+ * Returns 0 on success (the status of the items is reported in rsp),
+ * -EINVAL if the request is malformed, -ENOSPC if rsp can't even hold
+ * the header of an item, or -ve on error.
+ */
+int halse_batch(struct halse_dev *dev, unsigned char *req, size_t req_len,
+	unsigned char *rsp, size_t *rsp_len);
+
+#endif /* HALSE_BATCH_H_ */
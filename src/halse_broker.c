@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "halse_ring.h"
+#include "halse_broker_proto.h"
+#include "halse_broker.h"
+
+/* Time a new client has to send its hello message. */
+#define HELLO_TIMEOUT_MS 1000
+
+/* Descriptors accepted with the hello message (more are closed). */
+#define MAX_HELLO_FDS 8
+
+struct halse_broker_session;
+
+struct halse_broker_se {
+	struct halse_dev *dev;
+	pthread_mutex_t lock; /* Serializes the requests of the sessions */
+	pthread_cond_t cond; /* Signaled when the exclusive access ends */
+	struct halse_broker_session *owner; /* Session with exclusive access */
+	size_t n_powered; /* Sessions, which have powered up the SE */
+};
+
+struct halse_broker_session {
+	struct halse_broker *broker;
+	struct halse_broker_se *se;
+	pthread_t thread;
+	bool done; /* The thread can be joined (protected by the broker lock) */
+	int sock;
+	int req_fd;
+	int rsp_fd;
+	struct halse_broker_shm *shm;
+	bool powered;
+	/*
+	 * Private copies of the request and response data, so that the
+	 * client can't change them while the SE code (and e.g. the
+	 * response cache shared with other sessions) is using them.
+	 */
+	unsigned char tx[HALSE_RING_MAX_DATA];
+	unsigned char rx[HALSE_RING_MAX_DATA];
+};
+
+struct halse_broker {
+	int listen_fd;
+	int stop_fd;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	struct halse_broker_se ses[MAX_SE_DEVICES];
+	size_t n_ses;
+	pthread_mutex_t lock; /* Protects the session table */
+	struct halse_broker_session *sessions[MAX_BROKER_SESSIONS];
+};
+
+/* Called with the SE lock held. */
+static int halse_broker_power_up(struct halse_broker_session *s)
+{
+	int ret;
+
+	if (s->powered)
+		return 0;
+
+	if (!s->se->n_powered) {
+		ret = halse_power_up(s->se->dev);
+		if (ret)
+			return ret;
+	}
+
+	s->powered = true;
+	s->se->n_powered++;
+
+	return 0;
+}
+
+/* Called with the SE lock held. */
+static int halse_broker_power_down(struct halse_broker_session *s)
+{
+	if (!s->powered)
+		return 0;
+
+	s->powered = false;
+	s->se->n_powered--;
+
+	if (!s->se->n_powered)
+		return halse_power_down(s->se->dev);
+
+	return 0;
+}
+
+/* Called with the SE lock held. */
+static int halse_broker_warm_reset(struct halse_broker_session *s)
+{
+	int ret = 0;
+
+	if (s->se->n_powered > (s->powered ? 1 : 0)) {
+		/* A reset would destroy the state of the other sessions. */
+		Log1(PCSC_LOG_DEBUG, "Other sessions are using the SE, skipping reset");
+	} else {
+		ret = halse_warm_reset(s->se->dev);
+		if (ret)
+			return ret;
+	}
+
+	if (!s->powered) {
+		s->powered = true;
+		s->se->n_powered++;
+	}
+
+	return 0;
+}
+
+/* Called with the SE lock held. */
+static void halse_broker_end(struct halse_broker_session *s)
+{
+	if (s->se->owner != s)
+		return;
+
+	s->se->owner = NULL;
+	pthread_cond_broadcast(&s->se->cond);
+}
+
+/*
+ * Execute a request (data in s->tx) and store the response data in
+ * s->rx (*rx_len: size of s->rx on input, length on output).
+ */
+static int halse_broker_exec(struct halse_broker_session *s, uint32_t op,
+	uint32_t arg, size_t tx_len, size_t *rx_len)
+{
+	struct halse_dev *dev = s->se->dev;
+	int ret;
+
+	pthread_mutex_lock(&s->se->lock);
+
+	/* Wait for the end of the exclusive access of another session. */
+	while (s->se->owner && s->se->owner != s)
+		pthread_cond_wait(&s->se->cond, &s->se->lock);
+
+	switch (op) {
+		case HALSE_BROKER_OP_BEGIN:
+			s->se->owner = s;
+			ret = 0;
+			*rx_len = 0;
+			break;
+		case HALSE_BROKER_OP_END:
+			halse_broker_end(s);
+			ret = 0;
+			*rx_len = 0;
+			break;
+		case HALSE_BROKER_OP_POWER_UP:
+			ret = halse_broker_power_up(s);
+			*rx_len = 0;
+			break;
+		case HALSE_BROKER_OP_POWER_DOWN:
+			ret = halse_broker_power_down(s);
+			*rx_len = 0;
+			break;
+		case HALSE_BROKER_OP_WARM_RESET:
+			ret = halse_broker_warm_reset(s);
+			*rx_len = 0;
+			break;
+		case HALSE_BROKER_OP_GET_ATR:
+			ret = dev->get_atr(dev, s->rx, rx_len);
+			break;
+		case HALSE_BROKER_OP_XFER:
+			if (!s->powered)
+				ret = -EIO;
+			else
+				ret = halse_xfer(dev, s->tx, tx_len, s->rx, rx_len);
+			break;
+		case HALSE_BROKER_OP_GET_PARAM:
+			ret = halse_get_param(dev, arg, s->rx, rx_len);
+			break;
+		case HALSE_BROKER_OP_SET_PARAM:
+			ret = halse_set_param(dev, arg, s->tx, tx_len);
+			*rx_len = 0;
+			break;
+		default:
+			Log2(PCSC_LOG_ERROR, "Invalid request: %u", op);
+			ret = -EINVAL;
+			break;
+	}
+
+	pthread_mutex_unlock(&s->se->lock);
+
+	return ret;
+}
+
+/*
+ * Serve all pending requests of a session.
+ * Returns 0 if the request ring is empty, or -ve if the session must end.
+ */
+static int halse_broker_serve(struct halse_broker_session *s)
+{
+	struct halse_ring_msg *req, *rsp;
+	uint32_t op, arg;
+	size_t tx_len, rx_len;
+	uint64_t seq, v = 1;
+	int corrupt;
+	int ret;
+
+	while ((req = halse_ring_peek(&s->shm->req, &corrupt))) {
+		/* Read every field of the shared request only once. */
+		op = req->op;
+		arg = req->arg;
+		tx_len = req->len;
+		seq = req->seq;
+		if (tx_len > HALSE_RING_MAX_DATA) {
+			op = 0;
+			tx_len = 0;
+		}
+		memcpy(s->tx, req->data, tx_len);
+		halse_ring_pop(&s->shm->req);
+
+		rx_len = sizeof(s->rx);
+		ret = halse_broker_exec(s, op, arg, tx_len, &rx_len);
+		if (ret)
+			rx_len = 0;
+
+		rsp = halse_ring_reserve(&s->shm->rsp);
+		if (!rsp) {
+			Log1(PCSC_LOG_ERROR, "Client doesn't collect its responses");
+			return -EIO;
+		}
+		rsp->op = op;
+		rsp->arg = arg;
+		rsp->ret = ret;
+		rsp->len = rx_len;
+		rsp->seq = seq;
+		memcpy(rsp->data, s->rx, rx_len);
+		halse_ring_push(&s->shm->rsp);
+
+		if (write(s->rsp_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			return -errno;
+	}
+
+	if (corrupt) {
+		Log1(PCSC_LOG_ERROR, "Client has corrupted its request ring");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void* halse_broker_session_main(void *arg)
+{
+	struct halse_broker_session *s = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = s->req_fd, .events = POLLIN },
+		{ .fd = s->sock, .events = POLLIN },
+	};
+	uint64_t v;
+
+	while (!halse_broker_serve(s)) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/* Any activity on the socket ends the session. */
+		if (pfd[1].revents)
+			break;
+		if (read(s->req_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			break;
+	}
+
+	pthread_mutex_lock(&s->se->lock);
+	halse_broker_end(s);
+	halse_broker_power_down(s);
+	pthread_mutex_unlock(&s->se->lock);
+
+	Log2(PCSC_LOG_INFO, "Session with SE %zu ended", (size_t)(s->se - s->broker->ses));
+
+	pthread_mutex_lock(&s->broker->lock);
+	s->done = true;
+	pthread_mutex_unlock(&s->broker->lock);
+
+	return NULL;
+}
+
+static void halse_broker_session_free(struct halse_broker_session *s)
+{
+	if (s->shm && s->shm != MAP_FAILED)
+		munmap(s->shm, sizeof(*s->shm));
+	if (s->req_fd >= 0)
+		close(s->req_fd);
+	if (s->rsp_fd >= 0)
+		close(s->rsp_fd);
+	close(s->sock);
+	free(s);
+}
+
+/* Map the shared memory of a client, after checking that it is safe. */
+static int halse_broker_map(struct halse_broker_session *s, int mem_fd)
+{
+	struct stat st;
+	int seals;
+
+	seals = fcntl(mem_fd, F_GET_SEALS);
+	if (seals < 0 || (seals & HALSE_BROKER_SEALS) != HALSE_BROKER_SEALS) {
+		Log1(PCSC_LOG_ERROR, "Shared memory of client isn't sealed");
+		return -EPERM;
+	}
+
+	if (fstat(mem_fd, &st) || (size_t)st.st_size < sizeof(*s->shm)) {
+		Log1(PCSC_LOG_ERROR, "Shared memory of client is too small");
+		return -EINVAL;
+	}
+
+	s->shm = mmap(NULL, sizeof(*s->shm), PROT_READ | PROT_WRITE,
+		MAP_SHARED, mem_fd, 0);
+	if (s->shm == MAP_FAILED) {
+		s->shm = NULL;
+		return -errno;
+	}
+
+	if (s->shm->magic != HALSE_BROKER_MAGIC ||
+	    s->shm->version != HALSE_BROKER_VERSION) {
+		Log1(PCSC_LOG_ERROR, "Invalid shared memory of client");
+		return -EPROTO;
+	}
+
+	/* Never block on the eventfds of a client. */
+	if (fcntl(s->req_fd, F_SETFL, O_NONBLOCK) ||
+	    fcntl(s->rsp_fd, F_SETFL, O_NONBLOCK))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Receive the hello message of a new client.
+ * Returns 0 on success, or -ve on error.
+ */
+static int halse_broker_hello(struct halse_broker *b,
+	struct halse_broker_session *s)
+{
+	struct halse_broker_hello hello;
+	int fds[3] = { -1, -1, -1 };
+	int rcvd[MAX_HELLO_FDS];
+	union {
+		char buf[CMSG_SPACE(sizeof(rcvd))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct pollfd pfd = { .fd = s->sock, .events = POLLIN };
+	struct cmsghdr *cmsg;
+	size_t i, n_fds = 0;
+	ssize_t n;
+	int ret;
+
+	if (poll(&pfd, 1, HELLO_TIMEOUT_MS) != 1)
+		return -ETIMEDOUT;
+
+	n = recvmsg(s->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return -errno;
+
+	/* Take the first three descriptors, close any others. */
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(rcvd, CMSG_DATA(cmsg), n_fds * sizeof(int));
+	}
+	for (i = 0; i < n_fds; i++) {
+		if (i < 3)
+			fds[i] = rcvd[i];
+		else
+			close(rcvd[i]);
+	}
+
+	s->req_fd = fds[1];
+	s->rsp_fd = fds[2];
+
+	if (n != sizeof(hello) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+	    fds[0] < 0 || fds[1] < 0 || fds[2] < 0 ||
+	    hello.magic != HALSE_BROKER_MAGIC ||
+	    hello.version != HALSE_BROKER_VERSION) {
+		Log1(PCSC_LOG_ERROR, "Invalid hello message from client");
+		ret = -EPROTO;
+	} else if (hello.se >= b->n_ses) {
+		Log2(PCSC_LOG_ERROR, "Client requested unknown SE %u", hello.se);
+		ret = -ENODEV;
+	} else {
+		s->se = &b->ses[hello.se];
+		ret = halse_broker_map(s, fds[0]);
+	}
+
+	if (fds[0] >= 0)
+		close(fds[0]);
+
+	if (!ret)
+		Log2(PCSC_LOG_INFO, "Session with SE %u started", hello.se);
+
+	return ret;
+}
+
+/* Join the threads of ended sessions. Called with the broker lock held. */
+static void halse_broker_reap(struct halse_broker *b)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_BROKER_SESSIONS; i++) {
+		struct halse_broker_session *s = b->sessions[i];
+		if (s && s->done) {
+			pthread_join(s->thread, NULL);
+			halse_broker_session_free(s);
+			b->sessions[i] = NULL;
+		}
+	}
+}
+
+static void halse_broker_accept(struct halse_broker *b)
+{
+	struct halse_broker_welcome welcome = { 0 };
+	struct halse_broker_session *s;
+	size_t i;
+	int sock;
+
+	sock = accept4(b->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	pthread_mutex_lock(&b->lock);
+	halse_broker_reap(b);
+	for (i = 0; i < MAX_BROKER_SESSIONS; i++)
+		if (!b->sessions[i])
+			break;
+	pthread_mutex_unlock(&b->lock);
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		close(sock);
+		return;
+	}
+	s->broker = b;
+	s->sock = sock;
+	s->req_fd = s->rsp_fd = -1;
+
+	if (i == MAX_BROKER_SESSIONS) {
+		Log1(PCSC_LOG_ERROR, "Too many sessions!");
+		welcome.ret = -EBUSY;
+	} else {
+		welcome.ret = halse_broker_hello(b, s);
+	}
+
+	if (!welcome.ret &&
+	    pthread_create(&s->thread, NULL, halse_broker_session_main, s)) {
+		Log1(PCSC_LOG_ERROR, "Could not create session thread!");
+		welcome.ret = -EAGAIN;
+	}
+
+	/* The session thread doesn't use the socket for sending. */
+	send(sock, &welcome, sizeof(welcome), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (welcome.ret) {
+		halse_broker_session_free(s);
+		return;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	b->sessions[i] = s;
+	pthread_mutex_unlock(&b->lock);
+}
+
+int halse_broker_run(struct halse_broker *b)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = b->listen_fd, .events = POLLIN },
+		{ .fd = b->stop_fd, .events = POLLIN },
+	};
+	uint64_t v;
+	size_t i;
+	int ret = 0;
+
+	Log2(PCSC_LOG_INFO, "Serving %zu SEs", b->n_ses);
+
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		if (pfd[1].revents) {
+			if (read(b->stop_fd, &v, sizeof(v)) < 0)
+				ret = -errno;
+			break;
+		}
+		if (pfd[0].revents)
+			halse_broker_accept(b);
+	}
+
+	/* End all sessions (the threads see the shut down socket). */
+	pthread_mutex_lock(&b->lock);
+	for (i = 0; i < MAX_BROKER_SESSIONS; i++) {
+		struct halse_broker_session *s = b->sessions[i];
+		if (s)
+			shutdown(s->sock, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	for (i = 0; i < MAX_BROKER_SESSIONS; i++) {
+		struct halse_broker_session *s = b->sessions[i];
+		if (s) {
+			pthread_join(s->thread, NULL);
+			halse_broker_session_free(s);
+			b->sessions[i] = NULL;
+		}
+	}
+
+	return ret;
+}
+
+void halse_broker_stop(struct halse_broker *b)
+{
+	uint64_t v = 1;
+
+	if (write(b->stop_fd, &v, sizeof(v)) < 0)
+		return;
+}
+
+struct halse_broker* halse_broker_create(const char *path,
+	struct halse_dev **devs, size_t n_devs)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct halse_broker *b;
+	size_t i;
+
+	if (!path || !n_devs || n_devs > MAX_SE_DEVICES)
+		return NULL;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		Log2(PCSC_LOG_ERROR, "Socket path too long: '%s'", path);
+		return NULL;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	strcpy(b->path, path);
+	strcpy(addr.sun_path, path);
+	pthread_mutex_init(&b->lock, NULL);
+	for (i = 0; i < n_devs; i++) {
+		b->ses[i].dev = devs[i];
+		pthread_mutex_init(&b->ses[i].lock, NULL);
+		pthread_cond_init(&b->ses[i].cond, NULL);
+	}
+	b->n_ses = n_devs;
+
+	b->stop_fd = eventfd(0, EFD_CLOEXEC);
+	b->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (b->stop_fd < 0 || b->listen_fd < 0) {
+		Log2(PCSC_LOG_ERROR, "Could not create socket: %d", errno);
+		goto err;
+	}
+
+	/* Replace a stale socket (e.g. of a crashed broker). */
+	unlink(path);
+
+	/* Access is granted via the group of the socket (or its directory). */
+	if (bind(b->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+	    chmod(path, 0660) || listen(b->listen_fd, MAX_BROKER_SESSIONS)) {
+		Log3(PCSC_LOG_ERROR, "Could not listen on '%s': %d", path, errno);
+		goto err;
+	}
+
+	return b;
+
+err:
+	halse_broker_destroy(b);
+	return NULL;
+}
+
+void halse_broker_destroy(struct halse_broker *b)
+{
+	size_t i;
+
+	if (!b)
+		return;
+
+	if (b->listen_fd >= 0) {
+		close(b->listen_fd);
+		unlink(b->path);
+	}
+	if (b->stop_fd >= 0)
+		close(b->stop_fd);
+	for (i = 0; i < b->n_ses; i++) {
+		pthread_cond_destroy(&b->ses[i].cond);
+		pthread_mutex_destroy(&b->ses[i].lock);
+	}
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_BROKER_H_
+#define HALSE_BROKER_H_
+
+#include <stddef.h>
+
+#include "halse.h"
+
+/*
+ * SE broker: serves SEs to local processes over shared memory.
+ *
+ * The broker (e.g. the daemon ifdse-broker) owns the SEs and their
+ * buses. Clients (see halse_broker_client.h, or the "broker" provider
+ * of libifdse) open a session with one of the SEs via a Unix socket
+ * and then pass their requests and responses via a pair of SPSC rings
+ * (see halse_ring.h) in shared memory, signaled by eventfds (see
+ * halse_broker_proto.h). Every session is served by its own thread,
+ * which executes the requests via halse_xfer() and friends, so all
+ * options of the SEs (reactor, cache, health monitor,...) apply.
+ *
+ * The requests of the sessions of a SE are serialized (like the slots
+ * of halse_slots.h, the sessions interleave at APDU granularity).
+ * A session, which needs a sequence of APDUs without interleaving
+ * (e.g. a selection followed by commands on the basic channel), begins
+ * exclusive access, which makes the other sessions of the SE wait.
+ * The SE is powered up by the first session and powered down when the
+ * last session powers down or ends; a warm reset is only performed
+ * if no other session has powered up the SE.
+ */
+
+/* Max. number of concurrent sessions. */
+#define MAX_BROKER_SESSIONS 32
+
+struct halse_broker;
+
+/*
+ * Create a broker serving the SEs devs[0..n_devs-1] (up to MAX_SE_DEVICES,
+ * the index is the SE number of the clients) via the Unix socket path.
+ * A stale socket at path is replaced. The SEs remain owned by the caller.
+ * Returns the new broker on success, or NULL otherwise.
+ */
+struct halse_broker* halse_broker_create(const char *path,
+	struct halse_dev **devs, size_t n_devs);
+
+/*
+ * Accept and serve clients until halse_broker_stop() is called,
+ * then end all sessions.
+ * Returns 0 on success, or -ve on error.
+ */
+int halse_broker_run(struct halse_broker *b);
+
+/* Make halse_broker_run() return (async-signal-safe). */
+void halse_broker_stop(struct halse_broker *b);
+
+/* Remove the socket and free the broker (NULL is ignored). */
+void halse_broker_destroy(struct halse_broker *b);
+
+#endif /* HALSE_BROKER_H_ */
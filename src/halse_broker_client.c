@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "halse_ring.h"
+#include "halse_broker_proto.h"
+#include "halse_broker_client.h"
+
+/*
+ * No logging here: the library is also used outside of PCSC lite,
+ * so all errors are reported as return values.
+ */
+
+struct halse_broker_client {
+	int sock;
+	int req_fd; /* Signaled by us after pushing a request */
+	int rsp_fd; /* Signaled by the broker after pushing a response */
+	struct halse_broker_shm *shm;
+	pthread_mutex_t lock; /* One request in flight */
+	uint64_t seq;
+};
+
+static int halse_broker_hello(struct halse_broker_client *c, int mem_fd,
+	unsigned int se)
+{
+	struct halse_broker_hello hello = {
+		.magic = HALSE_BROKER_MAGIC,
+		.version = HALSE_BROKER_VERSION,
+		.se = se,
+	};
+	struct halse_broker_welcome welcome;
+	int fds[3] = { mem_fd, c->req_fd, c->rsp_fd };
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(&u, 0, sizeof(u));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	n = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+	if (n < 0)
+		return -errno;
+	if (n != sizeof(hello))
+		return -EIO;
+
+	do {
+		n = recv(c->sock, &welcome, sizeof(welcome), 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+	if (n != sizeof(welcome))
+		return -EPIPE;
+
+	return welcome.ret;
+}
+
+int halse_broker_connect(const char *path, unsigned int se,
+	struct halse_broker_client **client)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct halse_broker_client *c;
+	int mem_fd = -1;
+	int ret;
+
+	if (!path)
+		path = HALSE_BROKER_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+	c->sock = c->req_fd = c->rsp_fd = -1;
+	c->shm = MAP_FAILED;
+	pthread_mutex_init(&c->lock, NULL);
+
+	c->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	c->req_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	c->rsp_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	mem_fd = memfd_create("ifdse-broker", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (c->sock < 0 || c->req_fd < 0 || c->rsp_fd < 0 || mem_fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	if (ftruncate(mem_fd, sizeof(*c->shm)) ||
+	    fcntl(mem_fd, F_ADD_SEALS, HALSE_BROKER_SEALS)) {
+		ret = -errno;
+		goto err;
+	}
+
+	c->shm = mmap(NULL, sizeof(*c->shm), PROT_READ | PROT_WRITE,
+		MAP_SHARED, mem_fd, 0);
+	if (c->shm == MAP_FAILED) {
+		ret = -errno;
+		goto err;
+	}
+	c->shm->magic = HALSE_BROKER_MAGIC;
+	c->shm->version = HALSE_BROKER_VERSION;
+	halse_ring_init(&c->shm->req);
+	halse_ring_init(&c->shm->rsp);
+
+	if (connect(c->sock, (struct sockaddr*)&addr, sizeof(addr))) {
+		ret = -errno;
+		goto err;
+	}
+
+	ret = halse_broker_hello(c, mem_fd, se);
+	if (ret)
+		goto err;
+
+	/* The broker holds its own reference. */
+	close(mem_fd);
+
+	*client = c;
+	return 0;
+
+err:
+	if (mem_fd >= 0)
+		close(mem_fd);
+	halse_broker_disconnect(c);
+	return ret;
+}
+
+void halse_broker_disconnect(struct halse_broker_client *c)
+{
+	if (!c)
+		return;
+
+	/* The broker cleans up the session, when the socket is closed. */
+	if (c->sock >= 0)
+		close(c->sock);
+	if (c->shm != MAP_FAILED)
+		munmap(c->shm, sizeof(*c->shm));
+	if (c->req_fd >= 0)
+		close(c->req_fd);
+	if (c->rsp_fd >= 0)
+		close(c->rsp_fd);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+/* Wait for the response signal, or the end of the session. */
+static int halse_broker_wait(struct halse_broker_client *c)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = c->rsp_fd, .events = POLLIN },
+		{ .fd = c->sock, .events = POLLIN },
+	};
+	uint64_t v;
+
+	if (poll(pfd, 2, -1) < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	if (pfd[1].revents)
+		return -EPIPE;
+
+	if (read(c->rsp_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Pass a request to the broker and wait for the response.
+ * in/in_len: request data, out/out_len: response data (may be NULL).
+ */
+static int halse_broker_call(struct halse_broker_client *c, uint32_t op,
+	uint32_t arg, const unsigned char *in, size_t in_len,
+	unsigned char *out, size_t *out_len)
+{
+	struct halse_ring_msg *msg;
+	uint64_t v = 1;
+	int corrupt;
+	int ret;
+
+	if (!c)
+		return -EINVAL;
+	if (in_len > HALSE_RING_MAX_DATA)
+		return -EINVAL;
+
+	pthread_mutex_lock(&c->lock);
+
+	msg = halse_ring_reserve(&c->shm->req);
+	if (!msg) {
+		/* Can't happen with one request in flight. */
+		ret = -EIO;
+		goto out;
+	}
+
+	msg->op = op;
+	msg->arg = arg;
+	msg->ret = 0;
+	msg->len = in_len;
+	msg->seq = ++c->seq;
+	if (in_len)
+		memcpy(msg->data, in, in_len);
+	halse_ring_push(&c->shm->req);
+
+	if (write(c->req_fd, &v, sizeof(v)) != sizeof(v)) {
+		ret = -errno;
+		goto out;
+	}
+
+	while (!(msg = halse_ring_peek(&c->shm->rsp, &corrupt))) {
+		ret = corrupt ? -EIO : halse_broker_wait(c);
+		if (ret)
+			goto out;
+	}
+
+	ret = msg->ret;
+	if (msg->seq != c->seq || msg->len > HALSE_RING_MAX_DATA) {
+		ret = -EIO;
+	} else if (!ret && out_len) {
+		if (msg->len > *out_len) {
+			ret = -ENOSPC;
+		} else {
+			memcpy(out, msg->data, msg->len);
+			*out_len = msg->len;
+		}
+	}
+	halse_ring_pop(&c->shm->rsp);
+
+out:
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+int halse_broker_power_up(struct halse_broker_client *c)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_POWER_UP, 0, NULL, 0, NULL, NULL);
+}
+
+int halse_broker_power_down(struct halse_broker_client *c)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_POWER_DOWN, 0, NULL, 0, NULL, NULL);
+}
+
+int halse_broker_warm_reset(struct halse_broker_client *c)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_WARM_RESET, 0, NULL, 0, NULL, NULL);
+}
+
+int halse_broker_get_atr(struct halse_broker_client *c,
+	unsigned char *buf, size_t *len)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_GET_ATR, 0, NULL, 0, buf, len);
+}
+
+int halse_broker_xfer(struct halse_broker_client *c,
+	const unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_XFER, 0, tx_buf, tx_len,
+		rx_buf, rx_len);
+}
+
+int halse_broker_begin(struct halse_broker_client *c)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_BEGIN, 0, NULL, 0, NULL, NULL);
+}
+
+int halse_broker_end(struct halse_broker_client *c)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_END, 0, NULL, 0, NULL, NULL);
+}
+
+int halse_broker_get_param(struct halse_broker_client *c, uint32_t tag,
+	unsigned char *buf, size_t *len)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_GET_PARAM, tag, NULL, 0, buf, len);
+}
+
+int halse_broker_set_param(struct halse_broker_client *c, uint32_t tag,
+	const unsigned char *buf, size_t len)
+{
+	return halse_broker_call(c, HALSE_BROKER_OP_SET_PARAM, tag, buf, len, NULL, NULL);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_BROKER_CLIENT_H_
+#define HALSE_BROKER_CLIENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Client of the SE broker (see halse_broker.h), built as
+ * libifdse-client.so for applications, which don't use PCSC lite.
+ *
+ * A client is a session with one SE of the broker. Requests are
+ * passed to the broker via shared memory and are synchronous: one
+ * request of a session is in flight at a time (calls of several
+ * threads are serialized). Applications, which need parallel
+ * requests, open several sessions.
+ *
+ * Power actions are counted by the broker: the SE is powered up by
+ * the first session and powered down when no session needs it any
+ * more. A warm reset is skipped while other sessions use the SE.
+ * All functions return 0 on success, or -ve (errno) on error; -EPIPE
+ * means that the broker has ended the session.
+ */
+
+struct halse_broker_client;
+
+/*
+ * Open a session with the SE with the index se (order of the command
+ * line of the broker) of the broker listening on path (NULL: default).
+ */
+int halse_broker_connect(const char *path, unsigned int se,
+	struct halse_broker_client **client);
+
+/* End the session (powers down the SE of the session, if needed). */
+void halse_broker_disconnect(struct halse_broker_client *client);
+
+int halse_broker_power_up(struct halse_broker_client *client);
+int halse_broker_power_down(struct halse_broker_client *client);
+int halse_broker_warm_reset(struct halse_broker_client *client);
+
+/* Get the ATR (*len: size of buf on input, length of the ATR on output). */
+int halse_broker_get_atr(struct halse_broker_client *client,
+	unsigned char *buf, size_t *len);
+
+/* Transfer an APDU (same semantics as halse_xfer()). */
+int halse_broker_xfer(struct halse_broker_client *client,
+	const unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len);
+
+/*
+ * Begin or end exclusive access to the SE: until the session ends it
+ * (or ends), the requests of other sessions wait, so that a sequence
+ * of APDUs isn't interleaved with theirs (e.g. because they share the
+ * basic channel). Beginning again while in exclusive access is a no-op.
+ */
+int halse_broker_begin(struct halse_broker_client *client);
+int halse_broker_end(struct halse_broker_client *client);
+
+/* Read or change a parameter (same semantics as halse_get_param()/halse_set_param()). */
+int halse_broker_get_param(struct halse_broker_client *client, uint32_t tag,
+	unsigned char *buf, size_t *len);
+int halse_broker_set_param(struct halse_broker_client *client, uint32_t tag,
+	const unsigned char *buf, size_t len);
+
+#endif /* HALSE_BROKER_CLIENT_H_ */
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A SE served by the SE broker (see halse_broker.h), e.g. to share
+ * the SE between PCSC lite and other local processes.
+ *
+ * Config: "[<socket>:]<se>"
+ * where <socket> is the path of the socket of the broker (default:
+ * HALSE_BROKER_SOCKET) and <se> the index of the SE at the broker.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "halse_broker_proto.h"
+#include "halse_broker_client.h"
+#include "halse_broker_dev.h"
+
+_Static_assert(HALSE_RING_MAX_DATA >= MAX_APDU_SIZE,
+	"Broker messages must hold any APDU");
+
+struct halse_broker_dev {
+	/* Embed halse device */
+	struct halse_dev device;
+	struct halse_broker_client *client;
+	bool exclusive; /* See TAG_IFDSE_BROKER_EXCLUSIVE */
+};
+
+static int halse_broker_dev_get_atr(struct halse_dev *device, unsigned char *buf,
+	size_t *len)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+
+	return halse_broker_get_atr(dev->client, buf, len);
+}
+
+static int halse_broker_dev_power_up(struct halse_dev *device)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+
+	return halse_broker_power_up(dev->client);
+}
+
+static int halse_broker_dev_power_down(struct halse_dev *device)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+
+	/* The state, which the exclusive access protects, is gone. */
+	if (dev->exclusive && !halse_broker_end(dev->client))
+		dev->exclusive = false;
+
+	return halse_broker_power_down(dev->client);
+}
+
+static int halse_broker_dev_warm_reset(struct halse_dev *device)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+
+	return halse_broker_warm_reset(dev->client);
+}
+
+static int halse_broker_dev_xfer(struct halse_dev *device, unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+	int ret;
+
+	ret = halse_broker_xfer(dev->client, tx_buf, tx_len, rx_buf, rx_len);
+	if (ret == -EPIPE)
+		Log1(PCSC_LOG_ERROR, "Broker has ended the session");
+
+	return ret;
+}
+
+static int halse_broker_dev_get_param(struct halse_dev *device, DWORD tag,
+	unsigned char *buf, size_t *len)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+
+	if (tag == TAG_IFDSE_BROKER_EXCLUSIVE)
+		return put_param_u32(buf, len, dev->exclusive);
+
+	return halse_broker_get_param(dev->client, tag, buf, len);
+}
+
+static int halse_broker_dev_set_param(struct halse_dev *device, DWORD tag,
+	const unsigned char *buf, size_t len)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+	uint32_t v;
+	int ret;
+
+	if (tag != TAG_IFDSE_BROKER_EXCLUSIVE)
+		return halse_broker_set_param(dev->client, tag, buf, len);
+
+	ret = get_param_u32(buf, len, &v);
+	if (ret)
+		return ret;
+	if (v > 1)
+		return -EINVAL;
+
+	ret = v ? halse_broker_begin(dev->client) : halse_broker_end(dev->client);
+	if (!ret)
+		dev->exclusive = v;
+
+	return ret;
+}
+
+static void halse_broker_dev_close(struct halse_dev *device)
+{
+	struct halse_broker_dev *dev = container_of(device, struct halse_broker_dev, device);
+
+	halse_broker_disconnect(dev->client);
+	free(dev);
+}
+
+struct halse_dev* halse_open_broker(char* config)
+{
+	struct halse_broker_dev *dev;
+	char *path = NULL, *p, *endptr;
+	unsigned long se;
+	int ret;
+
+	if (!config)
+		return NULL;
+
+	Log2(PCSC_LOG_DEBUG, "Trying to create device with config: '%s'", config);
+
+	p = strrchr(config, ':');
+	if (p) {
+		*p++ = '\0';
+		path = config;
+	} else {
+		p = config;
+	}
+
+	errno = 0;
+	se = strtoul(p, &endptr, 0);
+	if (errno != 0 || p == endptr || *endptr || se >= MAX_SE_DEVICES) {
+		Log2(PCSC_LOG_ERROR, "Invalid broker SE: '%s'", p);
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	ret = halse_broker_connect(path, se, &dev->client);
+	if (ret) {
+		Log3(PCSC_LOG_ERROR, "Could not connect to broker '%s': %d",
+			path ? path : HALSE_BROKER_SOCKET, ret);
+		free(dev);
+		return NULL;
+	}
+
+	dev->device.close = halse_broker_dev_close;
+	dev->device.get_atr = halse_broker_dev_get_atr;
+	dev->device.power_up = halse_broker_dev_power_up;
+	dev->device.power_down = halse_broker_dev_power_down;
+	dev->device.warm_reset = halse_broker_dev_warm_reset;
+	dev->device.xfer = halse_broker_dev_xfer;
+	dev->device.get_param = halse_broker_dev_get_param;
+	dev->device.set_param = halse_broker_dev_set_param;
+
+	return &dev->device;
+}
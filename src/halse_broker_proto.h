@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_BROKER_PROTO_H_
+#define HALSE_BROKER_PROTO_H_
+
+#include <stdint.h>
+
+#include "halse_ring.h"
+
+/*
+ * Protocol between the SE broker (see halse_broker.h) and its clients
+ * (see halse_broker_client.h).
+ *
+ * A client connects to the Unix socket of the broker (SOCK_SEQPACKET)
+ * and sends a hello message together with three file descriptors
+ * (SCM_RIGHTS): a sealed memfd holding a struct halse_broker_shm,
+ * an eventfd signaled by the client after pushing requests and
+ * an eventfd signaled by the broker after pushing responses.
+ * The broker answers with a welcome message. From then on requests and
+ * responses only pass the rings; the socket is only used to detect
+ * the end of the session (closing it ends the session).
+ *
+ * The broker serves the requests of a session in order. The requests
+ * of all sessions using the same SE are serialized at request granularity,
+ * unless a session has begun exclusive access (until it ends it, or the
+ * session ends), which makes the requests of other sessions wait.
+ */
+
+#define HALSE_BROKER_MAGIC 0x49464453 /* "IFDS" */
+#define HALSE_BROKER_VERSION 1
+
+/* Default path of the socket of the broker. */
+#define HALSE_BROKER_SOCKET "/run/ifdse-broker.sock"
+
+/* Requests (data: command/value, response data: response/ATR/value). */
+#define HALSE_BROKER_OP_POWER_UP 1
+#define HALSE_BROKER_OP_POWER_DOWN 2
+#define HALSE_BROKER_OP_WARM_RESET 3
+#define HALSE_BROKER_OP_GET_ATR 4
+#define HALSE_BROKER_OP_XFER 5
+#define HALSE_BROKER_OP_GET_PARAM 6 /* arg: tag */
+#define HALSE_BROKER_OP_SET_PARAM 7 /* arg: tag */
+#define HALSE_BROKER_OP_BEGIN 8 /* Exclusive access to the SE */
+#define HALSE_BROKER_OP_END 9
+
+/* Seals required on the memfd (so that the broker can't fault on it). */
+#define HALSE_BROKER_SEALS (F_SEAL_SHRINK | F_SEAL_SEAL)
+
+struct halse_broker_shm {
+	uint32_t magic;
+	uint32_t version;
+	struct halse_ring req; /* Client -> broker */
+	struct halse_ring rsp; /* Broker -> client */
+};
+
+struct halse_broker_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t se; /* Index of the SE on the command line of the broker */
+};
+
+struct halse_broker_welcome {
+	int32_t ret; /* 0 on success, or -ve on error */
+};
+
+#endif /* HALSE_BROKER_PROTO_H_ */
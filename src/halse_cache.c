@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "halse_cache.h"
+
+#define MAX_CACHE_PATTERNS 16
+#define MAX_PATTERN_LEN 32
+#define MAX_CACHE_ENTRIES 32
+
+/* Basic channel, channels 1..3 and further channels 4..19. */
+#define MAX_CHANNELS 20
+
+/* Longer SELECT commands are not tracked. */
+#define MAX_SELECT_LEN 32
+
+/* Longer commands (extended length) are not cached. */
+#define MAX_APDU_KEY_LEN 261
+
+/* Longer responses (extended length) are not cached. */
+#define MAX_RSP_LEN 258
+
+#define MAX_KEY_LEN (2 + MAX_SELECT_LEN + MAX_APDU_KEY_LEN)
+
+#define INS_SELECT 0xA4
+
+struct halse_cache_pattern {
+	uint8_t val[MAX_PATTERN_LEN];
+	uint8_t mask[MAX_PATTERN_LEN];
+	size_t len;
+};
+
+/*
+ * Key: channel, SELECT command in effect and the command itself.
+ * The storage is part of the cache, so that caching doesn't allocate.
+ */
+struct halse_cache_entry {
+	unsigned char key[MAX_KEY_LEN];
+	unsigned char rsp[MAX_RSP_LEN];
+	size_t key_len; /* 0...unused */
+	size_t rsp_len;
+};
+
+struct halse_cache_sel {
+	unsigned char cmd[MAX_SELECT_LEN];
+	size_t len; /* 0...unknown */
+};
+
+struct halse_cache {
+	pthread_mutex_t lock;
+	struct halse_cache_pattern patterns[MAX_CACHE_PATTERNS];
+	size_t n_patterns;
+	struct halse_cache_entry entries[MAX_CACHE_ENTRIES];
+	size_t n_entries; /* Entries in use (1..MAX_CACHE_ENTRIES) */
+	size_t next; /* Entry to be replaced next */
+	struct halse_cache_sel sel[MAX_CHANNELS];
+
+	/* Accounting. */
+	size_t hits;
+	size_t misses;
+	size_t flushes;
+};
+
+static size_t halse_cache_channel(const unsigned char *tx_buf)
+{
+	if (tx_buf[0] & 0x40)
+		return 4 + (tx_buf[0] & 0x0F);
+	return tx_buf[0] & 0x03;
+}
+
+static bool halse_cache_is_select(const unsigned char *tx_buf, size_t tx_len)
+{
+	return tx_len >= 4 && tx_buf[1] == INS_SELECT;
+}
+
+static bool halse_cache_match(struct halse_cache *cache,
+	const unsigned char *tx_buf, size_t tx_len)
+{
+	size_t i, j;
+
+	if (tx_len < 4)
+		return false;
+
+	for (i = 0; i < cache->n_patterns; i++) {
+		const struct halse_cache_pattern *p = &cache->patterns[i];
+
+		if (p->len > tx_len)
+			continue;
+
+		for (j = 0; j < p->len; j++) {
+			if ((tx_buf[j] & p->mask[j]) != p->val[j])
+				break;
+		}
+		if (j == p->len)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Build the key of a command.
+ * Returns the length of the key, or 0 if the command can't be cached.
+ */
+static size_t halse_cache_key(struct halse_cache *cache, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *key)
+{
+	size_t ch = halse_cache_channel(tx_buf);
+	const struct halse_cache_sel *sel = &cache->sel[ch];
+	size_t len = 0;
+
+	if (halse_cache_is_select(tx_buf, tx_len)) {
+		/* Only a SELECT of the selected applet is answered from the cache. */
+		if (!sel->len || sel->len != tx_len || memcmp(sel->cmd, tx_buf, tx_len))
+			return 0;
+	}
+
+	key[len++] = (unsigned char)ch;
+	key[len++] = (unsigned char)sel->len;
+	memcpy(&key[len], sel->cmd, sel->len);
+	len += sel->len;
+	memcpy(&key[len], tx_buf, tx_len);
+	len += tx_len;
+
+	return len;
+}
+
+static struct halse_cache_entry* halse_cache_find(struct halse_cache *cache,
+	const unsigned char *key, size_t key_len)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_CACHE_ENTRIES; i++) {
+		struct halse_cache_entry *e = &cache->entries[i];
+		if (e->key_len && e->key_len == key_len && !memcmp(e->key, key, key_len))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void halse_cache_clear(struct halse_cache *cache)
+{
+	bool dropped = false;
+	size_t i;
+
+	for (i = 0; i < MAX_CACHE_ENTRIES; i++) {
+		if (cache->entries[i].key_len)
+			dropped = true;
+		cache->entries[i].key_len = 0;
+	}
+	memset(cache->sel, 0, sizeof(cache->sel));
+	cache->next = 0;
+
+	if (dropped)
+		cache->flushes++;
+}
+
+static void halse_cache_store(struct halse_cache *cache, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len)
+{
+	unsigned char key[MAX_KEY_LEN];
+	struct halse_cache_entry *e;
+	size_t key_len;
+
+	if (tx_len > MAX_APDU_KEY_LEN || rx_len > MAX_RSP_LEN)
+		return;
+
+	key_len = halse_cache_key(cache, tx_buf, tx_len, key);
+	if (!key_len || halse_cache_find(cache, key, key_len))
+		return;
+
+	e = &cache->entries[cache->next];
+	memcpy(e->key, key, key_len);
+	memcpy(e->rsp, rx_buf, rx_len);
+	e->key_len = key_len;
+	e->rsp_len = rx_len;
+
+	cache->next = (cache->next + 1) % cache->n_entries;
+}
+
+int halse_cache_lookup(struct halse_cache *cache, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	unsigned char key[MAX_KEY_LEN];
+	struct halse_cache_entry *e = NULL;
+	size_t key_len;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (!halse_cache_match(cache, tx_buf, tx_len)) {
+		/* The command might change the state of the SE. */
+		halse_cache_clear(cache);
+		goto out;
+	}
+
+	key_len = tx_len <= MAX_APDU_KEY_LEN ?
+		halse_cache_key(cache, tx_buf, tx_len, key) : 0;
+	if (key_len)
+		e = halse_cache_find(cache, key, key_len);
+
+	if (e && e->rsp_len <= *rx_len) {
+		memcpy(rx_buf, e->rsp, e->rsp_len);
+		*rx_len = e->rsp_len;
+		cache->hits++;
+		ret = 1;
+	} else {
+		cache->misses++;
+	}
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+void halse_cache_update(struct halse_cache *cache, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len, int ret)
+{
+	bool ok = !ret && rx_len >= 2 &&
+		rx_buf[rx_len - 2] == 0x90 && rx_buf[rx_len - 1] == 0x00;
+
+	if (tx_len < 4 || !halse_cache_match(cache, tx_buf, tx_len))
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (ret) {
+		/* The state of the SE is unknown. */
+		halse_cache_clear(cache);
+	} else if (halse_cache_is_select(tx_buf, tx_len)) {
+		struct halse_cache_sel *sel = &cache->sel[halse_cache_channel(tx_buf)];
+
+		if (!ok || tx_len > MAX_SELECT_LEN) {
+			/* The previous selection might be lost. */
+			halse_cache_clear(cache);
+		} else {
+			memcpy(sel->cmd, tx_buf, tx_len);
+			sel->len = tx_len;
+			halse_cache_store(cache, tx_buf, tx_len, rx_buf, rx_len);
+		}
+	} else if (ok) {
+		halse_cache_store(cache, tx_buf, tx_len, rx_buf, rx_len);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void halse_cache_flush(struct halse_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	halse_cache_clear(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = (char)tolower((unsigned char)c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+int halse_cache_add_pattern(struct halse_cache *cache, const char *pattern)
+{
+	struct halse_cache_pattern *p;
+	size_t n = strlen(pattern), i;
+
+	if (cache->n_patterns == MAX_CACHE_PATTERNS) {
+		Log1(PCSC_LOG_ERROR, "Too many cache patterns!");
+		return -ENOSPC;
+	}
+
+	if (!n || n % 2 || n / 2 > MAX_PATTERN_LEN)
+		goto invalid;
+
+	p = &cache->patterns[cache->n_patterns];
+	p->len = n / 2;
+	for (i = 0; i < p->len; i++) {
+		const char *c = &pattern[2 * i];
+		int hi, lo;
+
+		if (tolower((unsigned char)c[0]) == 'x' && tolower((unsigned char)c[1]) == 'x') {
+			p->val[i] = 0;
+			p->mask[i] = 0;
+			continue;
+		}
+
+		hi = hex_nibble(c[0]);
+		lo = hex_nibble(c[1]);
+		if (hi < 0 || lo < 0)
+			goto invalid;
+
+		p->val[i] = (uint8_t)((hi << 4) | lo);
+		p->mask[i] = 0xFF;
+	}
+
+	cache->n_patterns++;
+	return 0;
+
+invalid:
+	Log2(PCSC_LOG_ERROR, "Invalid cache pattern: '%s'", pattern);
+	return -EINVAL;
+}
+
+int halse_cache_set_entries(struct halse_cache *cache, size_t n)
+{
+	if (n == 0 || n > MAX_CACHE_ENTRIES)
+		return -EINVAL;
+
+	pthread_mutex_lock(&cache->lock);
+	halse_cache_clear(cache);
+	cache->n_entries = n;
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+size_t halse_cache_entries(struct halse_cache *cache)
+{
+	return cache->n_entries;
+}
+
+struct halse_cache* halse_cache_create(void)
+{
+	struct halse_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->n_entries = MAX_CACHE_ENTRIES;
+
+	return cache;
+}
+
+void halse_cache_destroy(struct halse_cache *cache)
+{
+	if (!cache)
+		return;
+
+	Log4(PCSC_LOG_INFO, "Response cache: %zu hits, %zu misses, %zu flushes",
+		cache->hits, cache->misses, cache->flushes);
+
+	halse_cache_clear(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
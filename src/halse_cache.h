@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_CACHE_H_
+#define HALSE_CACHE_H_
+
+#include <stddef.h>
+
+/*
+ * Response cache for read-only APDUs.
+ *
+ * Commands matching one of the configured patterns are answered from
+ * the cache, if the same command has been answered with 9000 before
+ * while the same applet was selected on the same logical channel.
+ * Any other command (which might change the state of the SE), a
+ * transfer error and a power or reset action flush the cache.
+ *
+ * SELECT commands (INS A4) may be allowlisted as well: they are only
+ * answered from the cache, if they would select the applet which is
+ * known to be selected already.
+ *
+ * The entries are stored in the cache itself, so neither lookups nor
+ * stores allocate memory. Extended length commands and responses are
+ * not cached.
+ */
+
+struct halse_cache;
+
+/* Create an empty cache (without patterns). */
+struct halse_cache* halse_cache_create(void);
+
+/* Log the counters and free the cache (NULL is ignored). */
+void halse_cache_destroy(struct halse_cache *cache);
+
+/*
+ * Add a pattern of cacheable commands: hex bytes, which have to match
+ * the beginning of the command, "xx" matches any byte
+ * (e.g. "80020000" or "00A40400xxA0000003965453").
+ *
+ * Returns 0 on success, or -ve on error.
+ */
+int halse_cache_add_pattern(struct halse_cache *cache, const char *pattern);
+
+/*
+ * Look up a command. Commands which aren't cacheable flush the cache.
+ * Returns 1 if the response has been copied to rx_buf, 0 otherwise.
+ */
+int halse_cache_lookup(struct halse_cache *cache, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len);
+
+/*
+ * Record the result of a command, which has been sent to the SE
+ * (ret is the result of the transfer).
+ */
+void halse_cache_update(struct halse_cache *cache, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len, int ret);
+
+/* Drop all entries and forget the selected applets. */
+void halse_cache_flush(struct halse_cache *cache);
+
+/*
+ * Change the max. number of entries (1..32, default: 32).
+ * This flushes the cache. Returns 0 on success, or -EINVAL.
+ */
+int halse_cache_set_entries(struct halse_cache *cache, size_t n);
+
+/* Max. number of entries. */
+size_t halse_cache_entries(struct halse_cache *cache);
+
+#endif /* HALSE_CACHE_H_ */
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "halse_health.h"
+
+#define US_PER_MS 1000
+
+struct halse_health {
+	struct halse_dev *dev;
+	pthread_t thread;
+
+	/* Serializes the access to the SE (recursive). */
+	pthread_mutex_t io;
+
+	/* Protects the fields below. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t idle_ms;
+	uint64_t last_us; /* End of the last activity */
+	bool powered;
+	bool stop;
+
+	/* Statistics (only used by the monitor thread). */
+	size_t probes;
+	size_t failures;
+	size_t recoveries;
+};
+
+/* Called with the lock held. */
+static bool halse_health_due(struct halse_health *h, uint64_t *due_us)
+{
+	*due_us = h->last_us + h->idle_ms * US_PER_MS;
+	return h->powered && monotonic_us() >= *due_us;
+}
+
+/* Probe the SE and recover it if needed (called with io held). */
+static void halse_health_check(struct halse_health *h)
+{
+	struct halse_dev *dev = h->dev;
+	int ret;
+
+	h->probes++;
+	ret = dev->probe(dev);
+	if (!ret)
+		return;
+
+	h->failures++;
+	Log2(PCSC_LOG_ERROR, "Health probe failed (%d) -> recovering SE", ret);
+
+	ret = halse_force_reset(dev);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Warm reset failed (%d) -> power cycle", ret);
+		halse_power_down(dev);
+		ret = halse_power_up(dev);
+		if (!ret)
+			ret = halse_force_reset(dev);
+	}
+
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Recovery of SE failed: %d", ret);
+		return;
+	}
+
+	h->recoveries++;
+	Log1(PCSC_LOG_INFO, "SE recovered by health monitor");
+}
+
+static void* halse_health_main(void *arg)
+{
+	struct halse_health *h = arg;
+	uint64_t due_us;
+	struct timespec ts;
+
+	pthread_mutex_lock(&h->lock);
+
+	while (!h->stop) {
+		if (!halse_health_due(h, &due_us)) {
+			if (h->powered) {
+				ts.tv_sec = due_us / 1000000;
+				ts.tv_nsec = (due_us % 1000000) * 1000;
+				pthread_cond_timedwait(&h->cond, &h->lock, &ts);
+			} else {
+				pthread_cond_wait(&h->cond, &h->lock);
+			}
+			continue;
+		}
+		pthread_mutex_unlock(&h->lock);
+
+		pthread_mutex_lock(&h->io);
+
+		/* The SE might have been used while we waited for it. */
+		pthread_mutex_lock(&h->lock);
+		bool due = halse_health_due(h, &due_us) && !h->stop;
+		pthread_mutex_unlock(&h->lock);
+
+		if (due)
+			halse_health_check(h);
+
+		halse_health_end(h);
+
+		pthread_mutex_lock(&h->lock);
+	}
+
+	pthread_mutex_unlock(&h->lock);
+
+	return NULL;
+}
+
+void halse_health_begin(struct halse_health *h)
+{
+	pthread_mutex_lock(&h->io);
+}
+
+void halse_health_end(struct halse_health *h)
+{
+	pthread_mutex_lock(&h->lock);
+	h->last_us = monotonic_us();
+	pthread_mutex_unlock(&h->lock);
+
+	pthread_mutex_unlock(&h->io);
+}
+
+void halse_health_set_idle(struct halse_health *h, size_t idle_ms)
+{
+	pthread_mutex_lock(&h->lock);
+	h->idle_ms = idle_ms;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+}
+
+size_t halse_health_idle(struct halse_health *h)
+{
+	size_t idle_ms;
+
+	pthread_mutex_lock(&h->lock);
+	idle_ms = h->idle_ms;
+	pthread_mutex_unlock(&h->lock);
+
+	return idle_ms;
+}
+
+void halse_health_powered(struct halse_health *h, bool powered)
+{
+	pthread_mutex_lock(&h->lock);
+	h->powered = powered;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+}
+
+struct halse_health* halse_health_create(struct halse_dev *dev, size_t idle_ms)
+{
+	struct halse_health *h;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+
+	if (!dev->probe) {
+		Log1(PCSC_LOG_ERROR, "SE doesn't support health probes!");
+		return NULL;
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	h->dev = dev;
+	h->idle_ms = idle_ms;
+	h->last_us = monotonic_us();
+
+	/* Recovery calls the power actions, which lock again. */
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&h->io, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_mutex_init(&h->lock, NULL);
+
+	/* Timeouts are based on monotonic_us(). */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&h->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (pthread_create(&h->thread, NULL, halse_health_main, h)) {
+		Log1(PCSC_LOG_ERROR, "Could not start health monitor!");
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->lock);
+		pthread_mutex_destroy(&h->io);
+		free(h);
+		return NULL;
+	}
+
+	Log2(PCSC_LOG_DEBUG, "Health monitor started (idle: %zu ms)", idle_ms);
+
+	return h;
+}
+
+void halse_health_destroy(struct halse_health *h)
+{
+	if (!h)
+		return;
+
+	pthread_mutex_lock(&h->lock);
+	h->stop = true;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+
+	pthread_join(h->thread, NULL);
+
+	Log4(PCSC_LOG_INFO, "Health monitor: %zu probes, %zu failures, %zu recoveries",
+		h->probes, h->failures, h->recoveries);
+
+	pthread_cond_destroy(&h->cond);
+	pthread_mutex_destroy(&h->lock);
+	pthread_mutex_destroy(&h->io);
+	free(h);
+}
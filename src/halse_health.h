@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_HEALTH_H_
+#define HALSE_HEALTH_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "halse.h"
+
+/*
+ * Idle health monitor of a SE.
+ *
+ * A thread probes a powered SE, which has been idle for idle_ms,
+ * with the cheap probe() callback of the provider (e.g. an S-block
+ * exchange). If the probe fails, the SE is recovered right away
+ * (warm reset, or a power cycle if that fails), so that a hung SE
+ * doesn't cost the next client APDU its timeouts and the recovery.
+ *
+ * The transfers and power actions of halse.c are bracketed with
+ * halse_health_begin() and halse_health_end(), which keeps the
+ * monitor away from the SE while it is in use. Transfers submitted
+ * via halse_async.h bypass this and must not be mixed with a monitor.
+ */
+
+struct halse_health;
+
+/*
+ * Start monitoring dev (which needs a probe() callback).
+ * Returns the new object on success, or NULL otherwise.
+ */
+struct halse_health* halse_health_create(struct halse_dev *dev, size_t idle_ms);
+
+/* Stop the monitor and free it (NULL is ignored). */
+void halse_health_destroy(struct halse_health *h);
+
+/* Lock the monitor out (nests, i.e. power actions may be called inside). */
+void halse_health_begin(struct halse_health *h);
+
+/* Let the monitor in again and restart the idle period. */
+void halse_health_end(struct halse_health *h);
+
+/* Change the idle time before a probe (> 0). */
+void halse_health_set_idle(struct halse_health *h, size_t idle_ms);
+
+/* Idle time before a probe. */
+size_t halse_health_idle(struct halse_health *h);
+
+/* Tell the monitor, if the SE is powered (only powered SEs are probed). */
+void halse_health_powered(struct halse_health *h, bool powered);
+
+#endif /* HALSE_HEALTH_H_ */
@@ -26,10 +26,12 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include <debuglog.h>
 
 #include "helpers.h"
+#include "halsched.h"
 #include "hali2c.h"
 #include "halgpio.h"
 #include "halse.h"
@@ -39,7 +41,36 @@
 
 #define I2C_FRAME_LENGTH_MAX 254
 
+/*
+ * A response header has the form (big endian):
+ *   C L14 ... L0
+ * C: more data follows (chaining), L: length of the data.
+ */
+#define HEADER_CHAIN 0x8000
+#define HEADER_LEN_MASK 0x7FFF
+
 #define GUARD_TIME_US 1000
+#define US_PER_MS 1000
+
+/*
+ * Poll schedule while the Kerkey signals WTX: poll every WTX_INTERVAL_US
+ * for at least WTX_DENSE_US (or twice the average response time),
+ * then back off up to WTX_INTERVAL_MAX_US.
+ */
+#define WTX_INTERVAL_US 1000
+#define WTX_INTERVAL_MAX_US (16 * 1000)
+#define WTX_DENSE_US (10 * 1000)
+
+/*
+ * The Kerkey acknowledges a chained frame as soon as it has been buffered.
+ * Poll for that acknowledgement with a short interval first.
+ */
+#define CHAIN_ACK_INTERVAL_US 50
+#define CHAIN_ACK_DENSE_US 1000
+
+/* Upper bounds of the tunables (see halse_kerkey_set_param()). */
+#define MAX_TUNE_US (1000 * US_PER_MS)
+#define MAX_TUNE_TIMEOUT_MS (60 * 1000)
 
 struct halse_kerkey_dev
 {
@@ -51,26 +82,206 @@ struct halse_kerkey_dev
 	struct halgpio_dev *gpio_dev;
 
 	/* Cached data from the device. */
-	unsigned char *atr;
+	unsigned char atr[MAX_ATR_SIZE];
 	size_t atr_len;
 	size_t timeout_ms;
+
+	/* Deadline handling. */
+	size_t apdu_timeout_ms; /* Deadline per APDU (0: none). */
+	uint64_t apdu_deadline_us; /* Absolute deadline of the current APDU. */
+	size_t resp_ewma_us; /* Average response time of APDUs. */
+
+	/* Tunables (see halse.h), default to the defines above. */
+	size_t guard_time_us;
+	size_t wtx_interval_us;
+	size_t wtx_interval_max_us;
+	size_t wtx_dense_us;
+
+	/* An exchange has been aborted, its response might still be pending. */
+	bool need_drain;
+
+	/*
+	 * Serializes the device operations, which can be called from
+	 * different threads (e.g. parameters via the other slots of a reader).
+	 */
+	pthread_mutex_t lock;
 };
 
+/* State of a sequence of WTX responses. */
+struct halse_kerkey_wtx
+{
+	uint64_t start_us;
+	uint64_t deadline_us;
+	size_t interval_us;
+};
+
+static inline bool halse_kerkey_chain(const unsigned char *res)
+{
+	return ((res[0] << 8) | res[1]) & HEADER_CHAIN;
+}
+
+static inline size_t halse_kerkey_len(const unsigned char *res)
+{
+	return ((res[0] << 8) | res[1]) & HEADER_LEN_MASK;
+}
+
 static inline int halse_kerkey_read_i2c(struct halse_kerkey_dev *dev, unsigned char *buf, size_t len)
 {
-	return hali2c_read_with_retry(dev->i2c_dev, buf, len, dev->timeout_ms, GUARD_TIME_US);
+	return hali2c_read_with_retry(dev->i2c_dev, buf, len, dev->timeout_ms, dev->guard_time_us);
 }
 
 static inline int halse_kerkey_write_i2c(struct halse_kerkey_dev *dev, const unsigned char *buf, size_t len)
 {
-	return hali2c_write_with_retry(dev->i2c_dev, buf, len, dev->timeout_ms, GUARD_TIME_US);
+	return hali2c_write_with_retry(dev->i2c_dev, buf, len, dev->timeout_ms, dev->guard_time_us);
 }
 
-static int halse_kerkey_get_timeout(struct halse_kerkey_dev *dev)
+/*
+ * Read the response header after a chained frame.
+ */
+static int halse_kerkey_read_ack(struct halse_kerkey_dev *dev, unsigned char *res)
+{
+	struct hali2c_poll poll = {
+		.deadline_us = monotonic_us() + dev->timeout_ms * US_PER_MS,
+		.dense_us = CHAIN_ACK_DENSE_US,
+		.interval_us = CHAIN_ACK_INTERVAL_US,
+		.max_interval_us = dev->guard_time_us,
+	};
+
+	return hali2c_read_poll(dev->i2c_dev, res, 2, &poll);
+}
+
+/*
+ * Wait before polling again after a WTX response.
+ * The Kerkey may signal WTX for at most its timeout (and not beyond the
+ * deadline of the APDU).
+ *
+ * Returns 0 if polling should continue, or -ETIMEDOUT.
+ */
+static int halse_kerkey_wtx_wait(struct halse_kerkey_dev *dev, struct halse_kerkey_wtx *wtx)
 {
+	uint64_t now = monotonic_us();
+
+	if (!wtx->start_us) {
+		wtx->start_us = now;
+		wtx->deadline_us = now + dev->timeout_ms * US_PER_MS;
+		if (dev->apdu_deadline_us && dev->apdu_deadline_us < wtx->deadline_us)
+			wtx->deadline_us = dev->apdu_deadline_us;
+		wtx->interval_us = dev->wtx_interval_us;
+	}
+
+	if (now >= wtx->deadline_us) {
+		Log1(PCSC_LOG_ERROR, "WTX timed out");
+		return -ETIMEDOUT;
+	}
+
+	/* Back off after the expected response time. */
+	size_t dense_us = 2 * dev->resp_ewma_us;
+	if (dense_us < dev->wtx_dense_us)
+		dense_us = dev->wtx_dense_us;
+	if (now - wtx->start_us > dense_us) {
+		wtx->interval_us *= 2;
+		if (wtx->interval_us > dev->wtx_interval_max_us)
+			wtx->interval_us = dev->wtx_interval_max_us;
+	}
+
+	size_t delay = wtx->interval_us;
+	if (now + delay > wtx->deadline_us)
+		delay = wtx->deadline_us - now;
+
+	if (halsched_sleep_us(delay)) {
+		Log1(PCSC_LOG_ERROR, "Sleeping failed!");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read and discard the rest of a response: rlen bytes of data and,
+ * if chain is set, the following chunks.
+ */
+static int halse_kerkey_discard(struct halse_kerkey_dev *dev, size_t rlen, bool chain)
+{
+	struct halse_kerkey_wtx wtx = { 0 };
+	unsigned char buf[I2C_FRAME_LENGTH_MAX];
+	unsigned char res[2];
+	int ret;
+
+	for (;;) {
+		if (rlen > sizeof(buf)) {
+			Log2(PCSC_LOG_ERROR, "Invalid response length %zu", rlen);
+			return -EIO;
+		}
+		if (rlen && halse_kerkey_read_i2c(dev, buf, rlen))
+			return -EIO;
+		if (!chain)
+			return 0;
+
+		if (halse_kerkey_read_i2c(dev, res, 2))
+			return -EIO;
+		chain = halse_kerkey_chain(res);
+		rlen = halse_kerkey_len(res);
+
+		if (!chain && rlen == 0) {
+			ret = halse_kerkey_wtx_wait(dev, &wtx);
+			if (ret)
+				return ret;
+			chain = true;
+		}
+	}
+}
+
+static int halse_kerkey_warm_reset_dev(struct halse_kerkey_dev *dev);
+
+/*
+ * Get rid of the response of an aborted exchange, which the Kerkey
+ * would return for the next command otherwise. If it doesn't show up
+ * within the timeout of the Kerkey, the Kerkey is reset.
+ *
+ * Returns 0 if the Kerkey is ready, -EIO if it had to be reset (the
+ * state of the SE is lost), or another -ve error.
+ */
+static int halse_kerkey_drain(struct halse_kerkey_dev *dev)
+{
+	int ret;
+
+	if (!dev->need_drain)
+		return 0;
+
+	/* Wait for the response as long as the Kerkey may take. */
+	dev->apdu_deadline_us = 0;
+	ret = halse_kerkey_discard(dev, 0, true);
+	if (!ret) {
+		Log1(PCSC_LOG_INFO, "Discarded response of an aborted APDU");
+		dev->need_drain = false;
+		return 0;
+	}
+
+	Log1(PCSC_LOG_ERROR, "Could not drain the Kerkey, resetting it");
+	dev->need_drain = false;
+	ret = halse_kerkey_warm_reset_dev(dev);
+	if (ret) {
+		dev->need_drain = true;
+		return ret;
+	}
+
+	return -EIO;
+}
+
+static int halse_kerkey_get_timeout(struct halse_kerkey_dev *dev, size_t *timeout_ms)
+{
+	struct halse_kerkey_wtx wtx = { 0 };
+
 	const unsigned char cmd = KERKEY_CMD_TIMEOUT;
 
-	int ret = halse_kerkey_write_i2c(dev, &cmd, 1);
+	int ret = halse_kerkey_drain(dev);
+	if (ret)
+		return ret;
+
+	/* Not bound to the deadline of the last APDU. */
+	dev->apdu_deadline_us = 0;
+
+	ret = halse_kerkey_write_i2c(dev, &cmd, 1);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Failed to write command");
 		return -1;
@@ -81,18 +292,18 @@ read_res:
 	ret = halse_kerkey_read_i2c(dev, res, 2);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Reading response failed!");
+		dev->need_drain = true;
 		return -1;
 	}
 
-	bool chain = (res[0] & 0x80) ? 1 : 0;
-	short rlen = ((res[0] << 8) | res[1]) & 0x00ff;
+	bool chain = halse_kerkey_chain(res);
+	size_t rlen = halse_kerkey_len(res);
 
 	if (!chain && rlen == 0) {
-		Log1(PCSC_LOG_DEBUG, "Received WTX");
-		ret = usleep(1000);
+		ret = halse_kerkey_wtx_wait(dev, &wtx);
 		if (ret) {
-			Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
-			return -1;
+			dev->need_drain = true;
+			return ret;
 		}
 		goto read_res;
 	}
@@ -108,9 +319,7 @@ read_res:
 		return -1;
 	}
 
-	dev->timeout_ms = (res[0] << 8) | res[1];
-
-	Log2(PCSC_LOG_DEBUG, "Set card timeout to: %zu", dev->timeout_ms);
+	*timeout_ms = (res[0] << 8) | res[1];
 
 	return 0;
 }
@@ -118,7 +327,16 @@ read_res:
 static int halse_kerkey_warm_reset_dev(struct halse_kerkey_dev *dev)
 {
 	const unsigned char cmd = KERKEY_CMD_ATR;
-	int ret = halse_kerkey_write_i2c(dev, &cmd, 1);
+	int ret;
+
+	/* A pending response would be taken for the ATR. */
+	if (dev->need_drain) {
+		dev->need_drain = false;
+		dev->apdu_deadline_us = 0;
+		halse_kerkey_discard(dev, 0, true);
+	}
+
+	ret = halse_kerkey_write_i2c(dev, &cmd, 1);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Failed to write command");
 		return -1;
@@ -131,18 +349,16 @@ static int halse_kerkey_warm_reset_dev(struct halse_kerkey_dev *dev)
 		return -1;
 	}
 
-	bool chain = (res[0] & 0x80) ? 1 : 0;
-	short rlen = ((res[0] << 8) | res[1]) & 0x00ff;
+	bool chain = halse_kerkey_chain(res);
+	size_t rlen = halse_kerkey_len(res);
 
 	if (chain || rlen == 0) {
 		Log1(PCSC_LOG_ERROR, "Could not trigger warm reset!");
 		return -1;
 	}
 
-	free(dev->atr);
-	dev->atr = malloc(rlen);
-	if (!dev->atr) {
-		Log1(PCSC_LOG_ERROR, "Could not allocate ATR buffer!");
+	if (rlen > sizeof(dev->atr)) {
+		Log2(PCSC_LOG_ERROR, "ATR too long (%zu bytes)", rlen);
 		return -1;
 	}
 
@@ -155,9 +371,9 @@ static int halse_kerkey_warm_reset_dev(struct halse_kerkey_dev *dev)
 	}
 
 	/* CMD_ATR triggers a warm reset, which takes some time */
-	ret = usleep(200*1000);
+	ret = halsched_sleep_us(200*1000);
 	if (ret) {
-		Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
+		Log1(PCSC_LOG_ERROR, "Sleeping failed!");
 		return -1;
 	}
 
@@ -226,9 +442,9 @@ static int halse_kerkey_open(struct halse_kerkey_dev *dev)
 		return -1;
 	}
 
-	ret = usleep(200*1000);
+	ret = halsched_sleep_us(200*1000);
 	if (ret) {
-		Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
+		Log1(PCSC_LOG_ERROR, "Sleeping failed!");
 		return -1;
 	}
 
@@ -238,9 +454,9 @@ static int halse_kerkey_open(struct halse_kerkey_dev *dev)
 		return -1;
 	}
 
-	ret = usleep(200*1000);
+	ret = halsched_sleep_us(200*1000);
 	if (ret) {
-		Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
+		Log1(PCSC_LOG_ERROR, "Sleeping failed!");
 		return -1;
 	}
 
@@ -253,7 +469,7 @@ static int halse_kerkey_open(struct halse_kerkey_dev *dev)
 		return -1;
 	}
 
-	ret = halse_kerkey_get_timeout(dev);
+	ret = halse_kerkey_get_timeout(dev, &dev->timeout_ms);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Could not get timeout!");
 		hali2c_close(dev->i2c_dev);
@@ -261,6 +477,8 @@ static int halse_kerkey_open(struct halse_kerkey_dev *dev)
 		return -1;
 	}
 
+	Log2(PCSC_LOG_DEBUG, "Set card timeout to: %zu", dev->timeout_ms);
+
 	return 0;
 }
 
@@ -269,29 +487,38 @@ static void halse_kerkey_close(struct halse_dev *device)
 	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
 	hali2c_close(dev->i2c_dev);
 	halgpio_close(dev->gpio_dev);
+	pthread_mutex_destroy(&dev->lock);
 }
 
 static int halse_kerkey_get_atr(struct halse_dev* device, unsigned char *buf, size_t *len)
 {
 	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->lock);
 
 	if (*len < dev->atr_len) {
 		Log1(PCSC_LOG_ERROR, "Buffer size too small!");
-		return -1;
+		ret = -1;
+	} else {
+		memcpy(buf, dev->atr, dev->atr_len);
+		*len = dev->atr_len;
 	}
 
-	memcpy(buf, dev->atr, dev->atr_len);
-	*len = dev->atr_len;
+	pthread_mutex_unlock(&dev->lock);
 
-	return 0;
+	return ret;
 }
 
 static int halse_kerkey_power_up(struct halse_dev *device)
 {
 	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
-	int ret = halgpio_enable(dev->gpio_dev);
+	int ret;
 
-	usleep(200*1000);
+	pthread_mutex_lock(&dev->lock);
+	ret = halgpio_enable(dev->gpio_dev);
+	halsched_sleep_us(200*1000);
+	pthread_mutex_unlock(&dev->lock);
 
 	return ret;
 }
@@ -299,79 +526,131 @@ static int halse_kerkey_power_up(struct halse_dev *device)
 static int halse_kerkey_power_down(struct halse_dev *device)
 {
 	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
-	return halgpio_disable(dev->gpio_dev);
+	int ret;
+
+	pthread_mutex_lock(&dev->lock);
+	ret = halgpio_disable(dev->gpio_dev);
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
 }
 
 static int halse_kerkey_warm_reset(struct halse_dev *device)
 {
 	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
-	return halse_kerkey_warm_reset_dev(dev);
+	int ret;
+
+	pthread_mutex_lock(&dev->lock);
+	ret = halse_kerkey_warm_reset_dev(dev);
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
 }
 
-static int halse_kerkey_xfer(struct halse_dev *device, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+/*
+ * Check if the Kerkey is alive (see halse_health.h).
+ * Querying the timeout doesn't change the state of the Kerkey.
+ */
+static int halse_kerkey_probe(struct halse_dev *device)
 {
 	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
+	size_t timeout_ms;
+	int ret;
+
+	/* Keep the (possibly tuned) timeout. */
+	pthread_mutex_lock(&dev->lock);
+	ret = halse_kerkey_get_timeout(dev, &timeout_ms);
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
+}
+
+static int halse_kerkey_xfer_dev(struct halse_kerkey_dev *dev, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
 	size_t tx_off = 0;
 	size_t rx_off = 0;
 	size_t rx_buf_len = *rx_len;
 	size_t len;
 	int ret;
 	unsigned char res[2];
+	struct halse_kerkey_wtx wtx = { 0 };
+	uint64_t start;
 
 	*rx_len = 0;
 
-send:
-	Log2(PCSC_LOG_DEBUG, "tx_len: %zu", tx_len);
+	ret = halse_kerkey_drain(dev);
+	if (ret)
+		return ret;
 
+	if (dev->apdu_timeout_ms)
+		dev->apdu_deadline_us = monotonic_us() + dev->apdu_timeout_ms * US_PER_MS;
+	else
+		dev->apdu_deadline_us = 0;
+
+send:
 	len = tx_len > I2C_FRAME_LENGTH_MAX ? I2C_FRAME_LENGTH_MAX : tx_len;
 
 	ret = halse_kerkey_write_i2c(dev, tx_buf + tx_off, len);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Writing data failed!");
+		if (tx_off)
+			dev->need_drain = true;
 		return -1;
 	}
 
 	tx_off += len;
 	tx_len -= len;
+	start = monotonic_us();
 
 read_res:
-	ret = halse_kerkey_read_i2c(dev, res, 2);
+	if (tx_len != 0)
+		ret = halse_kerkey_read_ack(dev, res);
+	else
+		ret = halse_kerkey_read_i2c(dev, res, 2);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Reading response failed!");
-		return -1;
+		ret = -1;
+		goto abort;
 	}
 
-	int chain = (res[0] & 0x80) ? 1 : 0;
-	short rlen = ((res[0] << 8) | res[1]) & 0x00ff;
+	bool chain = halse_kerkey_chain(res);
+	size_t rlen = halse_kerkey_len(res);
 
 	if (!chain && rlen == 0) {
-		Log1(PCSC_LOG_DEBUG, "Received WTX");
-		ret = usleep(1000);
-		if (ret) {
-			Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
-			return -1;
-		}
+		ret = halse_kerkey_wtx_wait(dev, &wtx);
+		if (ret)
+			goto abort;
 		goto read_res;
 	}
 
+	/* Track the average response time of the Kerkey. */
+	if (tx_len == 0 && rx_off == 0) {
+		size_t elapsed = monotonic_us() - start;
+		dev->resp_ewma_us = dev->resp_ewma_us - dev->resp_ewma_us / 8 + elapsed / 8;
+	}
+
 	if (chain && rlen == 0x00) {
 		if (tx_len != 0)
 			goto send;
 		else {
 			Log1(PCSC_LOG_ERROR, "Communication error!");
-			return -1;
+			ret = -1;
+			goto abort;
 		}
 	}
 
 	if (rx_off + rlen > rx_buf_len) {
 		Log1(PCSC_LOG_ERROR, "Receive buffer too small!");
-		return -1;
+		if (halse_kerkey_discard(dev, rlen, chain))
+			dev->need_drain = true;
+		return -ENOSPC;
 	}
 
 	ret = halse_kerkey_read_i2c(dev, rx_buf + rx_off, rlen);
 	if (ret) {
 		Log1(PCSC_LOG_ERROR, "Reading data failed!");
-		return -1;
+		ret = -1;
+		goto abort;
 	}
 
 	rx_off += rlen;
@@ -381,6 +660,108 @@ read_res:
 		goto read_res;
 
 	return 0;
+
+abort:
+	/* Don't let the next APDU read the response of this one. */
+	dev->need_drain = true;
+	return ret;
+}
+
+static int halse_kerkey_xfer(struct halse_dev *device, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
+	int ret;
+
+	pthread_mutex_lock(&dev->lock);
+	ret = halse_kerkey_xfer_dev(dev, tx_buf, tx_len, rx_buf, rx_len);
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
+}
+
+static int halse_kerkey_get_param_dev(struct halse_kerkey_dev *dev, DWORD tag, unsigned char *buf, size_t *len)
+{
+	switch (tag) {
+		case TAG_IFDSE_APDU_TIMEOUT_MS:
+			return put_param_u32(buf, len, dev->apdu_timeout_ms);
+		case TAG_IFDSE_POLL_INTERVAL_US:
+			return put_param_u32(buf, len, dev->wtx_interval_us);
+		case TAG_IFDSE_POLL_MAX_INTERVAL_US:
+			return put_param_u32(buf, len, dev->wtx_interval_max_us);
+		case TAG_IFDSE_POLL_DENSE_US:
+			return put_param_u32(buf, len, dev->wtx_dense_us);
+		case TAG_IFDSE_GUARD_TIME_US:
+			return put_param_u32(buf, len, dev->guard_time_us);
+		case TAG_IFDSE_RESPONSE_TIMEOUT_MS:
+			return put_param_u32(buf, len, dev->timeout_ms);
+		default:
+			return -ENOENT;
+	}
+}
+
+static int halse_kerkey_get_param(struct halse_dev *device, DWORD tag, unsigned char *buf, size_t *len)
+{
+	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
+	int ret;
+
+	pthread_mutex_lock(&dev->lock);
+	ret = halse_kerkey_get_param_dev(dev, tag, buf, len);
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
+}
+
+static int halse_kerkey_set_param_dev(struct halse_kerkey_dev *dev, DWORD tag, uint32_t v)
+{
+	switch (tag) {
+		case TAG_IFDSE_APDU_TIMEOUT_MS:
+			dev->apdu_timeout_ms = v;
+			return 0;
+		case TAG_IFDSE_POLL_INTERVAL_US:
+			if (v == 0 || v > dev->wtx_interval_max_us)
+				return -EINVAL;
+			dev->wtx_interval_us = v;
+			return 0;
+		case TAG_IFDSE_POLL_MAX_INTERVAL_US:
+			if (v < dev->wtx_interval_us || v > MAX_TUNE_US)
+				return -EINVAL;
+			dev->wtx_interval_max_us = v;
+			return 0;
+		case TAG_IFDSE_POLL_DENSE_US:
+			if (v > MAX_TUNE_US)
+				return -EINVAL;
+			dev->wtx_dense_us = v;
+			return 0;
+		case TAG_IFDSE_GUARD_TIME_US:
+			if (v == 0 || v > MAX_TUNE_US)
+				return -EINVAL;
+			dev->guard_time_us = v;
+			return 0;
+		case TAG_IFDSE_RESPONSE_TIMEOUT_MS:
+			if (v == 0 || v > MAX_TUNE_TIMEOUT_MS)
+				return -EINVAL;
+			dev->timeout_ms = v;
+			return 0;
+		default:
+			return -ENOENT;
+	}
+}
+
+static int halse_kerkey_set_param(struct halse_dev *device, DWORD tag, const unsigned char *buf, size_t len)
+{
+	struct halse_kerkey_dev *dev = container_of(device, struct halse_kerkey_dev, device);
+	uint32_t v;
+	int ret;
+
+	ret = get_param_u32(buf, len, &v);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&dev->lock);
+	ret = halse_kerkey_set_param_dev(dev, tag, v);
+	pthread_mutex_unlock(&dev->lock);
+
+	return ret;
 }
 
 struct halse_dev* halse_open_kerkey(char* config)
@@ -409,6 +790,10 @@ struct halse_dev* halse_open_kerkey(char* config)
 
 	/* Initialial kerkey timeout */
 	dev->timeout_ms = 10000;
+	dev->guard_time_us = GUARD_TIME_US;
+	dev->wtx_interval_us = WTX_INTERVAL_US;
+	dev->wtx_interval_max_us = WTX_INTERVAL_MAX_US;
+	dev->wtx_dense_us = WTX_DENSE_US;
 
 	ret = halse_kerkey_open(dev);
 	if (ret) {
@@ -417,12 +802,19 @@ struct halse_dev* halse_open_kerkey(char* config)
 		return NULL;
 	}
 
+	pthread_mutex_init(&dev->lock, NULL);
+
 	dev->device.close = halse_kerkey_close;
 	dev->device.get_atr = halse_kerkey_get_atr;
 	dev->device.power_up = halse_kerkey_power_up;
 	dev->device.power_down = halse_kerkey_power_down;
 	dev->device.warm_reset = halse_kerkey_warm_reset;
 	dev->device.xfer = halse_kerkey_xfer;
+	dev->device.get_param = halse_kerkey_get_param;
+	dev->device.set_param = halse_kerkey_set_param;
+	dev->device.probe = halse_kerkey_probe;
+	dev->device.mem = dev;
+	dev->device.mem_len = sizeof(*dev);
 
 	return &dev->device;
 }
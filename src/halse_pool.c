@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A pool aggregates several identical SEs behind one reader.
+ * APDUs on the basic channel matching the allowlist (stateless
+ * operations like random generation) go to the member with the fewest
+ * transfers so far. A pool is a single-slot reader, so pcscd serializes
+ * its calls: the APDUs are spread over the members, but they don't run
+ * in parallel. Everything else goes to the first member (the primary),
+ * so that any state (selected applets, sessions) lives on one SE.
+ *
+ * The members are powered and reset together with the primary, and the
+ * last SELECT on the basic channel of the primary is replayed on a
+ * member before it gets an allowlisted APDU. As long as the selection
+ * of the primary is unknown (failed SELECT or transfer), all APDUs go
+ * to the primary.
+ *
+ * Config: "<member>|<member>|...[|allow:<CLA>:<INS>[:<P1>:<P2>]]..."
+ * where <member> is a complete SE config (e.g. "se:se05x@i2c:...")
+ * and CLA/INS/P1/P2 are hex bytes or '*' (P1/P2 default to '*').
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "halse_pool.h"
+
+#define MAX_POOL_MEMBERS 8
+#define MAX_POOL_RULES 16
+
+/* Longest SELECT (short APDU) that can be replayed */
+#define MAX_POOL_SELECT (5 + 255 + 1)
+
+struct halse_pool_rule {
+	/* CLA, INS, P1, P2 */
+	uint8_t val[4];
+	uint8_t mask[4];
+};
+
+struct halse_pool_member {
+	struct halse_dev *dev;
+	pthread_mutex_t lock; /* Serializes the transfers of the member */
+	unsigned long gen; /* State of the primary taken over (member lock) */
+	size_t inflight; /* Protected by the pool lock */
+	size_t n_xfers; /* Protected by the pool lock */
+};
+
+struct halse_pool_dev {
+	/* Embed halse device */
+	struct halse_dev device;
+	struct halse_pool_member members[MAX_POOL_MEMBERS];
+	size_t n_members;
+	struct halse_pool_rule rules[MAX_POOL_RULES];
+	size_t n_rules;
+	pthread_mutex_t lock; /* Protects the load of the members and the state */
+	/* State of the primary (0 is never a valid generation) */
+	unsigned long gen;
+	bool select_valid;
+	unsigned char select[MAX_POOL_SELECT];
+	size_t select_len;
+};
+
+/* An APDU on the basic channel (interindustry or proprietary class) */
+static bool halse_pool_basic(const unsigned char *tx_buf, size_t tx_len)
+{
+	return tx_len >= 4 && tx_buf[0] != 0xFF && !(tx_buf[0] & 0x43);
+}
+
+static bool halse_pool_allowed(struct halse_pool_dev *dev,
+	const unsigned char *tx_buf, size_t tx_len)
+{
+	size_t i, j;
+
+	if (!halse_pool_basic(tx_buf, tx_len))
+		return false;
+
+	for (i = 0; i < dev->n_rules; i++) {
+		const struct halse_pool_rule *r = &dev->rules[i];
+		for (j = 0; j < 4; j++) {
+			if ((tx_buf[j] & r->mask[j]) != r->val[j])
+				break;
+		}
+		if (j == 4)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Select the member for the APDU and account it as in flight.
+ */
+static struct halse_pool_member* halse_pool_get(struct halse_pool_dev *dev,
+	const unsigned char *tx_buf, size_t tx_len)
+{
+	struct halse_pool_member *m = &dev->members[0];
+	size_t i;
+
+	pthread_mutex_lock(&dev->lock);
+
+	if (dev->select_valid && halse_pool_allowed(dev, tx_buf, tx_len)) {
+		for (i = 1; i < dev->n_members; i++) {
+			struct halse_pool_member *c = &dev->members[i];
+			if (c->inflight < m->inflight ||
+			    (c->inflight == m->inflight && c->n_xfers < m->n_xfers))
+				m = c;
+		}
+	}
+
+	m->inflight++;
+	m->n_xfers++;
+
+	pthread_mutex_unlock(&dev->lock);
+
+	return m;
+}
+
+static void halse_pool_put(struct halse_pool_dev *dev, struct halse_pool_member *m)
+{
+	pthread_mutex_lock(&dev->lock);
+	m->inflight--;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+/*
+ * Let a member take over the selection of the primary by replaying
+ * its last SELECT (member lock is held).
+ * Returns 0 on success, or -1 if the member can't be used.
+ */
+static int halse_pool_sync(struct halse_pool_dev *dev, struct halse_pool_member *m)
+{
+	unsigned char select[MAX_POOL_SELECT];
+	unsigned char rsp[256 + 2];
+	size_t select_len, rsp_len = sizeof(rsp);
+	unsigned long gen;
+	int ret;
+
+	pthread_mutex_lock(&dev->lock);
+	gen = dev->select_valid ? dev->gen : 0;
+	select_len = dev->select_len;
+	memcpy(select, dev->select, select_len);
+	pthread_mutex_unlock(&dev->lock);
+
+	if (!gen)
+		return -1;
+	if (m->gen == gen)
+		return 0;
+
+	if (select_len) {
+		ret = halse_xfer(m->dev, select, select_len, rsp, &rsp_len);
+		if (ret || rsp_len < 2 ||
+		    rsp[rsp_len - 2] != 0x90 || rsp[rsp_len - 1] != 0x00) {
+			Log1(PCSC_LOG_ERROR, "Failed to replay SELECT on pool member");
+			m->gen = 0;
+			return -1;
+		}
+	}
+
+	m->gen = gen;
+	return 0;
+}
+
+/*
+ * Track the selection on the basic channel of the primary.
+ */
+static void halse_pool_track(struct halse_pool_dev *dev, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len, int ret)
+{
+	bool select = halse_pool_basic(tx_buf, tx_len) && tx_buf[1] == 0xA4;
+
+	if (!ret && !select)
+		return;
+
+	pthread_mutex_lock(&dev->lock);
+	dev->gen++;
+	if (!ret && rx_len >= 2 && rx_buf[rx_len - 2] == 0x90 &&
+	    rx_buf[rx_len - 1] == 0x00 && tx_len <= sizeof(dev->select)) {
+		memcpy(dev->select, tx_buf, tx_len);
+		dev->select_len = tx_len;
+		dev->select_valid = true;
+	} else {
+		/* A failed SELECT or transfer leaves the selection unknown. */
+		dev->select_valid = false;
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static int halse_pool_xfer(struct halse_dev *device, unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+	struct halse_pool_member *primary = &dev->members[0];
+	struct halse_pool_member *m = halse_pool_get(dev, tx_buf, tx_len);
+	int ret;
+
+	pthread_mutex_lock(&m->lock);
+	if (m != primary && halse_pool_sync(dev, m)) {
+		pthread_mutex_unlock(&m->lock);
+		halse_pool_put(dev, m);
+		m = primary;
+		pthread_mutex_lock(&dev->lock);
+		m->inflight++;
+		m->n_xfers++;
+		pthread_mutex_unlock(&dev->lock);
+		pthread_mutex_lock(&m->lock);
+	}
+
+	ret = halse_xfer(m->dev, tx_buf, tx_len, rx_buf, rx_len);
+	if (m == primary)
+		halse_pool_track(dev, tx_buf, tx_len, rx_buf, ret ? 0 : *rx_len, ret);
+	else if (ret)
+		m->gen = 0; /* The recovery of the member might have lost its selection */
+	pthread_mutex_unlock(&m->lock);
+
+	halse_pool_put(dev, m);
+
+	return ret;
+}
+
+static int halse_pool_get_atr(struct halse_dev *device, unsigned char *buf, size_t *len)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+	struct halse_dev *primary = dev->members[0].dev;
+
+	return primary->get_atr(primary, buf, len);
+}
+
+/*
+ * Call a power/reset operation on all members,
+ * which leaves nothing selected on them.
+ * Returns 0 on success, or the first error.
+ */
+static int halse_pool_for_each(struct halse_pool_dev *dev,
+	int (*op)(struct halse_dev *member))
+{
+	unsigned long gen;
+	size_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->lock);
+	gen = ++dev->gen;
+	dev->select_len = 0;
+	dev->select_valid = true;
+	pthread_mutex_unlock(&dev->lock);
+
+	for (i = 0; i < dev->n_members; i++) {
+		struct halse_pool_member *m = &dev->members[i];
+
+		pthread_mutex_lock(&m->lock);
+		int r = op(m->dev);
+		m->gen = r ? 0 : gen;
+		pthread_mutex_unlock(&m->lock);
+
+		if (r && !ret)
+			ret = r;
+		if (r && i == 0) {
+			pthread_mutex_lock(&dev->lock);
+			dev->select_valid = false;
+			pthread_mutex_unlock(&dev->lock);
+		}
+	}
+
+	return ret;
+}
+
+static int halse_pool_member_power_up(struct halse_dev *member)
+{
+	return halse_power_up(member);
+}
+
+static int halse_pool_member_power_down(struct halse_dev *member)
+{
+	return halse_power_down(member);
+}
+
+static int halse_pool_member_warm_reset(struct halse_dev *member)
+{
+	return halse_warm_reset(member);
+}
+
+static int halse_pool_power_up(struct halse_dev *device)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+
+	return halse_pool_for_each(dev, halse_pool_member_power_up);
+}
+
+static int halse_pool_power_down(struct halse_dev *device)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+
+	return halse_pool_for_each(dev, halse_pool_member_power_down);
+}
+
+static int halse_pool_warm_reset(struct halse_dev *device)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+
+	return halse_pool_for_each(dev, halse_pool_member_warm_reset);
+}
+
+static int halse_pool_get_param(struct halse_dev *device, DWORD tag,
+	unsigned char *buf, size_t *len)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+
+	return halse_get_param(dev->members[0].dev, tag, buf, len);
+}
+
+static int halse_pool_set_param(struct halse_dev *device, DWORD tag,
+	const unsigned char *buf, size_t len)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < dev->n_members && !ret; i++)
+		ret = halse_set_param(dev->members[i].dev, tag, buf, len);
+
+	return ret;
+}
+
+static void halse_pool_close(struct halse_dev *device)
+{
+	struct halse_pool_dev *dev = container_of(device, struct halse_pool_dev, device);
+	size_t i;
+
+	for (i = 0; i < dev->n_members; i++) {
+		halse_destroy(dev->members[i].dev);
+		pthread_mutex_destroy(&dev->members[i].lock);
+	}
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
+}
+
+static int halse_pool_parse_byte(const char *p, uint8_t *v, uint8_t *mask)
+{
+	char *endptr;
+	unsigned long l;
+
+	if (strcmp(p, "*") == 0) {
+		*v = 0;
+		*mask = 0;
+		return 0;
+	}
+
+	errno = 0;
+	l = strtoul(p, &endptr, 16);
+	if (errno != 0 || p == endptr || *endptr != '\0' || l > 0xFF)
+		return -1;
+
+	*v = (uint8_t)l;
+	*mask = 0xFF;
+	return 0;
+}
+
+/*
+ * Parse an allowlist entry "<CLA>:<INS>[:<P1>:<P2>]".
+ */
+static int halse_pool_parse_rule(struct halse_pool_dev *dev, char *p)
+{
+	struct halse_pool_rule *r;
+	char *entry = p;
+	size_t n = 0;
+
+	if (dev->n_rules == MAX_POOL_RULES) {
+		Log1(PCSC_LOG_ERROR, "Too many allowlist entries!");
+		return -1;
+	}
+
+	r = &dev->rules[dev->n_rules];
+	memset(r, 0, sizeof(*r));
+	while (p) {
+		char *next = strchr(p, ':');
+		if (next)
+			*next++ = '\0';
+		if (n == 4 || halse_pool_parse_byte(p, &r->val[n], &r->mask[n]))
+			goto invalid;
+		n++;
+		p = next;
+	}
+
+	if (n != 2 && n != 4)
+		goto invalid;
+
+	dev->n_rules++;
+	return 0;
+
+invalid:
+	Log2(PCSC_LOG_ERROR, "Invalid allowlist entry: '%s'", entry);
+	return -1;
+}
+
+static int halse_pool_parse(struct halse_pool_dev *dev, char* config)
+{
+	char *fields[MAX_POOL_MEMBERS + MAX_POOL_RULES];
+	size_t n_fields = 0, i;
+	char *p = config;
+
+	/* Split first, as the members tokenize their own config. */
+	while (p) {
+		if (n_fields == sizeof(fields) / sizeof(fields[0])) {
+			Log1(PCSC_LOG_ERROR, "Too many pool entries!");
+			return -1;
+		}
+		fields[n_fields++] = p;
+		p = strchr(p, '|');
+		if (p)
+			*p++ = '\0';
+	}
+
+	for (i = 0; i < n_fields; i++) {
+		p = fields[i];
+		if (starts_with("allow:", p)) {
+			p = strchr(p, ':');
+			p++;
+			if (halse_pool_parse_rule(dev, p))
+				return -1;
+		} else if (starts_with("se:", p)) {
+			struct halse_pool_member *m;
+			if (dev->n_members == MAX_POOL_MEMBERS) {
+				Log1(PCSC_LOG_ERROR, "Too many pool members!");
+				return -1;
+			}
+			m = &dev->members[dev->n_members];
+			m->dev = halse_create(p);
+			if (!m->dev) {
+				Log2(PCSC_LOG_ERROR, "Failed to create pool member %zu", dev->n_members);
+				return -1;
+			}
+			pthread_mutex_init(&m->lock, NULL);
+			dev->n_members++;
+		} else {
+			Log2(PCSC_LOG_ERROR, "Invalid token in config string: '%s'", p);
+			return -1;
+		}
+	}
+
+	if (!dev->n_members) {
+		Log1(PCSC_LOG_ERROR, "Pool without members!");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct halse_dev* halse_open_pool(char* config)
+{
+	int ret;
+	struct halse_pool_dev *dev;
+
+	if (!config)
+		return NULL;
+
+	Log2(PCSC_LOG_DEBUG, "Trying to create pool with config: '%s'", config);
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	pthread_mutex_init(&dev->lock, NULL);
+
+	ret = halse_pool_parse(dev, config);
+	if (ret) {
+		Log1(PCSC_LOG_ERROR, "pool string can't be parsed!");
+		halse_pool_close(&dev->device);
+		return NULL;
+	}
+
+	Log3(PCSC_LOG_INFO, "Pool with %zu members, %zu allowlist entries",
+		dev->n_members, dev->n_rules);
+
+	/* The members are fresh, nothing is selected. */
+	dev->gen = 1;
+	dev->select_valid = true;
+	for (size_t i = 0; i < dev->n_members; i++)
+		dev->members[i].gen = dev->gen;
+
+	dev->device.close = halse_pool_close;
+	dev->device.get_atr = halse_pool_get_atr;
+	dev->device.power_up = halse_pool_power_up;
+	dev->device.power_down = halse_pool_power_down;
+	dev->device.warm_reset = halse_pool_warm_reset;
+	dev->device.xfer = halse_pool_xfer;
+	dev->device.get_param = halse_pool_get_param;
+	dev->device.set_param = halse_pool_set_param;
+
+	return &dev->device;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse_presence.h"
+
+/* Consecutive failed transfers, after which the SE is considered failed. */
+#define MAX_XFER_ERRORS 3
+
+struct halse_presence {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t events; /* Number of state changes */
+	bool failed;
+	bool stop;
+	size_t xfer_errors;
+};
+
+/* Called with the lock held. */
+static void halse_presence_event(struct halse_presence *p)
+{
+	p->events++;
+	pthread_cond_broadcast(&p->cond);
+}
+
+void halse_presence_xfer(struct halse_presence *p, int ret)
+{
+	pthread_mutex_lock(&p->lock);
+
+	if (!ret) {
+		p->xfer_errors = 0;
+	} else if (ret != -ENOSPC && ret != -EINVAL) {
+		/* Errors of the caller don't count. */
+		p->xfer_errors++;
+		if (p->xfer_errors == MAX_XFER_ERRORS && !p->failed) {
+			Log2(PCSC_LOG_ERROR, "SE failed (%d consecutive transfer errors)",
+				MAX_XFER_ERRORS);
+			p->failed = true;
+			halse_presence_event(p);
+		}
+	}
+
+	pthread_mutex_unlock(&p->lock);
+}
+
+void halse_presence_power(struct halse_presence *p, int ret)
+{
+	pthread_mutex_lock(&p->lock);
+
+	p->xfer_errors = 0;
+	if (ret && !p->failed)
+		Log2(PCSC_LOG_ERROR, "SE failed (power action: %d)", ret);
+	else if (!ret && p->failed)
+		Log1(PCSC_LOG_INFO, "SE recovered");
+	p->failed = ret != 0;
+	halse_presence_event(p);
+
+	pthread_mutex_unlock(&p->lock);
+}
+
+void halse_presence_retry(struct halse_presence *p)
+{
+	pthread_mutex_lock(&p->lock);
+
+	if (p->failed) {
+		p->xfer_errors = 0;
+		p->failed = false;
+		halse_presence_event(p);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+}
+
+bool halse_presence_present(struct halse_presence *p)
+{
+	bool present;
+
+	pthread_mutex_lock(&p->lock);
+	present = !p->failed;
+	pthread_mutex_unlock(&p->lock);
+
+	return present;
+}
+
+int halse_presence_wait(struct halse_presence *p, int timeout_ms)
+{
+	uint64_t events, deadline_us = 0;
+	struct timespec ts;
+	bool stopped;
+	int ret = 0;
+
+	if (timeout_ms > 0) {
+		deadline_us = monotonic_us() + (uint64_t)timeout_ms * 1000;
+		ts.tv_sec = deadline_us / 1000000;
+		ts.tv_nsec = (deadline_us % 1000000) * 1000;
+	}
+
+	pthread_mutex_lock(&p->lock);
+
+	events = p->events;
+	while (p->events == events && !p->stop && ret != ETIMEDOUT) {
+		if (deadline_us)
+			ret = pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+		else
+			pthread_cond_wait(&p->cond, &p->lock);
+	}
+	events = p->events - events;
+	stopped = p->stop;
+	p->stop = false;
+
+	pthread_mutex_unlock(&p->lock);
+
+	if (events)
+		return 1;
+	return stopped ? -EINTR : 0;
+}
+
+void halse_presence_stop(struct halse_presence *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+struct halse_presence* halse_presence_create(void)
+{
+	struct halse_presence *p;
+	pthread_condattr_t attr;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+
+	/* Timeouts are based on monotonic_us(). */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return p;
+}
+
+void halse_presence_destroy(struct halse_presence *p)
+{
+	if (!p)
+		return;
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
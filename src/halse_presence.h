@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_PRESENCE_H_
+#define HALSE_PRESENCE_H_
+
+#include <stdbool.h>
+
+/*
+ * Presence state of a slot.
+ *
+ * A SE can't be removed, but it can fail: a failed power action or
+ * a number of consecutive failed transfers mark it as failed (i.e.
+ * not present). Every state change (failure, recovery, reset) is an
+ * event, which wakes up halse_presence_wait().
+ */
+
+struct halse_presence;
+
+/* Create the state of a present SE. */
+struct halse_presence* halse_presence_create(void);
+
+/* Free the state (no waiter must be left; NULL is ignored). */
+void halse_presence_destroy(struct halse_presence *p);
+
+/* Account the result of a transfer. */
+void halse_presence_xfer(struct halse_presence *p, int ret);
+
+/* Account the result of a power up or reset. */
+void halse_presence_power(struct halse_presence *p, int ret);
+
+/*
+ * Report a failed SE as present again (without touching the SE), so
+ * that the next power up can try to recover it.
+ */
+void halse_presence_retry(struct halse_presence *p);
+
+/* Returns false if the SE has failed. */
+bool halse_presence_present(struct halse_presence *p);
+
+/*
+ * Wait for the next event, for at most timeout_ms (<= 0: no limit)
+ * or until halse_presence_stop() is called.
+ * Returns 1 if an event has occurred, 0 on timeout, or -EINTR if stopped.
+ */
+int halse_presence_wait(struct halse_presence *p, int timeout_ms);
+
+/* Wake up the waiter of halse_presence_wait(). */
+void halse_presence_stop(struct halse_presence *p);
+
+#endif /* HALSE_PRESENCE_H_ */
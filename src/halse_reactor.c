@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <debuglog.h>
+
+#include "halse_reactor.h"
+#include "halse_async.h"
+#include "helpers.h"
+
+struct halse_reactor_req {
+	struct halse_xfer xfer;
+	struct halse_dev *dev;
+	struct halse_reactor_req *next;
+	bool done;
+	pthread_cond_t cond;
+};
+
+struct halse_reactor {
+	pthread_t thread;
+	struct halse_loop *loop;
+	struct halse_loop_watch watch; /* Watches event_fd */
+	pthread_mutex_t lock; /* Protects queue, stop and done of the reqs */
+	struct halse_reactor_req *queue; /* In submission order */
+	struct halse_reactor_req **queue_tail;
+	bool stop;
+	size_t n_devs;
+	bool dedicated; /* Thread of a single device with real-time settings */
+};
+
+/* Protects the thread array and the device assignment. */
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct halse_reactor reactors[MAX_REACTOR_THREADS];
+static size_t n_reactors;
+
+static void halse_reactor_done(struct halse_xfer *xfer)
+{
+	struct halse_reactor_req *req = container_of(xfer, struct halse_reactor_req, xfer);
+	struct halse_reactor *r = req->dev->reactor;
+
+	pthread_mutex_lock(&r->lock);
+	req->done = true;
+	pthread_cond_signal(&req->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static int halse_reactor_handler(struct halse_loop_watch *watch)
+{
+	struct halse_reactor *r = container_of(watch, struct halse_reactor, watch);
+	struct halse_reactor_req *req;
+	uint64_t cnt;
+	int ret;
+
+	if (read(watch->fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		Log2(PCSC_LOG_ERROR, "Reading eventfd failed: %d", errno);
+
+	pthread_mutex_lock(&r->lock);
+	req = r->queue;
+	r->queue = NULL;
+	r->queue_tail = &r->queue;
+	pthread_mutex_unlock(&r->lock);
+
+	while (req) {
+		struct halse_reactor_req *next = req->next;
+
+		ret = halse_xfer_submit(r->loop, req->dev, &req->xfer);
+		if (ret) {
+			req->xfer.ret = ret;
+			halse_reactor_done(&req->xfer);
+		}
+
+		req = next;
+	}
+
+	return 0;
+}
+
+static void* halse_reactor_main(void *arg)
+{
+	struct halse_reactor *r = arg;
+	bool stop = false;
+
+	while (!stop) {
+		if (halse_loop_dispatch(r->loop, -1) < 0)
+			break;
+
+		pthread_mutex_lock(&r->lock);
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	return NULL;
+}
+
+static void halse_reactor_kick(struct halse_reactor *r)
+{
+	uint64_t one = 1;
+
+	if (write(r->watch.fd, &one, sizeof(one)) < 0)
+		Log2(PCSC_LOG_ERROR, "Writing eventfd failed: %d", errno);
+}
+
+static void halse_reactor_release(struct halse_reactor *r)
+{
+	if (r->watch.fd >= 0)
+		close(r->watch.fd);
+	halse_loop_destroy(r->loop);
+	pthread_mutex_destroy(&r->lock);
+}
+
+static int halse_reactor_start(struct halse_reactor *r)
+{
+	int ret;
+
+	r->queue = NULL;
+	r->queue_tail = &r->queue;
+	r->stop = false;
+	r->n_devs = 0;
+	pthread_mutex_init(&r->lock, NULL);
+
+	r->watch.handler = halse_reactor_handler;
+	r->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->loop = halse_loop_create();
+	if (r->watch.fd < 0 || !r->loop) {
+		Log1(PCSC_LOG_ERROR, "Could not create reactor!");
+		halse_reactor_release(r);
+		return -ENOMEM;
+	}
+
+	ret = halse_loop_watch_add(r->loop, &r->watch);
+	if (ret) {
+		halse_reactor_release(r);
+		return ret;
+	}
+
+	ret = pthread_create(&r->thread, NULL, halse_reactor_main, r);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Could not start reactor thread: %d", ret);
+		halse_reactor_release(r);
+		return -ret;
+	}
+
+	return 0;
+}
+
+static void halse_reactor_stop(struct halse_reactor *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->stop = true;
+	pthread_mutex_unlock(&r->lock);
+
+	halse_reactor_kick(r);
+	pthread_join(r->thread, NULL);
+	halse_reactor_release(r);
+}
+
+/*
+ * Start a thread for a device with real-time settings, so that they
+ * neither apply to nor are overridden by other devices.
+ */
+static int halse_reactor_attach_dedicated(struct halse_dev *dev)
+{
+	struct halse_reactor *r;
+	int ret;
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return -ENOMEM;
+	}
+
+	ret = halse_reactor_start(r);
+	if (ret) {
+		free(r);
+		return ret;
+	}
+
+	r->n_devs = 1;
+	r->dedicated = true;
+	dev->reactor = r;
+	halse_rt_apply(&dev->rt, r->thread);
+
+	Log1(PCSC_LOG_DEBUG, "Device attached to its own reactor thread");
+
+	return 0;
+}
+
+int halse_reactor_attach(struct halse_dev *dev, size_t n_threads)
+{
+	struct halse_reactor *r;
+	size_t i;
+	int ret = 0;
+
+	if (n_threads == 0 || n_threads > MAX_REACTOR_THREADS)
+		return -EINVAL;
+
+	/* Don't allocate on the I/O path. */
+	ret = halse_async_prepare(dev);
+	if (ret)
+		return ret;
+
+	if (halse_rt_enabled(&dev->rt))
+		return halse_reactor_attach_dedicated(dev);
+
+	pthread_mutex_lock(&reactor_lock);
+
+	while (n_reactors < n_threads) {
+		ret = halse_reactor_start(&reactors[n_reactors]);
+		if (ret)
+			break;
+		n_reactors++;
+	}
+
+	if (!n_reactors) {
+		pthread_mutex_unlock(&reactor_lock);
+		return ret;
+	}
+
+	/* Pick the thread with the least devices. */
+	r = &reactors[0];
+	for (i = 1; i < n_reactors; i++) {
+		if (reactors[i].n_devs < r->n_devs)
+			r = &reactors[i];
+	}
+
+	r->n_devs++;
+	dev->reactor = r;
+
+	pthread_mutex_unlock(&reactor_lock);
+
+	Log2(PCSC_LOG_DEBUG, "Device attached to reactor thread %zu",
+		(size_t)(r - reactors));
+
+	return 0;
+}
+
+void halse_reactor_detach(struct halse_dev *dev)
+{
+	size_t i, n_devs = 0;
+
+	if (!dev->reactor)
+		return;
+
+	if (dev->reactor->dedicated) {
+		halse_reactor_stop(dev->reactor);
+		free(dev->reactor);
+		dev->reactor = NULL;
+		return;
+	}
+
+	pthread_mutex_lock(&reactor_lock);
+
+	dev->reactor->n_devs--;
+	dev->reactor = NULL;
+
+	for (i = 0; i < n_reactors; i++)
+		n_devs += reactors[i].n_devs;
+
+	if (!n_devs) {
+		for (i = 0; i < n_reactors; i++)
+			halse_reactor_stop(&reactors[i]);
+		n_reactors = 0;
+	}
+
+	pthread_mutex_unlock(&reactor_lock);
+}
+
+int halse_reactor_xfer(struct halse_dev *dev, unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_reactor *r = dev->reactor;
+	struct halse_reactor_req req = {
+		.xfer = {
+			.tx_buf = tx_buf,
+			.tx_len = tx_len,
+			.rx_buf = rx_buf,
+			.rx_len = *rx_len,
+			.done = halse_reactor_done,
+		},
+		.dev = dev,
+	};
+
+	if (!r)
+		return dev->xfer(dev, tx_buf, tx_len, rx_buf, rx_len);
+
+	pthread_cond_init(&req.cond, NULL);
+
+	pthread_mutex_lock(&r->lock);
+	*r->queue_tail = &req;
+	r->queue_tail = &req.next;
+	pthread_mutex_unlock(&r->lock);
+
+	halse_reactor_kick(r);
+
+	pthread_mutex_lock(&r->lock);
+	while (!req.done)
+		pthread_cond_wait(&req.cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_cond_destroy(&req.cond);
+
+	*rx_len = req.xfer.rx_len;
+	return req.xfer.ret;
+}
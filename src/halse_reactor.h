@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_REACTOR_H_
+#define HALSE_REACTOR_H_
+
+#include <stddef.h>
+
+#include "halse.h"
+
+/*
+ * The reactor owns the I/O of attached devices.
+ * It consists of a few threads, each running an event loop
+ * (see halse_async.h), which multiplexes the transfers of all
+ * devices assigned to it. Devices with real-time settings (see
+ * halse_rt.h) get a thread of their own. Transfers from other
+ * threads are handed over via a queue and an eventfd.
+ */
+
+#define MAX_REACTOR_THREADS 4
+
+/*
+ * Attach a device to the reactor. The reactor is started on demand
+ * with up to n_threads threads (1..MAX_REACTOR_THREADS); the device
+ * is assigned to the thread with the least devices. A device with
+ * a priority or CPU list gets a new thread with these settings.
+ *
+ * Returns 0 on success, or -ve on error.
+ */
+int halse_reactor_attach(struct halse_dev *dev, size_t n_threads);
+
+/*
+ * Detach a device (no transfer must be pending).
+ * The reactor is stopped when the last device is detached.
+ */
+void halse_reactor_detach(struct halse_dev *dev);
+
+/*
+ * Run a transfer on the reactor thread of the device and wait
+ * for its completion (same semantics as the xfer() callback).
+ */
+int halse_reactor_xfer(struct halse_dev *dev, unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len);
+
+#endif /* HALSE_REACTOR_H_ */
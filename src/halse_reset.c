@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse_reset.h"
+
+#define US_PER_MS 1000
+
+struct halse_reset {
+	bool by_atr;
+
+	/* Protects the fields below. */
+	pthread_mutex_t lock;
+	size_t window_ms;
+	uint64_t fresh_us; /* Time of the last reset (0: SE used since) */
+	size_t coalesced;
+	size_t by_atr_count;
+};
+
+bool halse_reset_coalesce(struct halse_reset *r)
+{
+	bool skip;
+
+	pthread_mutex_lock(&r->lock);
+	skip = r->fresh_us && r->window_ms &&
+		monotonic_us() - r->fresh_us < r->window_ms * US_PER_MS;
+	if (skip)
+		r->coalesced++;
+	pthread_mutex_unlock(&r->lock);
+
+	if (skip)
+		Log1(PCSC_LOG_DEBUG, "SE has just been reset, skipping");
+
+	return skip;
+}
+
+void halse_reset_set_window(struct halse_reset *r, size_t window_ms)
+{
+	pthread_mutex_lock(&r->lock);
+	r->window_ms = window_ms;
+	pthread_mutex_unlock(&r->lock);
+}
+
+size_t halse_reset_window(struct halse_reset *r)
+{
+	size_t window_ms;
+
+	pthread_mutex_lock(&r->lock);
+	window_ms = r->window_ms;
+	pthread_mutex_unlock(&r->lock);
+
+	return window_ms;
+}
+
+bool halse_reset_by_atr(struct halse_reset *r)
+{
+	return r->by_atr;
+}
+
+void halse_reset_done(struct halse_reset *r, int ret, bool by_atr)
+{
+	pthread_mutex_lock(&r->lock);
+	r->fresh_us = ret ? 0 : monotonic_us();
+	if (!ret && by_atr)
+		r->by_atr_count++;
+	pthread_mutex_unlock(&r->lock);
+}
+
+void halse_reset_used(struct halse_reset *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->fresh_us = 0;
+	pthread_mutex_unlock(&r->lock);
+}
+
+struct halse_reset* halse_reset_create(size_t window_ms, bool by_atr)
+{
+	struct halse_reset *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	r->window_ms = window_ms;
+	r->by_atr = by_atr;
+	pthread_mutex_init(&r->lock, NULL);
+
+	return r;
+}
+
+void halse_reset_destroy(struct halse_reset *r)
+{
+	if (!r)
+		return;
+
+	Log3(PCSC_LOG_INFO, "Reset policy: %zu resets coalesced, %zu satisfied by ATR",
+		r->coalesced, r->by_atr_count);
+
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_RESET_H_
+#define HALSE_RESET_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Reset policy of a SE.
+ *
+ * PCSC lite and its clients often request a power up and a reset
+ * (or several resets) right after each other. A power up or reset
+ * within window_ms after the last successful one, without any
+ * transfer or power down in between, finds the SE in the state
+ * after a reset and is coalesced with it (i.e. skipped).
+ *
+ * Optionally, resets can be satisfied by fetching the ATR without
+ * a reset (refresh_atr() callback of the provider), which keeps the
+ * state of the SE (e.g. for clients, which reset the card on every
+ * connect).
+ */
+
+struct halse_reset;
+
+/*
+ * Create a policy (window_ms: 0...no coalescing).
+ * Returns the new object on success, or NULL otherwise.
+ */
+struct halse_reset* halse_reset_create(size_t window_ms, bool by_atr);
+
+/* Free the policy (NULL is ignored). */
+void halse_reset_destroy(struct halse_reset *r);
+
+/* Check if a power up or reset can be skipped (counted if so). */
+bool halse_reset_coalesce(struct halse_reset *r);
+
+/* Change the coalescing window (0...no coalescing). */
+void halse_reset_set_window(struct halse_reset *r, size_t window_ms);
+
+/* Coalescing window. */
+size_t halse_reset_window(struct halse_reset *r);
+
+/* Check if resets should be satisfied by an ATR fetch. */
+bool halse_reset_by_atr(struct halse_reset *r);
+
+/* Account a power up or reset (by_atr: satisfied by an ATR fetch). */
+void halse_reset_done(struct halse_reset *r, int ret, bool by_atr);
+
+/* Account a transfer or power down (the SE is no longer fresh). */
+void halse_reset_used(struct halse_reset *r);
+
+#endif /* HALSE_RESET_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "halse_ring.h"
+
+void halse_ring_init(struct halse_ring *ring)
+{
+	__atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+}
+
+struct halse_ring_msg* halse_ring_reserve(struct halse_ring *ring)
+{
+	uint32_t head = ring->head; /* Only written by us */
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= HALSE_RING_SLOTS)
+		return NULL;
+
+	return &ring->msgs[head % HALSE_RING_SLOTS];
+}
+
+void halse_ring_push(struct halse_ring *ring)
+{
+	/* Publish the contents of the message before the index. */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+struct halse_ring_msg* halse_ring_peek(struct halse_ring *ring, int *corrupt)
+{
+	uint32_t tail = ring->tail; /* Only written by us */
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	*corrupt = head - tail > HALSE_RING_SLOTS;
+	if (head == tail || *corrupt)
+		return NULL;
+
+	return &ring->msgs[tail % HALSE_RING_SLOTS];
+}
+
+void halse_ring_pop(struct halse_ring *ring)
+{
+	/* Done with the contents of the message before releasing it. */
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
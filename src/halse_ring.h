@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_RING_H_
+#define HALSE_RING_H_
+
+#include <stdint.h>
+
+/*
+ * Single producer, single consumer ring of messages, which can live
+ * in memory shared between two processes (see halse_broker_proto.h).
+ *
+ * The producer fills the message returned by halse_ring_reserve()
+ * in place and publishes it with halse_ring_push(), the consumer
+ * processes the message returned by halse_ring_peek() in place and
+ * releases it with halse_ring_pop(). Neither side blocks or makes a
+ * system call; waking up the other side is up to the user (eventfd).
+ *
+ * The indices are free running. Since the other side might be
+ * misbehaving, the consumer validates the distance of the indices.
+ */
+
+/* Number of messages of a ring (power of 2). */
+#define HALSE_RING_SLOTS 4
+
+/* Max. payload of a message (a command or response APDU in extended length). */
+#define HALSE_RING_MAX_DATA (4 + 3 + (1 << 16) + 3 + 2)
+
+struct halse_ring_msg {
+	uint32_t op;
+	uint32_t arg; /* Op specific (e.g. the tag of a parameter) */
+	int32_t ret; /* Result (responses only) */
+	uint32_t len; /* Bytes in data */
+	uint64_t seq; /* Copied from the request to the response */
+	unsigned char data[HALSE_RING_MAX_DATA];
+};
+
+struct halse_ring {
+	/* Written by the producer only (own cache line). */
+	uint32_t head __attribute__((aligned(64)));
+	/* Written by the consumer only (own cache line). */
+	uint32_t tail __attribute__((aligned(64)));
+	struct halse_ring_msg msgs[HALSE_RING_SLOTS] __attribute__((aligned(64)));
+};
+
+/* Reset an unused ring to empty. */
+void halse_ring_init(struct halse_ring *ring);
+
+/* Producer: get the next free message, or NULL if the ring is full. */
+struct halse_ring_msg* halse_ring_reserve(struct halse_ring *ring);
+
+/* Producer: publish the message returned by halse_ring_reserve(). */
+void halse_ring_push(struct halse_ring *ring);
+
+/*
+ * Consumer: get the oldest published message, or NULL if the ring is empty.
+ * Returns NULL and sets *corrupt if the indices are inconsistent.
+ */
+struct halse_ring_msg* halse_ring_peek(struct halse_ring *ring, int *corrupt);
+
+/* Consumer: release the message returned by halse_ring_peek(). */
+void halse_ring_pop(struct halse_ring *ring);
+
+#endif /* HALSE_RING_H_ */
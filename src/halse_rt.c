@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <debuglog.h>
+
+#include "halse_rt.h"
+
+#define MAX_CPUS 64
+
+int halse_rt_parse_cpus(const char *p, uint64_t *mask)
+{
+	char *endptr;
+	unsigned long first, last, cpu;
+
+	*mask = 0;
+
+	for (;;) {
+		errno = 0;
+		first = strtoul(p, &endptr, 0);
+		if (errno != 0 || p == endptr || first >= MAX_CPUS)
+			return -EINVAL;
+		p = endptr;
+
+		last = first;
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &endptr, 0);
+			if (errno != 0 || p == endptr || last >= MAX_CPUS || last < first)
+				return -EINVAL;
+			p = endptr;
+		}
+
+		for (cpu = first; cpu <= last; cpu++)
+			*mask |= (uint64_t)1 << cpu;
+
+		if (*p == '\0')
+			return 0;
+		if (*p != ',')
+			return -EINVAL;
+		p++;
+	}
+}
+
+void halse_rt_apply(const struct halse_rt *rt, pthread_t thread)
+{
+	int ret;
+
+	if (rt->cpumask) {
+		cpu_set_t set;
+		size_t cpu;
+
+		CPU_ZERO(&set);
+		for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+			if (rt->cpumask & ((uint64_t)1 << cpu))
+				CPU_SET(cpu, &set);
+		}
+
+		ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+		if (ret)
+			Log2(PCSC_LOG_ERROR, "Could not set CPU affinity: %d", ret);
+	}
+
+	if (rt->prio) {
+		struct sched_param param = {
+			.sched_priority = rt->prio,
+		};
+
+		ret = pthread_setschedparam(thread, SCHED_FIFO, &param);
+		if (ret)
+			Log2(PCSC_LOG_ERROR, "Could not set SCHED_FIFO priority: %d", ret);
+	}
+}
+
+void halse_rt_lock(const struct halse_rt *rt, const void *addr, size_t len)
+{
+	/* Avoid page faults in the I/O path. */
+	if (!rt->mlock || !addr || !len)
+		return;
+
+	if (mlock(addr, len))
+		Log3(PCSC_LOG_ERROR, "Could not lock %zu bytes of memory: %d", len, errno);
+}
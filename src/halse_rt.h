@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_RT_H_
+#define HALSE_RT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Real-time settings of a SE. A priority or CPU list gives the SE its
+ * own reactor thread, so that neither the threads of pcscd nor the
+ * other SEs get its scheduling. Memory locking covers the memory of
+ * the I/O path of the SE (driver state and coroutine stack) only.
+ */
+struct halse_rt {
+	int prio; /* SCHED_FIFO priority (0...don't change) */
+	uint64_t cpumask; /* CPU affinity (0...don't change) */
+	bool mlock; /* Lock the memory of the I/O path */
+};
+
+/* Needs a thread of its own. */
+static inline bool halse_rt_enabled(const struct halse_rt *rt)
+{
+	return rt->prio || rt->cpumask;
+}
+
+/*
+ * Parse a CPU list like "0-1,3" into a mask (CPUs 0..63).
+ * Returns 0 on success, or -ve on error.
+ */
+int halse_rt_parse_cpus(const char *p, uint64_t *mask);
+
+/*
+ * Apply the scheduling settings to the given thread.
+ * Failures are logged but not fatal (e.g. missing CAP_SYS_NICE).
+ */
+void halse_rt_apply(const struct halse_rt *rt, pthread_t thread);
+
+/*
+ * Lock the pages of [addr, addr + len) into memory, if mlock is set.
+ * Locks aren't counted, so heap memory is never unlocked (the pages
+ * might be shared); mappings lose their locks when they are unmapped.
+ * Failures are logged but not fatal (e.g. missing CAP_IPC_LOCK).
+ */
+void halse_rt_lock(const struct halse_rt *rt, const void *addr, size_t len);
+
+#endif /* HALSE_RT_H_ */
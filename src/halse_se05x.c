@@ -22,17 +22,21 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <debuglog.h>
+#include <reader.h>
 
 #include "helpers.h"
+#include "halsched.h"
 #include "hali2c.h"
 #include "halgpio.h"
 #include "halse.h"
+#include "halse_se05x_rng.h"
 
 #define SEGT_us 10 /* SE05x guard time between I2C transactions. */
 #define MPOT_ms 1 /* Minimum polling time. */
@@ -40,13 +44,46 @@
 #define PWT_ms 5 /* Power-wakeup time. */
 #define US_PER_MS 1000
 
+/*
+ * Poll schedule while waiting for a block: poll every MPOT for at least
+ * POLL_DENSE_us (or twice the expected response time), then back off up to
+ * 1/POLL_BACKOFF_DIV of the waiting time.
+ */
+#define POLL_DENSE_us (10 * US_PER_MS)
+#define POLL_BACKOFF_DIV 64
+
+/* Upper bound of the random prefetch buffer. */
+#define MAX_RNG_SIZE (64 * 1024)
+
 #define SE05X_NAD 0x5A
 #define HOST_NAD 0xA5
 
+/*
+ * Error recovery limits (ISO 7816-3, 11.6.3).
+ * A corrupted or unexpected block is first answered with an R-block
+ * requesting retransmission. If that does not help, the sequence numbers
+ * are resynchronized (S(RESYNCH)) and the APDU is restarted. As the last
+ * resort a soft reset brings the SE05x back into a defined state.
+ */
+#define MAX_RNAK 3 /* R-blocks with error per received block. */
+#define MAX_RESYNC 1 /* S(RESYNCH) attempts per APDU. */
+
+/* Delay before each APDU (see halse_se05x_xfer_dev()). */
+#define XFER_DELAY_us (1 * US_PER_MS)
+
+/* Upper bounds of the tunables (see halse_se05x_set_param()). */
+#define MAX_TUNE_US (1000 * US_PER_MS)
+#define MAX_TUNE_BWT_ms (60 * 1000)
+#define MAX_TUNE_RETRIES 16
+
 #define SIZE_PROLOGUE 3
 #define SIZE_INF_MAX 254
 #define SIZE_EPILOGUE 2
 
+#define ATR_SIZE_HEADER 6 /* PVER(1), VID(5) */
+#define ATR_SIZE_DLLP 4 /* BWT(2), IFSC(2) */
+#define ATR_SIZE_PLP 11 /* MCF(2), CONFIG(1), MPOT(1), RFU(3), SEGT(2), WUT(2) */
+
 /*
  * I-Block has the form:
  *   0 N(S) M 0 0 0 0 0
@@ -100,6 +137,23 @@ static const uint8_t noreset_atr[] = {
 	0x50, 0x4F, 0x0B,
 };
 
+/* Parsed SE05x ATR (see halse_se05x_parse_atr()). */
+struct halse_se05x_atr
+{
+	uint8_t pver; /* Protocol version */
+	uint8_t vid[5]; /* Vendor ID */
+	size_t bwt_ms; /* Block waiting time */
+	size_t ifsc; /* Max. information field size of the SE05x */
+	uint8_t plid; /* Physical layer ID */
+	size_t mcf_khz; /* Max. I2C clock frequency */
+	uint8_t config; /* Physical layer configuration */
+	size_t mpot_ms; /* Minimum polling time */
+	size_t segt_us; /* Guard time between I2C transactions */
+	size_t wut_us; /* Wake-up time */
+	size_t hb_off; /* Offset of the historical bytes in the ATR */
+	size_t hb_len; /* Length of the historical bytes */
+};
+
 struct halse_se05x_dev
 {
 	/* Embed halse device */
@@ -109,16 +163,60 @@ struct halse_se05x_dev
 	struct hali2c_dev *i2c_dev;
 	struct halgpio_dev *gpio_dev;
 
-	/* Cached data from the device. */
-	unsigned char *atr;
+	/* Cached data from the device (atr_len is 0 if there is no ATR). */
+	unsigned char atr[SIZE_INF_MAX];
 	size_t atr_len;
-	size_t timeout_us;
-	size_t guard_time_us;
-	size_t max_retries;
+	struct halse_se05x_atr atr_info;
+	bool atr_valid;
+
+	/* Timing (derived from the ATR). */
+	size_t timeout_us; /* Poll interval (MPOT). */
+	size_t guard_time_us; /* Guard time (SEGT). */
+	size_t bwt_ms; /* Block waiting time (BWT). */
+	size_t max_retries; /* Polls per BWT. */
+	size_t pwt_us; /* Power-wakeup time (WUT). */
+
+	/*
+	 * Tunables (see halse.h). The timing values override the ATR
+	 * (0: use the ATR), the others default to the defines above.
+	 */
+	size_t cfg_timeout_us;
+	size_t cfg_guard_time_us;
+	size_t cfg_bwt_ms;
+	size_t poll_dense_us;
+	size_t max_rnak;
+	size_t max_resync;
+	size_t xfer_delay_us;
+
+	/* Deadline handling. */
+	size_t apdu_timeout_ms; /* Deadline per APDU (0: none). */
+	uint64_t apdu_deadline_us; /* Absolute deadline of the current APDU. */
+	size_t resp_ewma_us; /* Average response time of APDUs. */
+	bool need_resync; /* Last APDU was aborted. */
+	size_t wtx_count;
+
+	/*
+	 * Information field sizes.
+	 * card_ifsc: max. INF size the SE05x accepts (from ATR or S(IFS) request).
+	 * ifsc: max. INF size we send (card_ifsc limited by ifs_max).
+	 * ifsd: max. INF size the SE05x may send to us (negotiated via S(IFS)).
+	 * ifs_max: upper bound for both (configured via "ifs:<n>").
+	 */
+	size_t card_ifsc;
+	size_t ifsc;
+	size_t ifsd;
+	size_t ifs_max;
 
 	/* Transfer state. */
 	int n_s;
 	int n_r;
+	bool cmd_sent; /* The last I-block of the command has been sent */
+	bool cmd_acked; /* ...and the SE05x has started to process it */
+
+	/* Error recovery statistics (one counter per rung). */
+	size_t rnak_count;
+	size_t resync_count;
+	size_t soft_reset_count;
 
 	/*
 	 * Exchange buffers for blocks.
@@ -135,9 +233,33 @@ struct halse_se05x_dev
 	 * is disabled.
 	 */
 	bool noreset;
+
+	/* Random prefetch (configured via "rng:<size>[:<max_age_ms>]"). */
+	size_t rng_size;
+	size_t rng_max_age_ms;
+	struct halse_se05x_rng *rng;
+
+	/*
+	 * Serializes the device operations, which can be called from
+	 * different threads (parameters via the other slots of a reader,
+	 * the prefetch worker).
+	 */
+	pthread_mutex_t lock;
 };
 
-static int halse_se05x_recv_block(struct halse_se05x_dev *dev, size_t *len);
+static inline void halse_se05x_lock(struct halse_se05x_dev *dev)
+{
+	pthread_mutex_lock(&dev->lock);
+}
+
+static inline void halse_se05x_unlock(struct halse_se05x_dev *dev)
+{
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static int halse_se05x_recv_block(struct halse_se05x_dev *dev, size_t *len,
+		int (*expected)(uint8_t pcb), size_t expected_us);
+static int halse_se05x_set_ifsd(struct halse_se05x_dev *dev, size_t ifsd);
 static int halse_se05x_power_up(struct halse_dev *device);
 static int halse_se05x_power_down(struct halse_dev *device);
 static void halse_se05x_close(struct halse_dev *device);
@@ -145,23 +267,37 @@ static int halse_se05x_warm_reset(struct halse_dev *device);
 
 static inline int halse_se05x_read_i2c(struct halse_se05x_dev *dev, unsigned char *buf, size_t len)
 {
-	/*
-	 * We need to wait between two I2C transactions.
-	 * As this guard time is so short, we simply do that always.
-	 */
-	usleep(dev->guard_time_us);
-
+	/* The guard time (SEGT) is enforced by the I2C layer. */
 	return hali2c_read_with_retry(dev->i2c_dev, buf, len, dev->max_retries, dev->timeout_us);
 }
 
-static inline int halse_se05x_write_i2c(struct halse_se05x_dev *dev, const unsigned char *buf, size_t len)
+/*
+ * Wait up to wait_us (and not beyond the APDU deadline) for the SE05x
+ * to respond. The SE05x is polled densely around the expected response
+ * time and less often afterwards.
+ */
+static int halse_se05x_wait_i2c(struct halse_se05x_dev *dev, unsigned char *buf, size_t len,
+		size_t wait_us, size_t expected_us)
 {
-	/*
-	 * We need to wait between two I2C transactions.
-	 * As this guard time is so short, we simply do that always.
-	 */
-	usleep(dev->guard_time_us);
+	struct hali2c_poll poll;
+
+	poll.deadline_us = monotonic_us() + wait_us;
+	if (dev->apdu_deadline_us && dev->apdu_deadline_us < poll.deadline_us)
+		poll.deadline_us = dev->apdu_deadline_us;
+	poll.dense_us = 2 * expected_us;
+	if (poll.dense_us < dev->poll_dense_us)
+		poll.dense_us = dev->poll_dense_us;
+	poll.interval_us = dev->timeout_us;
+	poll.max_interval_us = wait_us / POLL_BACKOFF_DIV;
+	if (poll.max_interval_us < poll.interval_us)
+		poll.max_interval_us = poll.interval_us;
+
+	return hali2c_read_poll(dev->i2c_dev, buf, len, &poll);
+}
 
+static inline int halse_se05x_write_i2c(struct halse_se05x_dev *dev, const unsigned char *buf, size_t len)
+{
+	/* The guard time (SEGT) is enforced by the I2C layer. */
 	return hali2c_write_with_retry(dev->i2c_dev, buf, len, dev->max_retries, dev->timeout_us);
 }
 
@@ -200,6 +336,7 @@ static inline void halse_se05x_clear_state(struct halse_se05x_dev *dev)
 	/* Reset the sequence numbers. */
 	dev->n_s = 0;
 	dev->n_r = 0;
+	dev->need_resync = false;
 }
 
 static inline void halse_se05x_clear_buf(struct halse_se05x_dev *dev)
@@ -345,28 +482,17 @@ static int halse_se05x_send_i_block(struct halse_se05x_dev *dev,
 
 	if (chain) {
 		/* In case of chaining, let's consume the token passing. */
-		ret = halse_se05x_recv_block(dev, &len);
+		ret = halse_se05x_recv_block(dev, &len, is_r_block, 0);
 		if (ret) {
 			Log2(PCSC_LOG_ERROR, "Receiving block failed: %d", ret);
 			return ret;
 		}
 
 		uint8_t pcb = dev->rxbuf[1];
-		if (!is_r_block(pcb)) {
-			Log2(PCSC_LOG_ERROR, "Received block is not R-block (PCB: 0x%hhx)", pcb);
-			return -1;
-		}
-
-		uint8_t ee = pcb & CMD_ERROR_MASK;
-		if (ee) {
-			Log2(PCSC_LOG_ERROR, "Received R-block with error (0x%hhx)", ee);
-			return -1;
-		}
-
 		uint8_t n_r = (pcb>>4) & 0x01;
 		if (n_r != dev->n_s) {
 			Log2(PCSC_LOG_ERROR, "Received R-block with wrong N(R) (0x%hhx)", n_r);
-			return -1;
+			return -EPROTO;
 		}
 	}
 
@@ -390,28 +516,31 @@ static int halse_se05x_send_r_block(struct halse_se05x_dev *dev,
 }
 
 /*
- * Read a block from the SE05x.
- * This function transparently handles WTX requests and
- * does CRC checking.
+ * Read a single block from the SE05x and verify it.
  *
  * @dev Device to read from.
  * @len Location where the length of the INF field will be stored.
+ * @wait_us Max. time to wait for the block.
+ * @expected_us Expected response time.
  *
- * @return 0 on success, or -ve on error.
+ * @return 0 on success, -EBADMSG if the block is corrupted,
+ *         or -ve on I2C errors.
  */
-static int halse_se05x_recv_block(struct halse_se05x_dev *dev, size_t *len)
+static int halse_se05x_read_block(struct halse_se05x_dev *dev, size_t *len,
+		size_t wait_us, size_t expected_us)
 {
 	int ret;
 
-	ret = halse_se05x_read_i2c(dev, dev->rxbuf, SIZE_PROLOGUE + SIZE_EPILOGUE);
+	ret = halse_se05x_wait_i2c(dev, dev->rxbuf, SIZE_PROLOGUE + SIZE_EPILOGUE,
+			wait_us, expected_us);
 	if (ret) {
 		Log2(PCSC_LOG_ERROR, "Read from I2C failed: %d", ret);
-		return -1;
+		return ret < 0 ? ret : -EIO;
 	}
 
 	if (dev->rxbuf[2] > SIZE_INF_MAX) {
 		Log3(PCSC_LOG_ERROR, "Invalid LEN received: (%d > %d)", dev->rxbuf[2], SIZE_INF_MAX);
-		return -1;
+		return -EBADMSG;
 	}
 
 	*len = dev->rxbuf[2];
@@ -420,7 +549,7 @@ static int halse_se05x_recv_block(struct halse_se05x_dev *dev, size_t *len)
 		ret = halse_se05x_read_i2c(dev, dev->rxbuf + off, *len);
 		if (ret) {
 			Log2(PCSC_LOG_ERROR, "Read from I2C failed: %d", ret);
-			return -1;
+			return ret < 0 ? ret : -EIO;
 		}
 	}
 
@@ -436,45 +565,376 @@ static int halse_se05x_recv_block(struct halse_se05x_dev *dev, size_t *len)
 	/* Check for CRC errors. */
 	if (exp_crc != act_crc) {
 		Log3(PCSC_LOG_ERROR, "act_crc (0x%hx) != exp_crc (0x%hx)", act_crc, exp_crc);
-		return -1;
+		return -EBADMSG;
 	}
 
-	uint8_t pcb = dev->rxbuf[1];
-	/* Check if we got an S-Block with a request. */
-	if (is_s_block_request(pcb)) {
-		switch (pcb & CMD_TYPE_MASK) {
-			case CMD_WTX:
-				Log1(PCSC_LOG_ERROR, "Received WTX");
-
-				/* Got a waiting time extension, let's ack that. */
-				ret = halse_se05x_send_s_block(dev, CMD_RES, CMD_WTX, &dev->rxbuf[3], 1);
-				if (ret) {
-					Log2(PCSC_LOG_ERROR, "Sending WTX response failed: %d", ret);
-					return -1;
-				}
-				/* Let's do a tail call. */
-				return halse_se05x_recv_block(dev, len);
-			default:
-				Log2(PCSC_LOG_ERROR, "Received unsupported command: 0x%hhx", pcb);
-				return -1;
+	return 0;
+}
+
+/*
+ * Ask the SE05x to retransmit its last block (R-block with error).
+ * Returns -EPROTO if the retransmission budget is exhausted.
+ */
+static int halse_se05x_send_nak(struct halse_se05x_dev *dev,
+		size_t *rnak, uint8_t ee)
+{
+	int ret;
+
+	if (*rnak >= dev->max_rnak) {
+		Log2(PCSC_LOG_ERROR, "Giving up after %zu retransmission requests", *rnak);
+		return -EPROTO;
+	}
+
+	(*rnak)++;
+	dev->rnak_count++;
+
+	ret = halse_se05x_send_r_block(dev, dev->n_r, ee);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Sending R-block failed: %d", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Read a block from the SE05x.
+ * This function transparently handles WTX requests and
+ * does CRC checking. Corrupted blocks and blocks of an
+ * unexpected type are re-requested via R-blocks.
+ *
+ * @dev Device to read from.
+ * @len Location where the length of the INF field will be stored.
+ * @expected Predicate for the expected block type (or NULL for any).
+ * @expected_us Expected response time (0 if unknown).
+ *
+ * @return 0 on success, -EPROTO on unrecoverable protocol errors,
+ *         or -ve on other errors.
+ */
+static int halse_se05x_recv_block(struct halse_se05x_dev *dev, size_t *len,
+		int (*expected)(uint8_t pcb), size_t expected_us)
+{
+	int ret;
+	size_t rnak = 0;
+	size_t wait_us = dev->bwt_ms * US_PER_MS;
+
+	for (;;) {
+		ret = halse_se05x_read_block(dev, len, wait_us, expected_us);
+		if (ret == -EBADMSG) {
+			ret = halse_se05x_send_nak(dev, &rnak, EE_CRC_ERROR);
+			if (ret)
+				return ret;
+			continue;
+		} else if (ret) {
+			return ret;
+		}
+
+		uint8_t pcb = dev->rxbuf[1];
+		/* Check if we got an S-Block with a request. */
+		if (is_s_block_request(pcb)) {
+			switch (pcb & CMD_TYPE_MASK) {
+				case CMD_WTX:
+					if (*len != 1 || dev->rxbuf[3] == 0) {
+						Log2(PCSC_LOG_ERROR, "Received invalid WTX request (len: %zu)", *len);
+						return -EPROTO;
+					}
+
+					/* The next block is due within BWT x multiplier. */
+					wait_us = dev->bwt_ms * US_PER_MS * dev->rxbuf[3];
+					expected_us = 0;
+					dev->wtx_count++;
+					if (dev->cmd_sent)
+						dev->cmd_acked = true;
+					Log2(PCSC_LOG_DEBUG, "Received WTX (%zu us)", wait_us);
+
+					/* Got a waiting time extension, let's ack that. */
+					ret = halse_se05x_send_s_block(dev, CMD_RES, CMD_WTX, &dev->rxbuf[3], 1);
+					if (ret) {
+						Log2(PCSC_LOG_ERROR, "Sending WTX response failed: %d", ret);
+						return -1;
+					}
+					continue;
+				case CMD_SET_IFC:
+					if (*len != 1 || dev->rxbuf[3] == 0 || dev->rxbuf[3] == 0xFF) {
+						Log2(PCSC_LOG_ERROR, "Received invalid IFS request (len: %zu)", *len);
+						return -EPROTO;
+					}
+
+					/* The SE05x announces a new IFSC, let's ack that. */
+					dev->card_ifsc = dev->rxbuf[3];
+					dev->ifsc = dev->card_ifsc;
+					if (dev->ifsc > dev->ifs_max)
+						dev->ifsc = dev->ifs_max;
+					Log2(PCSC_LOG_INFO, "SE05x requested IFSC: %zu", dev->card_ifsc);
+
+					ret = halse_se05x_send_s_block(dev, CMD_RES, CMD_SET_IFC, &dev->rxbuf[3], 1);
+					if (ret) {
+						Log2(PCSC_LOG_ERROR, "Sending IFS response failed: %d", ret);
+						return -1;
+					}
+					continue;
+				default:
+					Log2(PCSC_LOG_ERROR, "Received unsupported command: 0x%hhx", pcb);
+					return -EPROTO;
+			}
+		}
+
+		/* Check if we got an error */
+		if (is_r_block_with_error(pcb)) {
+			Log2(PCSC_LOG_ERROR, "Received R-block with error (PCB: 0x%hhx) -> retransmit", pcb);
+			ret = halse_se05x_resend(dev);
+			if (ret) {
+				Log2(PCSC_LOG_ERROR, "Retransmit failed: %d", ret);
+				return ret;
+			}
+			continue;
+		}
+
+		if (expected && !expected(pcb)) {
+			Log2(PCSC_LOG_ERROR, "Received unexpected block (PCB: 0x%hhx)", pcb);
+			ret = halse_se05x_send_nak(dev, &rnak, EE_OTHER_ERROR);
+			if (ret)
+				return ret;
+			continue;
 		}
+
+		return 0;
+	}
+}
+
+/*
+ * Resynchronize the sequence numbers (via CMD_RESYNC).
+ */
+static int halse_se05x_resync_dev(struct halse_se05x_dev *dev)
+{
+	int ret;
+
+	dev->resync_count++;
+
+	ret = halse_se05x_send_s_block_noinf(dev, CMD_REQ, CMD_RESYNC);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Sending RESYNC command failed: %d", ret);
+		return -1;
+	}
+
+	size_t len;
+	ret = halse_se05x_recv_block(dev, &len, is_s_block_response, 0);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Receiving response block failed: %d", ret);
+		return -1;
+	}
+
+	/* Sanity checks. */
+	if (dev->rxbuf[1] != (S_BLOCK | CMD_RES | CMD_RESYNC)) {
+		Log2(PCSC_LOG_ERROR, "Receiving unexpected PCB: 0x%hx", dev->rxbuf[1]);
+		return -1;
+	}
+
+	halse_se05x_clear_state(dev);
+
+	return 0;
+}
+
+/*
+ * Announce the max. INF size we accept from the SE05x (via CMD_SET_IFC).
+ */
+static int halse_se05x_set_ifsd(struct halse_se05x_dev *dev, size_t ifsd)
+{
+	int ret;
+	unsigned char inf = (unsigned char)ifsd;
+
+	if (ifsd == 0 || ifsd > SIZE_INF_MAX) {
+		Log2(PCSC_LOG_ERROR, "Invalid IFSD: %zu", ifsd);
+		return -EINVAL;
+	}
+
+	ret = halse_se05x_send_s_block(dev, CMD_REQ, CMD_SET_IFC, &inf, 1);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Sending IFS command failed: %d", ret);
+		return -1;
+	}
+
+	size_t len;
+	ret = halse_se05x_recv_block(dev, &len, is_s_block_response, 0);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Receiving response block failed: %d", ret);
+		return -1;
+	}
+
+	/* Sanity checks. */
+	if (dev->rxbuf[1] != (S_BLOCK | CMD_RES | CMD_SET_IFC) ||
+	    len != 1 || dev->rxbuf[3] != inf) {
+		Log2(PCSC_LOG_ERROR, "Receiving unexpected IFS response (PCB: 0x%hx)", dev->rxbuf[1]);
+		return -1;
+	}
+
+	dev->ifsd = ifsd;
+	Log2(PCSC_LOG_DEBUG, "IFSD: %zu", dev->ifsd);
+
+	return 0;
+}
+
+static inline size_t atr_be16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/*
+ * Parse the SE05x ATR (see UM11225) into dev->atr_info.
+ *
+ * The SE05x ATR looks as follows:
+ * - PVER(1)
+ * - VID(5)
+ * - DLLP_LEN(1)
+ * - DLLP(DLLP_LEN): BWT(2), IFSC(2)
+ * - PLID (1)
+ * - PLP_LEN (1)
+ * - PLP(PLP_LEN): MCF(2), CONFIG(1), MPOT(1), RFU(3), SEGT(2), WUT(2)
+ * - HB_LEN (1)
+ * - HB(HB_LEN)
+ *
+ * Parameters, which are not present are set to 0.
+ *
+ * @return 0 on success, or -1 if the ATR is malformed.
+ */
+static int halse_se05x_parse_atr(struct halse_se05x_dev *dev)
+{
+	struct halse_se05x_atr *info = &dev->atr_info;
+	const unsigned char *atr = dev->atr;
+	size_t len = dev->atr_len;
+	size_t off = 0;
+
+	memset(info, 0, sizeof(*info));
+
+	/* PVER, VID, DLLP_LEN */
+	if (len < ATR_SIZE_HEADER + 1)
+		goto malformed;
+	info->pver = atr[0];
+	memcpy(info->vid, &atr[1], sizeof(info->vid));
+	off = ATR_SIZE_HEADER;
+
+	/* DLLP */
+	size_t dllp_len = atr[off++];
+	if (off + dllp_len + 2 > len)
+		goto malformed;
+	if (dllp_len >= ATR_SIZE_DLLP) {
+		const unsigned char *dllp = &atr[off];
+		info->bwt_ms = atr_be16(&dllp[0]);
+		info->ifsc = atr_be16(&dllp[2]);
+	}
+	off += dllp_len;
+
+	/* PLID, PLP_LEN, PLP */
+	info->plid = atr[off++];
+	size_t plp_len = atr[off++];
+	if (off + plp_len + 1 > len)
+		goto malformed;
+	if (plp_len >= ATR_SIZE_PLP) {
+		const unsigned char *plp = &atr[off];
+		info->mcf_khz = atr_be16(&plp[0]);
+		info->config = plp[2];
+		info->mpot_ms = plp[3];
+		info->segt_us = atr_be16(&plp[7]);
+		info->wut_us = atr_be16(&plp[9]);
 	}
+	off += plp_len;
+
+	/* HB_LEN, HB */
+	info->hb_len = atr[off++];
+	if (off + info->hb_len > len)
+		goto malformed;
+	info->hb_off = off;
+
+	Log5(PCSC_LOG_DEBUG, "ATR: BWT: %zu ms, IFSC: %zu, MPOT: %zu ms, SEGT: %zu us",
+		info->bwt_ms, info->ifsc, info->mpot_ms, info->segt_us);
+	Log3(PCSC_LOG_DEBUG, "ATR: WUT: %zu us, MCF: %zu kHz", info->wut_us, info->mcf_khz);
+
+	dev->atr_valid = true;
+	return 0;
+
+malformed:
+	Log2(PCSC_LOG_ERROR, "Malformed ATR (length: %zu)", len);
+	memset(info, 0, sizeof(*info));
+	dev->atr_valid = false;
+	return -1;
+}
+
+/*
+ * Derive the link layer parameters from the parsed ATR.
+ * Parameters the SE05x does not report fall back to the
+ * (worst-case) defaults, tuned parameters override the ATR.
+ */
+static void halse_se05x_apply_atr(struct halse_se05x_dev *dev)
+{
+	const struct halse_se05x_atr *info = &dev->atr_info;
+
+	dev->guard_time_us = info->segt_us ? info->segt_us : SEGT_us;
+	if (dev->cfg_guard_time_us)
+		dev->guard_time_us = dev->cfg_guard_time_us;
+	hali2c_set_guard_time(dev->i2c_dev, dev->guard_time_us);
+	dev->timeout_us = info->mpot_ms ? info->mpot_ms * US_PER_MS : MPOT_ms * US_PER_MS;
+	if (dev->cfg_timeout_us)
+		dev->timeout_us = dev->cfg_timeout_us;
+	dev->bwt_ms = info->bwt_ms ? info->bwt_ms : BWT_ms;
+	if (dev->cfg_bwt_ms)
+		dev->bwt_ms = dev->cfg_bwt_ms;
+	dev->max_retries = dev->bwt_ms * US_PER_MS / dev->timeout_us;
+	if (dev->max_retries == 0)
+		dev->max_retries = 1;
+	dev->pwt_us = info->wut_us ? info->wut_us : PWT_ms * US_PER_MS;
+
+	/* The LEN field of a block is a single byte (0xFF is reserved). */
+	dev->card_ifsc = info->ifsc;
+	if (dev->card_ifsc == 0 || dev->card_ifsc > SIZE_INF_MAX)
+		dev->card_ifsc = SIZE_INF_MAX;
+}
+
+/*
+ * Apply the configured IFS limit to both directions.
+ * Needs to be called after each reset, as this restores the default IFSD.
+ */
+static int halse_se05x_apply_ifs(struct halse_se05x_dev *dev)
+{
+	int ret;
 
-	/* Check if we got an error */
-	if (is_r_block_with_error(pcb)) {
-		Log2(PCSC_LOG_ERROR, "Received R-block with error (PCB: 0x%hhx) -> retransmit", pcb);
-		ret = halse_se05x_resend(dev);
+	dev->ifsc = dev->card_ifsc;
+	if (dev->ifsc > dev->ifs_max)
+		dev->ifsc = dev->ifs_max;
+
+	dev->ifsd = SIZE_INF_MAX;
+	if (dev->ifs_max != SIZE_INF_MAX) {
+		ret = halse_se05x_set_ifsd(dev, dev->ifs_max);
 		if (ret) {
-			Log2(PCSC_LOG_ERROR, "Retransmit failed: %d", ret);
+			Log2(PCSC_LOG_ERROR, "IFS negotiation failed: %d", ret);
 			return ret;
 		}
-		/* Let's do a tail call. */
-		return halse_se05x_recv_block(dev, len);
 	}
 
 	return 0;
 }
 
+/*
+ * Cache the ATR (of len bytes) from the received S-block
+ * and derive the link layer parameters from it.
+ */
+static int halse_se05x_store_atr(struct halse_se05x_dev *dev, size_t len)
+{
+	/* The INF field of a block can't be larger. */
+	if (len > sizeof(dev->atr)) {
+		Log2(PCSC_LOG_ERROR, "ATR too long (%zu bytes)", len);
+		dev->atr_len = 0;
+		dev->atr_valid = false;
+		return -EINVAL;
+	}
+	memcpy(dev->atr, &dev->rxbuf[3], len);
+	dev->atr_len = len;
+
+	if (halse_se05x_parse_atr(dev) == 0)
+		halse_se05x_apply_atr(dev);
+
+	return 0;
+}
+
 /*
  * Do a warm reset to the SE (via CMD_SOFT_RESET).
  * After the reset the ATR will be cached.
@@ -490,7 +950,7 @@ static int halse_se05x_warm_reset_dev(struct halse_se05x_dev *dev)
 	}
 
 	size_t len;
-	ret = halse_se05x_recv_block(dev, &len);
+	ret = halse_se05x_recv_block(dev, &len, is_s_block_response, 0);
 	if (ret) {
 		Log2(PCSC_LOG_ERROR, "Receiving response block failed: %d", ret);
 		return -1;
@@ -502,10 +962,48 @@ static int halse_se05x_warm_reset_dev(struct halse_se05x_dev *dev)
 		return -1;
 	}
 
-	free(dev->atr);
-	dev->atr = malloc(len);
-	memcpy(dev->atr, &dev->rxbuf[3], len);
-	dev->atr_len = len;
+	ret = halse_se05x_store_atr(dev, len);
+	if (ret)
+		return ret;
+
+	return halse_se05x_apply_ifs(dev);
+}
+
+/*
+ * Get the ATR without a reset (via CMD_ATR).
+ * The state of the SE (including the negotiated IFSD) is preserved.
+ */
+static int halse_se05x_get_atr_dev(struct halse_se05x_dev *dev)
+{
+	int ret;
+
+	ret = halse_se05x_send_s_block_noinf(dev, CMD_REQ, CMD_ATR);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Sending ATR command failed: %d", ret);
+		return -1;
+	}
+
+	size_t len;
+	ret = halse_se05x_recv_block(dev, &len, is_s_block_response, 0);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Receiving response block failed: %d", ret);
+		return -1;
+	}
+
+	/* Sanity checks. */
+	if (dev->rxbuf[1] != (S_BLOCK | CMD_RES | CMD_ATR)) {
+		Log2(PCSC_LOG_ERROR, "Receiving unexpected PCB: 0x%hx", dev->rxbuf[1]);
+		return -1;
+	}
+
+	ret = halse_se05x_store_atr(dev, len);
+	if (ret)
+		return ret;
+
+	/* apply_atr() has updated the card's IFSC. */
+	dev->ifsc = dev->card_ifsc;
+	if (dev->ifsc > dev->ifs_max)
+		dev->ifsc = dev->ifs_max;
 
 	return 0;
 }
@@ -527,7 +1025,7 @@ static int halse_se05x_hard_reset_dev(struct halse_se05x_dev *dev)
 	}
 
 	size_t len;
-	ret = halse_se05x_recv_block(dev, &len);
+	ret = halse_se05x_recv_block(dev, &len, is_s_block_response, 0);
 	if (ret) {
 		Log2(PCSC_LOG_ERROR, "Receiving response block failed: %d", ret);
 		return -1;
@@ -574,6 +1072,37 @@ static int halse_se05x_parse(struct halse_se05x_dev *dev, char* config)
 		} else if (strcmp("noreset", p) == 0) {
 			Log1(PCSC_LOG_INFO, "Noreset is set");
 			dev->noreset = true;
+		} else if (starts_with("ifs:", p)) {
+			char *endptr;
+			p = strchr(p, ':');
+			p++;
+			errno = 0;
+			dev->ifs_max = strtoul(p, &endptr, 0);
+			if (errno != 0 || p == endptr || dev->ifs_max == 0 ||
+			    dev->ifs_max > SIZE_INF_MAX) {
+				Log2(PCSC_LOG_ERROR, "Invalid IFS in config string: '%s'", p);
+				return -1;
+			}
+			Log2(PCSC_LOG_INFO, "IFS is set to %zu", dev->ifs_max);
+		} else if (starts_with("rng:", p)) {
+			char *endptr;
+			p = strchr(p, ':');
+			p++;
+			errno = 0;
+			dev->rng_size = strtoul(p, &endptr, 0);
+			if (errno == 0 && *endptr == ':') {
+				char *age = endptr + 1;
+				dev->rng_max_age_ms = strtoul(age, &endptr, 0);
+				if (age == endptr)
+					errno = EINVAL;
+			}
+			if (errno != 0 || p == endptr || *endptr != '\0' ||
+			    dev->rng_size == 0 || dev->rng_size > MAX_RNG_SIZE) {
+				Log2(PCSC_LOG_ERROR, "Invalid random prefetch config: '%s'", p);
+				return -1;
+			}
+			Log3(PCSC_LOG_INFO, "Random prefetch: %zu bytes, max. age %zu ms",
+				dev->rng_size, dev->rng_max_age_ms);
 		} else {
 			Log2(PCSC_LOG_ERROR, "Invalid token in config string: '%s'", p);
 			return -1;
@@ -607,9 +1136,10 @@ static int halse_se05x_open(struct halse_dev *dev)
 		return -1;
 	}
 
-	ret = usleep(PWT_ms * US_PER_MS);
+	/* The actual wake-up time is not known before the first ATR. */
+	ret = halsched_sleep_us(PWT_ms * US_PER_MS);
 	if (ret) {
-		Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
+		Log1(PCSC_LOG_ERROR, "Sleeping failed!");
 		halse_se05x_close(dev);
 		return -1;
 	}
@@ -636,12 +1166,18 @@ static int halse_se05x_open(struct halse_dev *dev)
 static void halse_se05x_close(struct halse_dev *device)
 {
 	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+
+	Log5(PCSC_LOG_INFO, "T=1 recovery: %zu R-block NAKs, %zu resyncs, %zu soft resets, %zu WTX",
+		dev->rnak_count, dev->resync_count, dev->soft_reset_count, dev->wtx_count);
+
+	halse_se05x_rng_destroy(dev->rng);
+	dev->rng = NULL;
+	pthread_mutex_destroy(&dev->lock);
 	hali2c_close(dev->i2c_dev);
 	dev->i2c_dev = NULL;
 	halgpio_close(dev->gpio_dev);
 	dev->gpio_dev = NULL;
-	free(dev->atr);
-	dev->atr = NULL;
+	dev->atr_len = 0;
 }
 
 /*
@@ -651,15 +1187,15 @@ static int halse_se05x_get_atr(struct halse_dev* device, unsigned char *buf, siz
 {
 	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
 
-	if (dev->noreset && (dev->atr == NULL)) {
+	if (dev->noreset && !dev->atr_len) {
 		LogXxd(PCSC_LOG_INFO, "noreset-atr: ", noreset_atr, sizeof(noreset_atr));
 		memcpy(buf, noreset_atr, sizeof(noreset_atr));
 		*len = sizeof(noreset_atr);
 		return 0;
 	}
 
-	if (dev->atr == NULL) {
-		Log1(PCSC_LOG_ERROR, "SE05x has not yet reported an ATR.");
+	if (!dev->atr_len || !dev->atr_valid) {
+		Log1(PCSC_LOG_ERROR, "SE05x has not yet reported a valid ATR.");
 		return -1;
 	}
 
@@ -689,30 +1225,11 @@ static int halse_se05x_get_atr(struct halse_dev* device, unsigned char *buf, siz
 		0x00, /* TC(1) = 00 --> Extra guard time: 0 */
 		0x80, /* TD(1) = 80 --> Y(i+1) = 1000, Protocol T = 0 */
 		0x11, /* TD(2) = 11 --> Y(i+1) = 0001, Protocol T = 1 */
-		0xFE, /* TA(3) = FE --> IFSC: 254 */
+		0xFE, /* TA(3) = IFSC (replaced by the negotiated value) */
 	};
 
-	/*
-	 * The SE05x ATR looks as follows:
-	 * - PVER(1)
-	 * - VID(5)
-	 * - DLLP_LEN(1)
-	 * - DLLP(DLLP_LEN)
-	 * - PLID (1)
-	 * - PLP_LEN (1)
-	 * - PLP(PLP_LEN)
-	 * - HB_LEN (1)
-	 * - HB(HB_LEN)
-	 */
-
-	size_t offset_hb = 0;
-	size_t len_hb;
-	offset_hb += 1 + 5; /* PVER, VID */
-	offset_hb += 1 + dev->atr[offset_hb]; /* DLLP_LEN + DLLP */
-	offset_hb += 1; /* PLID */
-	offset_hb += 1 + dev->atr[offset_hb]; /* PLP_LEN + PLP */
-	len_hb = dev->atr[offset_hb];
-	offset_hb += 1; /* HB_LEN */
+	size_t offset_hb = dev->atr_info.hb_off;
+	size_t len_hb = dev->atr_info.hb_len;
 
 	/* Sanity check (HB can't be longer than 15) */
 	if (len_hb > 15) {
@@ -725,6 +1242,7 @@ static int halse_se05x_get_atr(struct halse_dev* device, unsigned char *buf, siz
 	memcpy(buf + i, atr_prologue, sizeof(atr_prologue));
 	i += sizeof(atr_prologue);
 	buf[1] |= len_hb; /* ATR len fixup (K in T0) */
+	buf[7] = dev->ifsc; /* IFSC fixup (TA(3)) */
 	memcpy(buf + i, &dev->atr[offset_hb], len_hb);
 	i += len_hb;
 	buf[i] = halse_se05x_calculate_xor(&buf[1], i-1); /* TCK */
@@ -734,10 +1252,9 @@ static int halse_se05x_get_atr(struct halse_dev* device, unsigned char *buf, siz
 	return 0;
 }
 
-static int halse_se05x_power_up(struct halse_dev *device)
+static int halse_se05x_power_up_dev(struct halse_se05x_dev *dev)
 {
 	int ret;
-	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
 
 	if (dev->gpio_dev) {
 		ret = halgpio_enable(dev->gpio_dev);
@@ -755,64 +1272,249 @@ static int halse_se05x_power_up(struct halse_dev *device)
 
 	halse_se05x_clear_state(dev);
 
-	ret = usleep(PWT_ms * US_PER_MS);
+	ret = halsched_sleep_us(dev->pwt_us);
 	if (ret) {
-		Log1(PCSC_LOG_ERROR, "Calling usleep failed!");
+		Log1(PCSC_LOG_ERROR, "Sleeping failed!");
 		return -1;
 	}
 
 	return 0;
 }
 
-static int halse_se05x_power_down(struct halse_dev *device)
+static int halse_se05x_power_up(struct halse_dev *device)
 {
 	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
-	return halgpio_disable(dev->gpio_dev);
+	int ret;
+
+	halse_se05x_lock(dev);
+	if (dev->rng)
+		halse_se05x_rng_reset(dev->rng);
+	ret = halse_se05x_power_up_dev(dev);
+	halse_se05x_unlock(dev);
+
+	return ret;
 }
 
-static int halse_se05x_warm_reset(struct halse_dev *device)
+static int halse_se05x_power_down(struct halse_dev *device)
 {
 	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+	int ret;
+
+	halse_se05x_lock(dev);
+	if (dev->rng)
+		halse_se05x_rng_reset(dev->rng);
+	ret = halgpio_disable(dev->gpio_dev);
+	halse_se05x_unlock(dev);
+
+	return ret;
+}
+
+static int halse_se05x_warm_reset_op(struct halse_se05x_dev *dev)
+{
 	if (!dev->noreset) {
 		halse_se05x_clear_state(dev);
 		return halse_se05x_warm_reset_dev(dev);
 	} else {
-		free(dev->atr);
-		dev->atr = NULL;
-		return 0;
+		dev->atr_len = 0;
+		return halse_se05x_apply_ifs(dev);
 	}
 }
 
-static int halse_se05x_xfer(struct halse_dev *device, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+static int halse_se05x_warm_reset(struct halse_dev *device)
 {
-	int ret = 0;
 	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
-	size_t tx_off = 0;
-	size_t rx_off = 0;
-	bool chain;
+	int ret;
 
-	//LogXxd(PCSC_LOG_INFO, "tx_buf: ", tx_buf, tx_len);
+	halse_se05x_lock(dev);
+	if (dev->rng)
+		halse_se05x_rng_reset(dev->rng);
+	ret = halse_se05x_warm_reset_op(dev);
+	halse_se05x_unlock(dev);
 
-	/*
-	 * This is an unspecified delay.
-	 *
-	 * Under high-load scenarios it was observed, that
-	 * certain devices get into a state, in which they
-	 * respond with EE_OTHER_ERROR and only a reset can
-	 * get them out of this state.
-	 * This delay reliably helped to address this issue.
-	 */
-	usleep(1 * US_PER_MS);
+	return ret;
+}
 
-	/* Sanity checks */
-	if (!tx_buf || !tx_len || !rx_buf || !rx_len) {
-		ret = -1;
-		goto end;
+/*
+ * Refresh the ATR without resetting the SE05x (see halse_reset.h).
+ */
+static int halse_se05x_refresh_atr(struct halse_dev *device)
+{
+	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+	int ret;
+
+	halse_se05x_lock(dev);
+	ret = halse_se05x_get_atr_dev(dev);
+	halse_se05x_clear_buf(dev);
+	halse_se05x_unlock(dev);
+
+	return ret;
+}
+
+/*
+ * Check if the SE05x is alive (see halse_health.h).
+ * Re-announcing the current IFSD is a S-block exchange,
+ * which doesn't change the state of the SE05x.
+ */
+static int halse_se05x_probe(struct halse_dev *device)
+{
+	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+	int ret;
+
+	halse_se05x_lock(dev);
+	ret = halse_se05x_set_ifsd(dev, dev->ifsd);
+	halse_se05x_clear_buf(dev);
+	halse_se05x_unlock(dev);
+
+	return ret;
+}
+
+static int halse_se05x_get_param_dev(struct halse_se05x_dev *dev, DWORD tag, unsigned char *buf, size_t *len)
+{
+	switch (tag) {
+		case SCARD_ATTR_CURRENT_IFSC:
+			return put_param_u32(buf, len, dev->ifsc);
+		case SCARD_ATTR_CURRENT_IFSD:
+			return put_param_u32(buf, len, dev->ifsd);
+		case SCARD_ATTR_MAX_IFSD:
+			return put_param_u32(buf, len, SIZE_INF_MAX);
+		case TAG_IFDSE_APDU_TIMEOUT_MS:
+			return put_param_u32(buf, len, dev->apdu_timeout_ms);
+		case TAG_IFDSE_POLL_INTERVAL_US:
+			return put_param_u32(buf, len, dev->timeout_us);
+		case TAG_IFDSE_POLL_DENSE_US:
+			return put_param_u32(buf, len, dev->poll_dense_us);
+		case TAG_IFDSE_GUARD_TIME_US:
+			return put_param_u32(buf, len, dev->guard_time_us);
+		case TAG_IFDSE_RESPONSE_TIMEOUT_MS:
+			return put_param_u32(buf, len, dev->bwt_ms);
+		case TAG_IFDSE_MAX_RNAK:
+			return put_param_u32(buf, len, dev->max_rnak);
+		case TAG_IFDSE_MAX_RESYNC:
+			return put_param_u32(buf, len, dev->max_resync);
+		case TAG_IFDSE_XFER_DELAY_US:
+			return put_param_u32(buf, len, dev->xfer_delay_us);
+		default:
+			return -ENOENT;
 	}
+}
+
+static int halse_se05x_get_param(struct halse_dev *device, DWORD tag, unsigned char *buf, size_t *len)
+{
+	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+	int ret;
+
+	halse_se05x_lock(dev);
+	ret = halse_se05x_get_param_dev(dev, tag, buf, len);
+	halse_se05x_unlock(dev);
+
+	return ret;
+}
+
+static int halse_se05x_set_param(struct halse_dev *device, DWORD tag, const unsigned char *buf, size_t len)
+{
+	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+	uint32_t v;
+	int ret;
+
+	ret = get_param_u32(buf, len, &v);
+	if (ret)
+		return ret;
+
+	halse_se05x_lock(dev);
+
+	switch (tag) {
+		case SCARD_ATTR_CURRENT_IFSD:
+			if (v == 0 || v > SIZE_INF_MAX) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->ifs_max = v;
+			ret = halse_se05x_apply_ifs(dev);
+			halse_se05x_clear_buf(dev);
+			break;
+		case TAG_IFDSE_APDU_TIMEOUT_MS:
+			dev->apdu_timeout_ms = v;
+			break;
+		case TAG_IFDSE_POLL_INTERVAL_US:
+			if (v == 0 || v > MAX_TUNE_US) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->cfg_timeout_us = v;
+			halse_se05x_apply_atr(dev);
+			break;
+		case TAG_IFDSE_POLL_DENSE_US:
+			if (v > MAX_TUNE_US) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->poll_dense_us = v;
+			break;
+		case TAG_IFDSE_GUARD_TIME_US:
+			if (v == 0 || v > MAX_TUNE_US) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->cfg_guard_time_us = v;
+			halse_se05x_apply_atr(dev);
+			break;
+		case TAG_IFDSE_RESPONSE_TIMEOUT_MS:
+			if (v == 0 || v > MAX_TUNE_BWT_ms) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->cfg_bwt_ms = v;
+			halse_se05x_apply_atr(dev);
+			break;
+		case TAG_IFDSE_MAX_RNAK:
+			if (v > MAX_TUNE_RETRIES) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->max_rnak = v;
+			break;
+		case TAG_IFDSE_MAX_RESYNC:
+			if (v > MAX_TUNE_RETRIES) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->max_resync = v;
+			break;
+		case TAG_IFDSE_XFER_DELAY_US:
+			if (v > MAX_TUNE_US) {
+				ret = -EINVAL;
+				break;
+			}
+			dev->xfer_delay_us = v;
+			break;
+		default:
+			ret = -ENOENT;
+			break;
+	}
+
+	halse_se05x_unlock(dev);
+
+	return ret;
+}
+
+/*
+ * Exchange a single APDU with the SE05x (I-block chains in both directions).
+ */
+static int halse_se05x_xfer_apdu(struct halse_se05x_dev *dev, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	int ret = 0;
+	size_t tx_off = 0;
+	size_t rx_off = 0;
+	size_t rx_total = 0;
+	bool chain;
+	uint64_t start;
+
+	dev->cmd_sent = false;
+	dev->cmd_acked = false;
 
 	/* Write loop */
 	do {
-		size_t len = SIZE_INF_MAX;
+		size_t len = dev->ifsc;
 		size_t left = tx_len - tx_off;
 		if (len > left) {
 			len = left;
@@ -827,32 +1529,42 @@ static int halse_se05x_xfer(struct halse_dev *device, unsigned char *tx_buf, siz
 		ret = halse_se05x_send_i_block(dev, tx_buf + tx_off, len, chain);
 		if (ret) {
 			Log2(PCSC_LOG_ERROR, "Sending I-block failed: %d", ret);
-			goto end;
+			return ret;
 		}
 
 		tx_off += len;
 	} while (chain);
 
+	dev->cmd_sent = true;
+
 	/* Read loop */
+	start = monotonic_us();
 	do {
 		size_t len;
-		ret = halse_se05x_recv_block(dev, &len);
+		size_t expected_us = rx_off ? 0 : dev->resp_ewma_us;
+		ret = halse_se05x_recv_block(dev, &len, is_i_block, expected_us);
 		if (ret) {
 			Log2(PCSC_LOG_ERROR, "Receiving block failed: %d", ret);
-			goto end;
+			return ret;
 		}
+		dev->cmd_acked = true;
 
-		uint8_t pcb = dev->rxbuf[1];
-		if (!is_i_block(pcb)) {
-			Log2(PCSC_LOG_ERROR, "Received block is not I-block (PCB: 0x%hhx)", pcb);
-			goto end;
+		/* Track the average response time of the SE05x. */
+		if (!rx_off) {
+			size_t elapsed = monotonic_us() - start;
+			dev->resp_ewma_us = dev->resp_ewma_us - dev->resp_ewma_us / 8 + elapsed / 8;
 		}
 
-		if ((rx_off + len) > *rx_len) {
-			Log3(PCSC_LOG_ERROR, "Receive buffer too small (buffer size: %zu, data size: %zu) -> Truncating",
-					*rx_len, rx_off + len);
+		uint8_t pcb = dev->rxbuf[1];
+		dev->n_r = ((pcb >> 6) & 1) ^ 1;
+
+		/*
+		 * Keep receiving the whole chain if the buffer is too small,
+		 * so that the SE05x is ready for the next APDU.
+		 */
+		rx_total += len;
+		if ((rx_off + len) > *rx_len)
 			len = *rx_len - rx_off;
-		}
 
 		memcpy(rx_buf + rx_off, &dev->rxbuf[3], len);
 		rx_off += len;
@@ -860,25 +1572,174 @@ static int halse_se05x_xfer(struct halse_dev *device, unsigned char *tx_buf, siz
 		chain = (pcb >> 5) & 0x01;
 		if (chain) {
 			uint8_t ee = 0;
-			int n_s = (pcb >> 6) & 1;
-			uint8_t n_r = n_s ^ 1;
-			ret = halse_se05x_send_r_block(dev, n_r, ee);
+			ret = halse_se05x_send_r_block(dev, dev->n_r, ee);
 			if (ret) {
 				Log2(PCSC_LOG_ERROR, "Sending R-block failed: %d", ret);
-				goto end;
+				return ret;
 			}
 		}
 	} while(chain);
 
+	if (rx_total > *rx_len) {
+		Log3(PCSC_LOG_ERROR, "Receive buffer too small (buffer size: %zu, data size: %zu)",
+				*rx_len, rx_total);
+		return -ENOSPC;
+	}
+
 	*rx_len = rx_off;
 
+	return 0;
+}
+
+static int halse_se05x_xfer_dev(struct halse_se05x_dev *dev, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	int ret = 0;
+	size_t len;
+	size_t resync;
+
+	//LogXxd(PCSC_LOG_INFO, "tx_buf: ", tx_buf, tx_len);
+
+	/*
+	 * This is an unspecified delay.
+	 *
+	 * Under high-load scenarios it was observed, that
+	 * certain devices get into a state, in which they
+	 * respond with EE_OTHER_ERROR and only a reset can
+	 * get them out of this state.
+	 * This delay reliably helped to address this issue.
+	 */
+	if (dev->xfer_delay_us)
+		halsched_sleep_us(dev->xfer_delay_us);
+
+	/* Sanity checks */
+	if (!tx_buf || !tx_len || !rx_buf || !rx_len) {
+		ret = -1;
+		goto end;
+	}
+
+	if (dev->apdu_timeout_ms)
+		dev->apdu_deadline_us = monotonic_us() + dev->apdu_timeout_ms * US_PER_MS;
+
+	/* The previous APDU has been aborted, the sequence numbers are unknown. */
+	if (dev->need_resync) {
+		ret = halse_se05x_resync_dev(dev);
+		if (ret)
+			goto recover;
+		dev->need_resync = false;
+	}
+
+	len = *rx_len;
+	ret = halse_se05x_xfer_apdu(dev, tx_buf, tx_len, rx_buf, &len);
+
+	/* The exchange itself succeeded, no need to recover. */
+	if (ret == -ENOSPC)
+		goto end;
+
+	/* Don't recover past the deadline, but resync with the next APDU. */
+	if (ret && dev->apdu_deadline_us && monotonic_us() >= dev->apdu_deadline_us) {
+		Log2(PCSC_LOG_ERROR, "APDU deadline (%zu ms) exceeded", dev->apdu_timeout_ms);
+		dev->need_resync = true;
+		ret = -ETIMEDOUT;
+		goto end;
+	}
+
+	/*
+	 * Recovery: resynchronize and restart the APDU, unless the SE05x
+	 * has already started to process it (it might not be idempotent).
+	 */
+	for (resync = 0; ret && resync < dev->max_resync; resync++) {
+		bool replay = !dev->cmd_acked;
+		int err = ret;
+
+		Log2(PCSC_LOG_INFO, "APDU exchange failed (%d) -> RESYNC", ret);
+		halse_se05x_clear_buf(dev);
+		ret = halse_se05x_resync_dev(dev);
+		if (ret)
+			break;
+
+		if (!replay) {
+			Log1(PCSC_LOG_ERROR, "SE05x has accepted the command, not repeating it");
+			ret = err;
+			goto end;
+		}
+
+		len = *rx_len;
+		ret = halse_se05x_xfer_apdu(dev, tx_buf, tx_len, rx_buf, &len);
+	}
+
+recover:
+	/* Last resort: soft reset, so that the next APDU finds a sane SE. */
+	if (ret) {
+		dev->apdu_deadline_us = 0;
+		if (!dev->noreset) {
+			Log2(PCSC_LOG_ERROR, "APDU exchange failed (%d) -> SOFT_RESET", ret);
+			dev->soft_reset_count++;
+			halse_se05x_clear_buf(dev);
+			halse_se05x_clear_state(dev);
+			if (halse_se05x_warm_reset_dev(dev))
+				Log1(PCSC_LOG_ERROR, "Soft reset failed!");
+		}
+		goto end;
+	}
+
+	*rx_len = len;
+
 	//LogXxd(PCSC_LOG_INFO, "rx_buf: ", rx_buf, *rx_len);
 
 end:
+	dev->apdu_deadline_us = 0;
 	halse_se05x_clear_buf(dev);
 	return ret;
 }
 
+/*
+ * Transfer function for the prefetch worker (device lock is held).
+ * Nothing above the driver would learn about a recovery (a soft reset
+ * loses the applet selection of the client), so a failed exchange is
+ * only reported; the resync is left to the next APDU of the client.
+ */
+static int halse_se05x_rng_xfer_dev(void *priv, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_se05x_dev *dev = priv;
+	size_t len = *rx_len;
+	int ret;
+
+	if (dev->need_resync)
+		return -EAGAIN;
+
+	ret = halse_se05x_xfer_apdu(dev, tx_buf, tx_len, rx_buf, &len);
+	if (ret && ret != -ENOSPC)
+		dev->need_resync = true;
+	else if (!ret)
+		*rx_len = len;
+
+	halse_se05x_clear_buf(dev);
+
+	return ret;
+}
+
+static int halse_se05x_xfer(struct halse_dev *device, unsigned char *tx_buf, size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_se05x_dev *dev = container_of(device, struct halse_se05x_dev, device);
+	int ret;
+
+	halse_se05x_lock(dev);
+
+	if (dev->rng && tx_buf && rx_buf && rx_len &&
+	    halse_se05x_rng_serve(dev->rng, tx_buf, tx_len, rx_buf, rx_len)) {
+		halse_se05x_unlock(dev);
+		return 0;
+	}
+
+	ret = halse_se05x_xfer_dev(dev, tx_buf, tx_len, rx_buf, rx_len);
+	if (!ret && dev->rng)
+		halse_se05x_rng_observe(dev->rng, tx_buf, tx_len, rx_buf, *rx_len);
+
+	halse_se05x_unlock(dev);
+
+	return ret;
+}
+
 struct halse_dev* halse_open_se05x(char* config)
 {
 	int ret;
@@ -896,6 +1757,15 @@ struct halse_dev* halse_open_se05x(char* config)
 	}
 
 	dev->noreset = false;
+	pthread_mutex_init(&dev->lock, NULL);
+	dev->ifs_max = SIZE_INF_MAX;
+	dev->card_ifsc = SIZE_INF_MAX;
+	dev->ifsc = SIZE_INF_MAX;
+	dev->ifsd = SIZE_INF_MAX;
+	dev->poll_dense_us = POLL_DENSE_us;
+	dev->max_rnak = MAX_RNAK;
+	dev->max_resync = MAX_RESYNC;
+	dev->xfer_delay_us = XFER_DELAY_us;
 
 	/* Parse device string from reader.conf */
 	ret = halse_se05x_parse(dev, config);
@@ -908,7 +1778,10 @@ struct halse_dev* halse_open_se05x(char* config)
 	/* Initialial se05x timeout */
 	dev->timeout_us = MPOT_ms * US_PER_MS;
 	dev->guard_time_us = SEGT_us;
-	dev->max_retries = BWT_ms * US_PER_MS / dev->timeout_us;
+	hali2c_set_guard_time(dev->i2c_dev, dev->guard_time_us);
+	dev->bwt_ms = BWT_ms;
+	dev->max_retries = dev->bwt_ms * US_PER_MS / dev->timeout_us;
+	dev->pwt_us = PWT_ms * US_PER_MS;
 
 	ret = halse_se05x_open(&dev->device);
 	if (ret) {
@@ -923,6 +1796,19 @@ struct halse_dev* halse_open_se05x(char* config)
 	dev->device.power_down = halse_se05x_power_down;
 	dev->device.warm_reset = halse_se05x_warm_reset;
 	dev->device.xfer = halse_se05x_xfer;
+	dev->device.get_param = halse_se05x_get_param;
+	dev->device.set_param = halse_se05x_set_param;
+	dev->device.probe = halse_se05x_probe;
+	dev->device.refresh_atr = halse_se05x_refresh_atr;
+	dev->device.mem = dev;
+	dev->device.mem_len = sizeof(*dev);
+
+	if (dev->rng_size) {
+		dev->rng = halse_se05x_rng_create(dev->rng_size, dev->rng_max_age_ms,
+				halse_se05x_rng_xfer_dev, dev, &dev->lock);
+		if (!dev->rng)
+			Log1(PCSC_LOG_ERROR, "Random prefetch disabled!");
+	}
 
 	return &dev->device;
 }
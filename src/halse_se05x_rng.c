@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse_se05x_rng.h"
+
+#define US_PER_MS 1000
+
+/* The SE05x must be idle for this time before prefetching. */
+#define RNG_IDLE_US (20 * US_PER_MS)
+
+/* Bytes requested per prefetch GetRandom. */
+#define RNG_CHUNK 128
+
+/* GetRandom: CLA INS P1 P2 Lc [TAG_1 (0x41) 0x02 SIZE_HI SIZE_LO] [Le] */
+#define GETRANDOM_HDR_LEN 9
+#define TAG_1 0x41
+static const uint8_t getrandom_hdr[] = { 0x80, 0x04, 0x00, 0x49, 0x04, TAG_1, 0x02 };
+
+/* AID of the SE05x IoT applet (the version bytes are not compared). */
+static const uint8_t iot_applet_aid[] = {
+	0xA0, 0x00, 0x00, 0x03, 0x96, 0x54, 0x53, 0x00,
+	0x00, 0x00, 0x01, 0x03,
+};
+
+struct halse_se05x_rng {
+	pthread_mutex_t *lock; /* Device lock */
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool stop;
+
+	halse_se05x_rng_xfer xfer;
+	void *priv;
+
+	/* Ring buffer. */
+	unsigned char *buf;
+	size_t size;
+	size_t head; /* Offset of the oldest byte */
+	size_t fill;
+	uint64_t oldest_us; /* Time of the oldest buffered byte */
+	size_t max_age_us;
+
+	/* State of the SE05x. */
+	bool selected; /* IoT applet selected on the basic channel */
+	bool pending; /* A command chain or a 61xx/6Cxx response is pending */
+	uint64_t last_activity_us;
+
+	/* Accounting. */
+	size_t hits;
+	size_t misses;
+	size_t bytes_served;
+	size_t bytes_fetched;
+	size_t bytes_discarded;
+};
+
+static void halse_se05x_rng_wipe(struct halse_se05x_rng *rng)
+{
+	explicit_bzero(rng->buf, rng->size);
+	rng->head = 0;
+	rng->fill = 0;
+}
+
+/* Discard the buffer, if its content is too old. */
+static void halse_se05x_rng_expire(struct halse_se05x_rng *rng)
+{
+	if (!rng->fill || !rng->max_age_us)
+		return;
+
+	if (monotonic_us() - rng->oldest_us > rng->max_age_us) {
+		rng->bytes_discarded += rng->fill;
+		halse_se05x_rng_wipe(rng);
+	}
+}
+
+static void halse_se05x_rng_push(struct halse_se05x_rng *rng,
+	const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	if (!rng->fill)
+		rng->oldest_us = monotonic_us();
+
+	for (i = 0; i < len && rng->fill < rng->size; i++) {
+		rng->buf[(rng->head + rng->fill) % rng->size] = data[i];
+		rng->fill++;
+	}
+}
+
+static void halse_se05x_rng_pop(struct halse_se05x_rng *rng,
+	unsigned char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		data[i] = rng->buf[rng->head];
+		rng->buf[rng->head] = 0;
+		rng->head = (rng->head + 1) % rng->size;
+	}
+	rng->fill -= len;
+}
+
+/* Length of the BER-TLV length field for len. */
+static size_t ber_len_size(size_t len)
+{
+	return len < 0x80 ? 1 : len <= 0xFF ? 2 : 3;
+}
+
+/*
+ * Parse a GetRandom response "TAG_1 <len> <data> 90 00".
+ * Returns the offset of the data or 0 on error.
+ */
+static size_t halse_se05x_rng_parse(const unsigned char *rx_buf, size_t rx_len,
+	size_t *data_len)
+{
+	size_t off = 2;
+
+	if (rx_len < 4 || rx_buf[0] != TAG_1 ||
+	    rx_buf[rx_len - 2] != 0x90 || rx_buf[rx_len - 1] != 0x00)
+		return 0;
+
+	if (rx_buf[1] < 0x80) {
+		*data_len = rx_buf[1];
+	} else if (rx_buf[1] == 0x81) {
+		*data_len = rx_buf[2];
+		off = 3;
+	} else if (rx_buf[1] == 0x82) {
+		*data_len = (rx_buf[2] << 8) | rx_buf[3];
+		off = 4;
+	} else {
+		return 0;
+	}
+
+	if (off + *data_len + 2 != rx_len)
+		return 0;
+
+	return off;
+}
+
+static void halse_se05x_rng_fetch(struct halse_se05x_rng *rng)
+{
+	unsigned char tx[GETRANDOM_HDR_LEN + 1];
+	unsigned char rx[RNG_CHUNK + 8];
+	size_t rx_len = sizeof(rx);
+	size_t chunk = rng->size - rng->fill;
+	size_t off, len;
+	int ret;
+
+	if (chunk > RNG_CHUNK)
+		chunk = RNG_CHUNK;
+
+	memcpy(tx, getrandom_hdr, sizeof(getrandom_hdr));
+	tx[7] = chunk >> 8;
+	tx[8] = chunk & 0xFF;
+	tx[9] = 0x00;
+
+	ret = rng->xfer(rng->priv, tx, sizeof(tx), rx, &rx_len);
+	off = ret ? 0 : halse_se05x_rng_parse(rx, rx_len, &len);
+	if (!off) {
+		/* Don't retry until the applet is selected again. */
+		Log2(PCSC_LOG_INFO, "Random prefetch failed (%d), pausing", ret);
+		rng->selected = false;
+		explicit_bzero(rx, sizeof(rx));
+		return;
+	}
+
+	halse_se05x_rng_push(rng, &rx[off], len);
+	rng->bytes_fetched += len;
+	explicit_bzero(rx, sizeof(rx));
+}
+
+static void* halse_se05x_rng_main(void *arg)
+{
+	struct halse_se05x_rng *rng = arg;
+
+	pthread_mutex_lock(rng->lock);
+
+	while (!rng->stop) {
+		uint64_t idle_at = rng->last_activity_us + RNG_IDLE_US;
+		struct timespec ts;
+
+		halse_se05x_rng_expire(rng);
+
+		if (rng->selected && !rng->pending && rng->fill < rng->size) {
+			if (monotonic_us() >= idle_at) {
+				halse_se05x_rng_fetch(rng);
+				continue;
+			}
+
+			ts.tv_sec = idle_at / 1000000;
+			ts.tv_nsec = (idle_at % 1000000) * 1000;
+			pthread_cond_timedwait(&rng->cond, rng->lock, &ts);
+		} else {
+			pthread_cond_wait(&rng->cond, rng->lock);
+		}
+	}
+
+	pthread_mutex_unlock(rng->lock);
+
+	return NULL;
+}
+
+int halse_se05x_rng_serve(struct halse_se05x_rng *rng, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	size_t len, hdr;
+
+	/* The same APDU might mean something else to another applet. */
+	if (!rng->selected)
+		return 0;
+
+	/* GetRandom with Le (short form) or without. */
+	if (tx_len != GETRANDOM_HDR_LEN && tx_len != GETRANDOM_HDR_LEN + 1)
+		return 0;
+	if (memcmp(tx_buf, getrandom_hdr, sizeof(getrandom_hdr)))
+		return 0;
+
+	len = (tx_buf[7] << 8) | tx_buf[8];
+	hdr = 1 + ber_len_size(len);
+
+	halse_se05x_rng_expire(rng);
+
+	if (!len || len > rng->fill || hdr + len + 2 > *rx_len) {
+		rng->misses++;
+		return 0;
+	}
+
+	rx_buf[0] = TAG_1;
+	if (len < 0x80) {
+		rx_buf[1] = len;
+	} else if (len <= 0xFF) {
+		rx_buf[1] = 0x81;
+		rx_buf[2] = len;
+	} else {
+		rx_buf[1] = 0x82;
+		rx_buf[2] = len >> 8;
+		rx_buf[3] = len & 0xFF;
+	}
+	halse_se05x_rng_pop(rng, &rx_buf[hdr], len);
+	rx_buf[hdr + len] = 0x90;
+	rx_buf[hdr + len + 1] = 0x00;
+	*rx_len = hdr + len + 2;
+
+	rng->hits++;
+	rng->bytes_served += len;
+
+	/* Refill when idle. */
+	pthread_cond_signal(&rng->cond);
+
+	return 1;
+}
+
+void halse_se05x_rng_observe(struct halse_se05x_rng *rng, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len)
+{
+	rng->last_activity_us = monotonic_us();
+
+	/*
+	 * Don't get between the parts of a command chain (CLA bit 0x10)
+	 * or between a 61xx/6Cxx response and the GET RESPONSE (or the
+	 * repeated command) of the client.
+	 */
+	rng->pending = (tx_len >= 1 && (tx_buf[0] & 0x10)) ||
+		(rx_len >= 2 && (rx_buf[rx_len - 2] == 0x61 || rx_buf[rx_len - 2] == 0x6C));
+
+	/* SELECT by AID on the basic channel? */
+	if (tx_len >= 5 && (tx_buf[0] & 0xC3) == 0x00 &&
+	    tx_buf[1] == 0xA4 && tx_buf[2] == 0x04) {
+		size_t lc = tx_buf[4];
+		bool ok = rx_len >= 2 && rx_buf[rx_len - 2] == 0x90 && rx_buf[rx_len - 1] == 0x00;
+
+		rng->selected = ok && tx_len >= 5 + lc && lc >= sizeof(iot_applet_aid) &&
+			!memcmp(&tx_buf[5], iot_applet_aid, sizeof(iot_applet_aid));
+	}
+
+	/* Random data of the IoT applet is of no use for another applet. */
+	if (!rng->selected && rng->fill) {
+		rng->bytes_discarded += rng->fill;
+		halse_se05x_rng_wipe(rng);
+	}
+
+	pthread_cond_signal(&rng->cond);
+}
+
+void halse_se05x_rng_reset(struct halse_se05x_rng *rng)
+{
+	halse_se05x_rng_wipe(rng);
+	rng->selected = false;
+	rng->pending = false;
+}
+
+struct halse_se05x_rng* halse_se05x_rng_create(size_t size, size_t max_age_ms,
+	halse_se05x_rng_xfer xfer, void *priv, pthread_mutex_t *lock)
+{
+	struct halse_se05x_rng *rng;
+	pthread_condattr_t attr;
+	int ret;
+
+	rng = calloc(1, sizeof(*rng));
+	if (!rng) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	rng->buf = calloc(1, size);
+	if (!rng->buf) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		free(rng);
+		return NULL;
+	}
+
+	rng->size = size;
+	rng->max_age_us = max_age_ms * US_PER_MS;
+	rng->xfer = xfer;
+	rng->priv = priv;
+	rng->lock = lock;
+
+	/* Timeouts are based on monotonic_us(). */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rng->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&rng->thread, NULL, halse_se05x_rng_main, rng);
+	if (ret) {
+		Log2(PCSC_LOG_ERROR, "Could not start prefetch thread: %d", ret);
+		pthread_cond_destroy(&rng->cond);
+		free(rng->buf);
+		free(rng);
+		return NULL;
+	}
+
+	return rng;
+}
+
+void halse_se05x_rng_destroy(struct halse_se05x_rng *rng)
+{
+	if (!rng)
+		return;
+
+	pthread_mutex_lock(rng->lock);
+	rng->stop = true;
+	pthread_cond_signal(&rng->cond);
+	pthread_mutex_unlock(rng->lock);
+
+	pthread_join(rng->thread, NULL);
+
+	Log3(PCSC_LOG_INFO, "Random prefetch: %zu hits, %zu misses",
+		rng->hits, rng->misses);
+	Log4(PCSC_LOG_INFO, "Random prefetch: %zu bytes served, %zu fetched, %zu discarded",
+		rng->bytes_served, rng->bytes_fetched, rng->bytes_discarded);
+
+	halse_se05x_rng_wipe(rng);
+	pthread_cond_destroy(&rng->cond);
+	free(rng->buf);
+	free(rng);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_SE05X_RNG_H_
+#define HALSE_SE05X_RNG_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Prefetch pool for SE05x GetRandom.
+ *
+ * A worker thread fills a ring buffer with large GetRandom requests
+ * while the SE05x is idle and the IoT applet is selected on the basic
+ * channel. Small GetRandom APDUs are then answered from the buffer
+ * (only while the IoT applet is selected, the buffer is wiped when
+ * another applet gets selected). A failed prefetch pauses the worker
+ * until the applet is selected again; it never recovers the SE05x
+ * itself (that would go unnoticed by the client).
+ * All functions except create/destroy must be called with the device
+ * lock held (the lock, which is passed to halse_se05x_rng_create()).
+ */
+
+struct halse_se05x_rng;
+
+/*
+ * Transfer function of the driver (called with the device lock held),
+ * which must not reset the SE05x.
+ */
+typedef int (*halse_se05x_rng_xfer)(void *priv, unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len);
+
+/*
+ * Create the pool with a buffer of size bytes. Buffered bytes older than
+ * max_age_ms are discarded (0: no limit).
+ * Returns the pool on success, or NULL otherwise.
+ */
+struct halse_se05x_rng* halse_se05x_rng_create(size_t size, size_t max_age_ms,
+	halse_se05x_rng_xfer xfer, void *priv, pthread_mutex_t *lock);
+
+/* Stop the worker, wipe the buffer and free the pool. */
+void halse_se05x_rng_destroy(struct halse_se05x_rng *rng);
+
+/*
+ * Try to answer a GetRandom APDU from the buffer.
+ * Returns 1 if the APDU has been answered, 0 if it needs to be sent
+ * to the SE05x.
+ */
+int halse_se05x_rng_serve(struct halse_se05x_rng *rng, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len);
+
+/*
+ * Inspect an APDU exchanged with the SE05x (tracks the applet selection,
+ * the bus activity and pending command chains or 61xx/6Cxx responses,
+ * during which nothing is prefetched).
+ */
+void halse_se05x_rng_observe(struct halse_se05x_rng *rng, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len);
+
+/* Wipe the buffer and forget the applet selection (e.g. on reset). */
+void halse_se05x_rng_reset(struct halse_se05x_rng *rng);
+
+#endif /* HALSE_SE05X_RNG_H_ */
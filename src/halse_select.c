@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "halse_select.h"
+
+/* Basic channel, channels 1..3 and further channels 4..19. */
+#define MAX_CHANNELS 20
+
+/* SELECT: CLA A4 04 P2 Lc AID (5..16 bytes) [Le] */
+#define MAX_SELECT_LEN (5 + 16 + 1)
+
+/* Longer responses (e.g. with a large FCI) are not stored. */
+#define MAX_SELECT_RSP_LEN 258
+
+#define INS_SELECT 0xA4
+#define INS_MANAGE_CHANNEL 0x70
+#define P1_SELECT_BY_NAME 0x04
+
+struct halse_select_channel {
+	unsigned char cmd[MAX_SELECT_LEN];
+	size_t cmd_len; /* 0...unknown */
+	unsigned char rsp[MAX_SELECT_RSP_LEN];
+	size_t rsp_len;
+};
+
+struct halse_select {
+	pthread_mutex_t lock;
+	struct halse_select_channel channels[MAX_CHANNELS];
+
+	/* Accounting. */
+	size_t elided;
+	size_t sent;
+};
+
+static size_t halse_select_channel(const unsigned char *tx_buf)
+{
+	if (tx_buf[0] & 0x40)
+		return 4 + (tx_buf[0] & 0x0F);
+	return tx_buf[0] & 0x03;
+}
+
+/*
+ * SELECT by AID of the first or only occurrence
+ * (selecting the next occurrence changes the selection).
+ */
+static bool halse_select_by_aid(const unsigned char *tx_buf, size_t tx_len)
+{
+	return tx_len >= 5 && tx_buf[1] == INS_SELECT &&
+		tx_buf[2] == P1_SELECT_BY_NAME && (tx_buf[3] & 0x03) == 0x00;
+}
+
+int halse_select_lookup(struct halse_select *sel, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_select_channel *c;
+	int ret = 0;
+
+	if (!halse_select_by_aid(tx_buf, tx_len))
+		return 0;
+
+	pthread_mutex_lock(&sel->lock);
+
+	c = &sel->channels[halse_select_channel(tx_buf)];
+	if (c->cmd_len && c->cmd_len == tx_len && !memcmp(c->cmd, tx_buf, tx_len) &&
+	    c->rsp_len <= *rx_len) {
+		memcpy(rx_buf, c->rsp, c->rsp_len);
+		*rx_len = c->rsp_len;
+		sel->elided++;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&sel->lock);
+
+	return ret;
+}
+
+void halse_select_update(struct halse_select *sel, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len, int ret)
+{
+	struct halse_select_channel *c;
+	bool ok = !ret && rx_len >= 2 &&
+		rx_buf[rx_len - 2] == 0x90 && rx_buf[rx_len - 1] == 0x00;
+
+	if (ret) {
+		/* The state of the SE is unknown. */
+		halse_select_reset(sel);
+		return;
+	}
+
+	if (tx_len < 4)
+		return;
+
+	if (tx_buf[1] == INS_MANAGE_CHANNEL) {
+		/* Opening or closing a channel. */
+		halse_select_reset(sel);
+		return;
+	}
+
+	if (tx_buf[1] != INS_SELECT)
+		return;
+
+	pthread_mutex_lock(&sel->lock);
+
+	c = &sel->channels[halse_select_channel(tx_buf)];
+	c->cmd_len = 0;
+
+	if (ok && halse_select_by_aid(tx_buf, tx_len) &&
+	    tx_len <= MAX_SELECT_LEN && rx_len <= MAX_SELECT_RSP_LEN) {
+		memcpy(c->cmd, tx_buf, tx_len);
+		c->cmd_len = tx_len;
+		memcpy(c->rsp, rx_buf, rx_len);
+		c->rsp_len = rx_len;
+	}
+	sel->sent++;
+
+	pthread_mutex_unlock(&sel->lock);
+}
+
+void halse_select_reset(struct halse_select *sel)
+{
+	size_t i;
+
+	pthread_mutex_lock(&sel->lock);
+	for (i = 0; i < MAX_CHANNELS; i++)
+		sel->channels[i].cmd_len = 0;
+	pthread_mutex_unlock(&sel->lock);
+}
+
+struct halse_select* halse_select_create(void)
+{
+	struct halse_select *sel;
+
+	sel = calloc(1, sizeof(*sel));
+	if (!sel) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return NULL;
+	}
+
+	pthread_mutex_init(&sel->lock, NULL);
+
+	return sel;
+}
+
+void halse_select_destroy(struct halse_select *sel)
+{
+	if (!sel)
+		return;
+
+	Log3(PCSC_LOG_INFO, "SELECT elision: %zu elided, %zu sent",
+		sel->elided, sel->sent);
+
+	pthread_mutex_destroy(&sel->lock);
+	free(sel);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_SELECT_H_
+#define HALSE_SELECT_H_
+
+#include <stddef.h>
+
+/*
+ * Tracker of the selected applet per logical channel.
+ *
+ * A SELECT by AID, which is identical to the last successful SELECT
+ * on the same channel, is answered with the response of the latter
+ * instead of being sent to the SE. Any other SELECT, a failed SELECT,
+ * MANAGE CHANNEL, a transfer error and a power or reset action reset
+ * the tracker.
+ *
+ * Note that applets, which reset their state when being selected
+ * again, won't see the repeated SELECT.
+ */
+
+struct halse_select;
+
+/* Create a tracker without known selections. */
+struct halse_select* halse_select_create(void);
+
+/* Log the counters and free the tracker (NULL is ignored). */
+void halse_select_destroy(struct halse_select *sel);
+
+/*
+ * Check if the command is a repeated SELECT.
+ * Returns 1 if the response has been copied to rx_buf, 0 otherwise.
+ */
+int halse_select_lookup(struct halse_select *sel, const unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len);
+
+/*
+ * Record the result of a command, which has been sent to the SE
+ * (ret is the result of the transfer).
+ */
+void halse_select_update(struct halse_select *sel, const unsigned char *tx_buf,
+	size_t tx_len, const unsigned char *rx_buf, size_t rx_len, int ret);
+
+/* Forget all selections. */
+void halse_select_reset(struct halse_select *sel);
+
+#endif /* HALSE_SELECT_H_ */
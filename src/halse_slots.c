@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "halse_slots.h"
+
+#define INS_MANAGE_CHANNEL 0x70
+
+struct halse_slots;
+
+struct halse_slot {
+	/* Embed halse device */
+	struct halse_dev device;
+	struct halse_slots *group;
+	size_t index;
+	unsigned char channel; /* Logical channel (0...basic channel) */
+	bool powered;
+};
+
+struct halse_slots {
+	struct halse_dev *base;
+	pthread_mutex_t lock; /* Serializes the access to base */
+	struct halse_slot slots[MAX_SE_SLOTS];
+	size_t n_slots;
+	size_t n_powered;
+};
+
+static bool sw_ok(const unsigned char *rx_buf, size_t rx_len)
+{
+	return rx_len >= 2 && rx_buf[rx_len - 2] == 0x90 && rx_buf[rx_len - 1] == 0x00;
+}
+
+/* Open a logical channel (the SE assigns the number). */
+static int halse_slots_open_channel(struct halse_slot *slot)
+{
+	struct halse_dev *base = slot->group->base;
+	unsigned char tx[] = { 0x00, INS_MANAGE_CHANNEL, 0x00, 0x00, 0x01 };
+	unsigned char rx[3];
+	size_t rx_len = sizeof(rx);
+	int ret;
+
+	ret = halse_xfer(base, tx, sizeof(tx), rx, &rx_len);
+	if (ret)
+		return ret;
+
+	if (rx_len != 3 || !sw_ok(rx, rx_len) || rx[0] < 1 || rx[0] > 3) {
+		Log2(PCSC_LOG_ERROR, "Could not open logical channel for slot %zu",
+			slot->index);
+		return -EIO;
+	}
+
+	slot->channel = rx[0];
+	Log3(PCSC_LOG_DEBUG, "Slot %zu uses logical channel %u",
+		slot->index, slot->channel);
+
+	return 0;
+}
+
+static void halse_slots_close_channel(struct halse_slot *slot)
+{
+	struct halse_dev *base = slot->group->base;
+	unsigned char tx[] = { 0x00, INS_MANAGE_CHANNEL, 0x80, slot->channel };
+	unsigned char rx[2];
+	size_t rx_len = sizeof(rx);
+
+	if (!slot->channel)
+		return;
+
+	if (halse_xfer(base, tx, sizeof(tx), rx, &rx_len) || !sw_ok(rx, rx_len))
+		Log2(PCSC_LOG_ERROR, "Could not close logical channel %u", slot->channel);
+
+	slot->channel = 0;
+}
+
+/* Called with the group lock held. */
+static int halse_slots_power_up_locked(struct halse_slot *slot)
+{
+	struct halse_slots *group = slot->group;
+	int ret;
+
+	if (slot->powered)
+		return 0;
+
+	if (!group->n_powered) {
+		ret = halse_power_up(group->base);
+		if (ret)
+			return ret;
+	}
+
+	if (slot->index) {
+		ret = halse_slots_open_channel(slot);
+		if (ret) {
+			if (!group->n_powered)
+				halse_power_down(group->base);
+			return ret;
+		}
+	}
+
+	slot->powered = true;
+	group->n_powered++;
+
+	return 0;
+}
+
+/* Called with the group lock held. */
+static int halse_slots_power_down_locked(struct halse_slot *slot)
+{
+	struct halse_slots *group = slot->group;
+
+	if (!slot->powered)
+		return 0;
+
+	halse_slots_close_channel(slot);
+
+	slot->powered = false;
+	group->n_powered--;
+
+	if (!group->n_powered)
+		return halse_power_down(group->base);
+
+	return 0;
+}
+
+static int halse_slots_power_up(struct halse_dev *device)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	int ret;
+
+	pthread_mutex_lock(&group->lock);
+	ret = halse_slots_power_up_locked(slot);
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+static int halse_slots_power_down(struct halse_dev *device)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	int ret;
+
+	pthread_mutex_lock(&group->lock);
+	ret = halse_slots_power_down_locked(slot);
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+static int halse_slots_warm_reset(struct halse_dev *device)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	int ret = 0;
+
+	pthread_mutex_lock(&group->lock);
+
+	if (slot->index) {
+		/* Start over with a fresh channel. */
+		if (slot->powered) {
+			halse_slots_close_channel(slot);
+			ret = halse_slots_open_channel(slot);
+			if (ret) {
+				slot->powered = false;
+				group->n_powered--;
+				if (!group->n_powered)
+					halse_power_down(group->base);
+			}
+		} else {
+			ret = halse_slots_power_up_locked(slot);
+		}
+	} else if (group->n_powered > (slot->powered ? 1 : 0)) {
+		/* A reset would close the channels of the other slots. */
+		if (slot->powered) {
+			Log1(PCSC_LOG_ERROR, "Other slots are in use, can't reset slot 0");
+			ret = -EBUSY;
+		} else {
+			slot->powered = true;
+			group->n_powered++;
+		}
+	} else {
+		ret = halse_warm_reset(group->base);
+		if (!ret && !slot->powered) {
+			slot->powered = true;
+			group->n_powered++;
+		}
+	}
+
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+static int halse_slots_xfer(struct halse_dev *device, unsigned char *tx_buf,
+	size_t tx_len, unsigned char *rx_buf, size_t *rx_len)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	unsigned char cla;
+	int ret;
+
+	if (tx_len < 4)
+		return -EINVAL;
+
+	if (tx_buf[1] == INS_MANAGE_CHANNEL) {
+		/* The channels are managed by the driver. */
+		if (*rx_len < 2)
+			return -ENOSPC;
+		rx_buf[0] = 0x68;
+		rx_buf[1] = 0x81;
+		*rx_len = 2;
+		return 0;
+	}
+
+	/* Channels 4..19 (and the basic channel) can't be encoded in this range. */
+	cla = tx_buf[0];
+	if (cla == 0xFF || (cla & 0x40)) {
+		Log3(PCSC_LOG_ERROR, "CLA 0x%02x can't be used on slot %zu", cla, slot->index);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&group->lock);
+
+	if (!slot->powered) {
+		pthread_mutex_unlock(&group->lock);
+		return -EIO;
+	}
+
+	/* Set the channel number of the slot (restored below). */
+	tx_buf[0] = (cla & ~0x03) | slot->channel;
+
+	ret = halse_xfer(group->base, tx_buf, tx_len, rx_buf, rx_len);
+
+	tx_buf[0] = cla;
+
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+static int halse_slots_get_atr(struct halse_dev *device, unsigned char *buf, size_t *len)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_dev *base = slot->group->base;
+
+	return base->get_atr(base, buf, len);
+}
+
+static int halse_slots_get_param(struct halse_dev *device, DWORD tag,
+	unsigned char *buf, size_t *len)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	int ret;
+
+	pthread_mutex_lock(&group->lock);
+	ret = halse_get_param(group->base, tag, buf, len);
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+static int halse_slots_set_param(struct halse_dev *device, DWORD tag,
+	const unsigned char *buf, size_t len)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	int ret;
+
+	pthread_mutex_lock(&group->lock);
+	ret = halse_set_param(group->base, tag, buf, len);
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+static void halse_slots_close(struct halse_dev *device)
+{
+	struct halse_slot *slot = container_of(device, struct halse_slot, device);
+	struct halse_slots *group = slot->group;
+	size_t i;
+
+	pthread_mutex_lock(&group->lock);
+
+	if (slot->index) {
+		/* Slot 0 owns the group. */
+		halse_slots_power_down_locked(slot);
+		pthread_mutex_unlock(&group->lock);
+		return;
+	}
+
+	for (i = 0; i < group->n_slots; i++)
+		halse_slots_power_down_locked(&group->slots[i]);
+
+	pthread_mutex_unlock(&group->lock);
+
+	halse_destroy(group->base);
+	pthread_mutex_destroy(&group->lock);
+	free(group);
+}
+
+int halse_slots_create(struct halse_dev *base, size_t n_slots,
+	struct halse_dev **slots)
+{
+	struct halse_slots *group;
+	size_t i;
+
+	if (n_slots < 2 || n_slots > MAX_SE_SLOTS)
+		return -EINVAL;
+
+	group = calloc(1, sizeof(*group));
+	if (!group) {
+		Log1(PCSC_LOG_ERROR, "Not enough memory!");
+		return -ENOMEM;
+	}
+
+	group->base = base;
+	group->n_slots = n_slots;
+	pthread_mutex_init(&group->lock, NULL);
+
+	for (i = 0; i < n_slots; i++) {
+		struct halse_slot *slot = &group->slots[i];
+
+		slot->group = group;
+		slot->index = i;
+		slot->device.close = halse_slots_close;
+		slot->device.get_atr = halse_slots_get_atr;
+		slot->device.power_up = halse_slots_power_up;
+		slot->device.power_down = halse_slots_power_down;
+		slot->device.warm_reset = halse_slots_warm_reset;
+		slot->device.xfer = halse_slots_xfer;
+		slot->device.get_param = halse_slots_get_param;
+		slot->device.set_param = halse_slots_set_param;
+		slots[i] = &slot->device;
+	}
+
+	Log2(PCSC_LOG_INFO, "SE exposed as %zu slots", n_slots);
+
+	return 0;
+}
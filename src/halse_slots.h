@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HALSE_SLOTS_H_
+#define HALSE_SLOTS_H_
+
+#include <stddef.h>
+
+#include "halse.h"
+
+/*
+ * Virtual slots on top of the logical channels of a SE.
+ *
+ * Slot 0 uses the basic channel, every further slot opens its own
+ * logical channel (MANAGE CHANNEL) when it is powered up and closes it
+ * when it is powered down. The channel number in the CLA byte of the
+ * commands is set by the driver (slot 0 included), so each client talks
+ * to "its" SE; CLA bytes that can't carry channels 0..3 are rejected.
+ * MANAGE CHANNEL commands of the clients are rejected with 6881.
+ *
+ * The APDUs of the slots are serialized, i.e. the slots interleave
+ * at APDU granularity. The SE itself is only powered down when all
+ * slots are powered down. A reset of slot 0 fails (-EBUSY) while
+ * another slot is powered, a reset of another slot reopens its channel.
+ */
+
+#define MAX_SE_SLOTS 4
+
+/*
+ * Create n_slots (2..MAX_SE_SLOTS) slots on top of base.
+ * The slots are stored in slots[] (slot 0 first). Closing slot 0
+ * closes all slots and destroys base (see halse_destroy()).
+ *
+ * Returns 0 on success, or -ve on error (base is not destroyed).
+ */
+int halse_slots_create(struct halse_dev *base, size_t n_slots,
+	struct halse_dev **slots);
+
+#endif /* HALSE_SLOTS_H_ */
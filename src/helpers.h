@@ -4,6 +4,8 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stddef.h>
+#include <errno.h>
+#include <time.h>
 
 #define container_of(ptr, type, member) ({                      \
         const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
@@ -22,4 +24,51 @@ static inline uint16_t swap_uint16(uint16_t v)
 	return (v << 8) | (v >> 8);
 }
 
+/*
+ * Current time of the monotonic clock in microseconds.
+ */
+static inline uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Store an unsigned capability value (native byte order).
+ */
+static inline int put_param_u32(unsigned char *buf, size_t *len, uint32_t v)
+{
+	if (*len < sizeof(v))
+		return -ENOSPC;
+
+	memcpy(buf, &v, sizeof(v));
+	*len = sizeof(v);
+	return 0;
+}
+
+/*
+ * Load an unsigned capability value of 1, 2 or 4 bytes (native byte order).
+ */
+static inline int get_param_u32(const unsigned char *buf, size_t len, uint32_t *v)
+{
+	uint16_t v16;
+
+	switch (len) {
+		case sizeof(uint8_t):
+			*v = buf[0];
+			return 0;
+		case sizeof(uint16_t):
+			memcpy(&v16, buf, sizeof(v16));
+			*v = v16;
+			return 0;
+		case sizeof(uint32_t):
+			memcpy(v, buf, sizeof(*v));
+			return 0;
+		default:
+			return -EINVAL;
+	}
+}
+
 #endif /* HELPERS_H_ */
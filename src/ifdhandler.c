@@ -16,10 +16,13 @@
  */
 
 #include <string.h>
+#include <errno.h>
 #include <ifdhandler.h>
 #include <debuglog.h>
 
 #include "halse.h"
+#include "halse_batch.h"
+#include "helpers.h"
 
 #ifndef IFDHANDLERv2
 
@@ -43,14 +46,27 @@ RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR
 	TxBuffer, DWORD TxLength, PUCHAR RxBuffer, DWORD RxLength,
 	LPDWORD pdwBytesReturned)
 {
-	(void) Lun;
-	(void) dwControlCode;
-	(void) TxBuffer;
-	(void) TxLength;
-	(void) RxBuffer;
-	(void) RxLength;
-	(void) pdwBytesReturned;
-	return SCARD_E_UNSUPPORTED_FEATURE;
+	int ret;
+	size_t len;
+
+	*pdwBytesReturned = 0;
+
+	if (dwControlCode != IOCTL_IFDSE_BATCH)
+		return SCARD_E_UNSUPPORTED_FEATURE;
+
+	struct halse_dev *dev = halse_get(Lun);
+	if (!dev) {
+		Log2(PCSC_LOG_ERROR, "Lun 0x%lx not open!", Lun);
+		return IFD_NO_SUCH_DEVICE;
+	}
+
+	len = RxLength;
+	ret = halse_batch(dev, TxBuffer, TxLength, RxBuffer, &len);
+	if (ret)
+		return ret == -ENOSPC ? IFD_ERROR_INSUFFICIENT_BUFFER : IFD_COMMUNICATION_ERROR;
+	*pdwBytesReturned = len;
+
+	return IFD_SUCCESS;
 }
 
 #else
@@ -78,22 +94,72 @@ RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 
 RESPONSECODE IFDHCloseChannel(DWORD Lun)
 {
-	struct halse_dev *dev = halse_get(Lun);
-	if (!dev) {
+	if (!halse_exists(Lun)) {
 		Log2(PCSC_LOG_ERROR, "Lun 0x%lx not open!", Lun);
 		return IFD_NO_SUCH_DEVICE;
 	}
 
-	dev->close(dev);
-	halse_free(Lun);
+	halse_close(Lun);
+
+	return IFD_SUCCESS;
+}
+
+static RESPONSECODE halse_to_ifd(int ret)
+{
+	switch (ret) {
+		case 0:
+			return IFD_SUCCESS;
+		case -ENOENT:
+			return IFD_ERROR_TAG;
+		case -ENOSPC:
+			return IFD_ERROR_INSUFFICIENT_BUFFER;
+		case -ETIMEDOUT:
+			return IFD_RESPONSE_TIMEOUT;
+		case -EINVAL:
+			return IFD_ERROR_SET_FAILURE;
+		default:
+			return IFD_COMMUNICATION_ERROR;
+	}
+}
+
+/* Polling thread (see TAG_IFD_POLLING_THREAD_WITH_TIMEOUT). */
+static RESPONSECODE halse_poll(DWORD Lun, int timeout)
+{
+	struct halse_dev *dev = halse_get(Lun);
+	if (!dev)
+		return IFD_NO_SUCH_DEVICE;
+
+	halse_wait_event(dev, timeout);
 
 	return IFD_SUCCESS;
 }
 
+static RESPONSECODE halse_stop_poll(DWORD Lun)
+{
+	struct halse_dev *dev = halse_get(Lun);
+	if (!dev)
+		return IFD_NO_SUCH_DEVICE;
+
+	halse_stop_wait(dev);
+
+	return IFD_SUCCESS;
+}
+
+static RESPONSECODE put_fn(PUCHAR Value, PDWORD Length, void *fn)
+{
+	if (*Length < sizeof(fn))
+		return IFD_ERROR_INSUFFICIENT_BUFFER;
+
+	memcpy(Value, &fn, sizeof(fn));
+	*Length = sizeof(fn);
+	return IFD_SUCCESS;
+}
+
 RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length,
 	PUCHAR Value)
 {
 	int ret;
+	size_t len;
 
 	struct halse_dev *dev = halse_get(Lun);
 	if (!dev) {
@@ -119,17 +185,43 @@ RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length,
 			break;
 
 		case TAG_IFD_SLOTS_NUMBER:
-			Value[0] = 1;
+			Value[0] = (UCHAR)halse_slots_number(Lun);
 			*Length = 1;
 			break;
 
 		case TAG_IFD_SLOT_THREAD_SAFE:
+			/* The slots serialize the access to shared SEs. */
+			Value[0] = halse_slots_number(Lun) > 1;
+			*Length = 1;
+			break;
+
+		case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
+			return put_fn(Value, Length, (void*)halse_poll);
+
+		case TAG_IFD_POLLING_THREAD_KILLABLE:
+			/* Stopped via TAG_IFD_STOP_POLLING_THREAD. */
 			Value[0] = 0;
 			*Length = 1;
 			break;
 
+		case TAG_IFD_STOP_POLLING_THREAD:
+			return put_fn(Value, Length, (void*)halse_stop_poll);
+
+		case SCARD_ATTR_MAXINPUT:
+			len = *Length;
+			ret = put_param_u32(Value, &len, MAX_APDU_SIZE);
+			if (ret)
+				return halse_to_ifd(ret);
+			*Length = len;
+			break;
+
 		default:
-			return IFD_ERROR_TAG;
+			len = *Length;
+			ret = halse_get_param(dev, Tag, Value, &len);
+			if (ret)
+				return halse_to_ifd(ret);
+			*Length = len;
+			break;
 	}
 
 	return IFD_SUCCESS;
@@ -137,11 +229,13 @@ RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length,
 
 RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
 {
-	(void) Lun;
-	(void) Tag;
-	(void) Length;
-	(void) Value;
-	return IFD_ERROR_TAG;
+	struct halse_dev *dev = halse_get(Lun);
+	if (!dev) {
+		Log2(PCSC_LOG_ERROR, "Lun 0x%lx not open!", Lun);
+		return IFD_NO_SUCH_DEVICE;
+	}
+
+	return halse_to_ifd(halse_set_param(dev, Tag, Value, Length));
 }
 
 RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol, UCHAR Flags,
@@ -168,20 +262,20 @@ RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD
 	}
 
 	if (Action == IFD_POWER_UP) {
-		ret = dev->power_up(dev);
+		ret = halse_power_up(dev);
 		if (ret)
 			return IFD_ERROR_POWER_ACTION;
 		ret = dev->get_atr(dev, Atr, (size_t*)AtrLength);
 		if (ret)
 			return IFD_COMMUNICATION_ERROR;
 	} else if (Action == IFD_POWER_DOWN) {
-		ret = dev->power_down(dev);
+		ret = halse_power_down(dev);
 		if (ret)
 			return IFD_ERROR_POWER_ACTION;
 		memset(Atr, 0, *AtrLength);
 		*AtrLength = 0;
 	} else if (Action == IFD_RESET) {
-		ret = dev->warm_reset(dev);
+		ret = halse_warm_reset(dev);
 		if (ret)
 			return IFD_ERROR_POWER_ACTION;
 		ret = dev->get_atr(dev, Atr, (size_t*)AtrLength);
@@ -198,6 +292,7 @@ RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 	RxLength, PSCARD_IO_HEADER RecvPci)
 {
 	int ret;
+	size_t len;
 
 	struct halse_dev *dev = halse_get(Lun);
 	if (!dev) {
@@ -207,9 +302,19 @@ RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 
 	memcpy(RecvPci, &SendPci, sizeof(SendPci));
 
-	ret = dev->xfer(dev, TxBuffer, TxLength, RxBuffer, (size_t*)RxLength);
-	if (ret)
+	if (TxLength > MAX_APDU_SIZE) {
+		Log2(PCSC_LOG_ERROR, "APDU too long: %lu", TxLength);
+		*RxLength = 0;
 		return IFD_COMMUNICATION_ERROR;
+	}
+
+	len = *RxLength;
+	ret = halse_xfer(dev, TxBuffer, TxLength, RxBuffer, &len);
+	if (ret) {
+		*RxLength = 0;
+		return halse_to_ifd(ret);
+	}
+	*RxLength = len;
 
 	return IFD_SUCCESS;
 }
@@ -222,6 +327,6 @@ RESPONSECODE IFDHICCPresence(DWORD Lun)
 		return IFD_NO_SUCH_DEVICE;
 	}
 
-	/* A SE cannot be removed... */
-	return IFD_SUCCESS;
+	/* A SE cannot be removed, but it can fail... */
+	return halse_present(dev) ? IFD_SUCCESS : IFD_ICC_NOT_PRESENT;
 }
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ifdse-broker: daemon serving SEs to local processes
+ * (see halse_broker.h).
+ *
+ * Usage: ifdse-broker [-d] [-s SOCKET] DEVICENAME...
+ *
+ * Every DEVICENAME describes one SE (same syntax as in the file
+ * libifdse, without ';' separated slots); clients select the SE by
+ * its index on the command line. Log messages go to stderr (-d: with
+ * debug messages).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <debuglog.h>
+
+#include "halse.h"
+#include "halse_broker_proto.h"
+#include "halse_broker.h"
+
+static int log_level = PCSC_LOG_INFO;
+static struct halse_broker *broker;
+
+/* Provided by PCSC lite for libifdse. */
+void log_msg(const int priority, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (priority < log_level)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void log_xxd(const int priority, const char *msg,
+	const unsigned char *buffer, const int size)
+{
+	int i;
+
+	if (priority < log_level)
+		return;
+
+	fputs(msg, stderr);
+	for (i = 0; i < size; i++)
+		fprintf(stderr, "%02X ", buffer[i]);
+	fputc('\n', stderr);
+}
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	halse_broker_stop(broker);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d] [-s SOCKET] DEVICENAME...\n", name);
+	fprintf(stderr, "  -d         log debug messages\n");
+	fprintf(stderr, "  -s SOCKET  path of the socket (default: %s)\n",
+		HALSE_BROKER_SOCKET);
+}
+
+int main(int argc, char **argv)
+{
+	struct halse_dev *devs[MAX_SE_DEVICES];
+	const char *path = HALSE_BROKER_SOCKET;
+	struct sigaction sa;
+	size_t n_devs = 0, i;
+	int ret = EXIT_FAILURE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ds:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				log_level = PCSC_LOG_DEBUG;
+				break;
+			case 's':
+				path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind == argc || argc - optind > MAX_SE_DEVICES) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (; optind < argc; optind++) {
+		devs[n_devs] = halse_create(argv[optind]);
+		if (!devs[n_devs]) {
+			fprintf(stderr, "Could not open SE '%s'\n", argv[optind]);
+			goto out;
+		}
+		n_devs++;
+	}
+
+	broker = halse_broker_create(path, devs, n_devs);
+	if (!broker)
+		goto out;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!halse_broker_run(broker))
+		ret = EXIT_SUCCESS;
+
+	halse_broker_destroy(broker);
+
+out:
+	for (i = 0; i < n_devs; i++)
+		halse_destroy(devs[i]);
+
+	return ret;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * CPU time of the driver per APDU, with a SE05x, which responds
+ * without any delay (no bus time, no processing time), so that the
+ * result is dominated by the protocol and I2C code.
+ *
+ * bench_cpu uses the generic driver, bench_cpu_se05x_kernel the
+ * specialized build of "make variants" (HALSE_ONLY_SE05X and
+ * HALI2C_ONLY_KERNEL with LTO).
+ *
+ * Usage: bench_cpu [-n APDUS] [-s SIZE]
+ */
+
+#ifdef HALI2C_ONLY_KERNEL
+#define BUILD "se05x-kernel"
+#else
+#define BUILD "generic"
+#endif
+
+static struct sim_se05x se;
+static unsigned char cmd[5 + 255];
+static unsigned char rsp[255 + 2];
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48";
+	size_t apdus = 20000;
+	size_t size = 16;
+	struct halse_dev *dev;
+	uint32_t delay_us = 0;
+	uint64_t cpu = 0, wall = 0;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				apdus = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				size = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n APDUS] [-s SIZE]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (!apdus || !size || size > 255) {
+		fprintf(stderr, "Invalid number of APDUs or size\n");
+		return 2;
+	}
+
+	sim_se05x_init(&se, "se05x");
+	se.i2c.bus_khz = 0;
+	se.proc_us = 0;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	if (halse_set_param(dev, TAG_IFDSE_XFER_DELAY_US,
+			(unsigned char *)&delay_us, sizeof(delay_us))) {
+		fprintf(stderr, "Could not disable the transfer delay\n");
+		halse_destroy(dev);
+		return 1;
+	}
+
+	cmd[0] = 0x80;
+	cmd[1] = 0x01;
+	cmd[4] = size;
+
+	/* The first APDUs warm up. */
+	for (i = 0; i < apdus + 100; i++) {
+		size_t rsp_len = sizeof(rsp);
+
+		if (i == 100) {
+			cpu = cpu_ns();
+			wall = monotonic_us();
+		}
+
+		if (halse_xfer(dev, cmd, 5 + size, rsp, &rsp_len) || rsp_len != size + 2) {
+			fprintf(stderr, "APDU %zu failed\n", i);
+			halse_destroy(dev);
+			return 1;
+		}
+	}
+
+	cpu = cpu_ns() - cpu;
+	wall = monotonic_us() - wall;
+
+	halse_destroy(dev);
+
+	printf("cpu (%s): %zu APDUs of %zu bytes, %.2f us CPU and %.2f us per APDU\n",
+		BUILD, apdus, size, cpu / 1000.0 / apdus, (double)wall / apdus);
+
+	return 0;
+}
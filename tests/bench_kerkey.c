@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * Throughput of the Kerkey protocol for large (extended length) APDUs,
+ * which are transferred in chained frames of 254 bytes. The result is
+ * compared with the time, which the bus needs for the bytes alone.
+ *
+ * Usage: bench_kerkey [-n APDUS] [-s SIZE] [-b BUS_KHZ] [-a ACK_US] [-p PROC_US]
+ */
+
+static struct sim_kerkey kk;
+static unsigned char cmd[SIM_MAX_APDU];
+static unsigned char rsp[SIM_MAX_APDU];
+
+int main(int argc, char **argv)
+{
+	char config[] = "se:kerkey@i2c:kernel:kerkey:0x20";
+	size_t apdus = 20;
+	size_t size = 2048;
+	struct halse_dev *dev;
+	size_t cmd_len, rsp_len;
+	uint64_t start, elapsed;
+	size_t i, frames;
+	int opt;
+
+	sim_kerkey_init(&kk, "kerkey");
+	kk.i2c.bus_khz = 400;
+	kk.ack_us = 200;
+	kk.proc_us = 1000;
+
+	while ((opt = getopt(argc, argv, "n:s:b:a:p:")) != -1) {
+		switch (opt) {
+			case 'n':
+				apdus = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				size = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				kk.i2c.bus_khz = strtoul(optarg, NULL, 0);
+				break;
+			case 'a':
+				kk.ack_us = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				kk.proc_us = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n APDUS] [-s SIZE] [-b BUS_KHZ] "
+					"[-a ACK_US] [-p PROC_US]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (!apdus || !size || size > 65535) {
+		fprintf(stderr, "Invalid number of APDUs or size\n");
+		return 2;
+	}
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated Kerkey\n");
+		return 1;
+	}
+
+	/* Case 4 extended: CLA INS P1 P2 00 Lc(2) data Le(2) */
+	cmd[0] = 0x80;
+	cmd[1] = 0x01;
+	cmd[4] = 0x00;
+	cmd[5] = (unsigned char)(size >> 8);
+	cmd[6] = (unsigned char)size;
+	for (i = 0; i < size; i++)
+		cmd[7 + i] = (unsigned char)i;
+	cmd_len = 7 + size + 2;
+
+	kk.i2c.bus_us = 0;
+	kk.frames = 0;
+
+	start = monotonic_us();
+	for (i = 0; i < apdus; i++) {
+		rsp_len = sizeof(rsp);
+		if (halse_xfer(dev, cmd, cmd_len, rsp, &rsp_len) ||
+		    rsp_len != size + 2 || memcmp(rsp, cmd + 7, size) ||
+		    rsp[size] != 0x90 || rsp[size + 1] != 0x00) {
+			fprintf(stderr, "APDU %zu failed\n", i);
+			halse_destroy(dev);
+			return 1;
+		}
+	}
+	elapsed = monotonic_us() - start;
+
+	halse_destroy(dev);
+
+	frames = kk.frames / apdus;
+	printf("kerkey: %zu APDUs of %zu bytes (%zu kHz, ack %zu us, processing %zu us)\n",
+		apdus, size, kk.i2c.bus_khz, kk.ack_us, kk.proc_us);
+	printf("  per APDU:   %.2f ms (bus %.2f ms, %.1f%%)\n",
+		elapsed / 1000.0 / apdus, kk.i2c.bus_us / 1000.0 / apdus,
+		100.0 * kk.i2c.bus_us / elapsed);
+	printf("  throughput: %.1f KB/s (command and response)\n",
+		(double)(cmd_len + rsp_len) * apdus / 1024 / (elapsed / 1e6));
+	printf("  overhead:   %.0f us per command frame (%zu frames per APDU)\n",
+		((double)(elapsed - kk.i2c.bus_us) / apdus - kk.proc_us) / frames,
+		frames);
+
+	return 0;
+}
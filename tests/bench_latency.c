@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * Latency of short APDUs (p50, p99, max), idle and with busy threads
+ * competing for the CPUs, without and with a SCHED_FIFO priority for
+ * the thread performing the I/O ("prio" option, needs CAP_SYS_NICE).
+ *
+ * Usage: bench_latency [-n APDUS] [-t THREADS] [-p PRIO]
+ */
+
+static struct sim_se05x se;
+static volatile bool stop_hogs;
+static uint64_t *samples;
+
+static void *hog_main(void *arg)
+{
+	(void)arg;
+
+	while (!stop_hogs)
+		;
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run(const char *name, const char *opts, size_t apdus, size_t hogs)
+{
+	char config[128];
+	unsigned char cmd[5 + 16] = { 0x80, 0x01, 0x00, 0x00, 16 };
+	unsigned char rsp[32];
+	pthread_t threads[64];
+	struct halse_dev *dev;
+	size_t i, n_threads = 0;
+	int ret = 0;
+
+	sim_se05x_init(&se, "se05x");
+	se.i2c.bus_khz = 400;
+	se.proc_us = 200;
+
+	snprintf(config, sizeof(config), "se:se05x@i2c:kernel:se05x:0x48%s", opts);
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	stop_hogs = false;
+	for (i = 0; i < hogs && i < sizeof(threads) / sizeof(threads[0]); i++) {
+		if (pthread_create(&threads[i], NULL, hog_main, NULL))
+			break;
+		n_threads++;
+	}
+
+	for (i = 0; i < apdus + 10; i++) {
+		size_t rsp_len = sizeof(rsp);
+		uint64_t start = monotonic_us();
+
+		if (halse_xfer(dev, cmd, sizeof(cmd), rsp, &rsp_len) || rsp_len != 18) {
+			fprintf(stderr, "%s: APDU %zu failed\n", name, i);
+			ret = 1;
+			break;
+		}
+
+		/* The first APDUs warm up. */
+		if (i >= 10)
+			samples[i - 10] = monotonic_us() - start;
+	}
+
+	stop_hogs = true;
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	halse_destroy(dev);
+
+	if (ret)
+		return ret;
+
+	qsort(samples, apdus, sizeof(*samples), cmp_u64);
+	printf("  %-22s p50 %6llu us   p99 %6llu us   max %6llu us\n", name,
+		(unsigned long long)samples[apdus / 2],
+		(unsigned long long)samples[apdus * 99 / 100],
+		(unsigned long long)samples[apdus - 1]);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t apdus = 1000;
+	size_t hogs = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	int prio = 50;
+	char opts[32];
+	char name[32];
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "n:t:p:")) != -1) {
+		switch (opt) {
+			case 'n':
+				apdus = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				hogs = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				prio = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n APDUS] [-t THREADS] [-p PRIO]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (!apdus || prio < 1 || prio > 99) {
+		fprintf(stderr, "Invalid number of APDUs or priority\n");
+		return 2;
+	}
+
+	samples = calloc(apdus, sizeof(*samples));
+	if (!samples)
+		return 1;
+
+	printf("latency: %zu APDUs (16 bytes, 400 kHz), %zu busy threads\n", apdus, hogs);
+	snprintf(opts, sizeof(opts), "@prio:%d", prio);
+	snprintf(name, sizeof(name), "busy, prio:%d", prio);
+
+	ret |= run("idle", "", apdus, 0);
+	ret |= run("busy", "", apdus, hogs);
+	ret |= run("busy, reactor", "@reactor", apdus, hogs);
+	ret |= run(name, opts, apdus, hogs);
+
+	free(samples);
+
+	return ret;
+}
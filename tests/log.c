@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <debuglog.h>
+
+/*
+ * Log sink of the driver: silent (the tests provoke errors), everything
+ * with TEST_DEBUG set in the environment.
+ */
+static int log_level(void)
+{
+	static int level = -1;
+
+	if (level < 0)
+		level = getenv("TEST_DEBUG") ? PCSC_LOG_DEBUG : PCSC_LOG_CRITICAL + 1;
+	return level;
+}
+
+void log_msg(const int priority, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (priority < log_level())
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+void log_xxd(const int priority, const char *msg,
+	const unsigned char *buffer, const int size)
+{
+	int i;
+
+	if (priority < log_level())
+		return;
+
+	fputs(msg, stderr);
+	for (i = 0; i < size; i++)
+		fprintf(stderr, "%02X ", buffer[i]);
+	fputc('\n', stderr);
+}
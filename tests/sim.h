@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Simulated I2C devices for the tests and benchmarks.
+ *
+ * The programs are linked without src/hali2c_kernel.c; sim_i2c.c
+ * provides the "kernel" I2C provider instead, which forwards the
+ * transfers of "i2c:kernel:<name>:<addr>" to the simulated device
+ * registered as <name>. A device NACKs (-ENXIO) as long as it isn't
+ * ready, like the real SEs do.
+ */
+
+struct sim_i2c {
+	/* Return len, or -ENXIO (NACK). */
+	int (*read)(struct sim_i2c *sim, unsigned char *buf, size_t len);
+	int (*write)(struct sim_i2c *sim, const unsigned char *buf, size_t len);
+	size_t bus_khz; /* I2C clock (0: transfers take no time) */
+	/* Statistics */
+	size_t reads;
+	size_t writes;
+	size_t nacks;
+	uint64_t bus_us; /* Time the bus was busy with transferring bytes */
+};
+
+/* Make sim available as "i2c:kernel:<name>:<addr>". */
+void sim_i2c_register(const char *name, struct sim_i2c *sim);
+
+/* Time a transfer of len bytes takes on the bus of sim. */
+uint64_t sim_i2c_bus_us(const struct sim_i2c *sim, size_t len);
+
+/* Simple APDU handler: returns the data of the command and 9000. */
+int sim_apdu_echo(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len);
+
+/* Max. length of a command or response APDU of the simulated SEs. */
+#define SIM_MAX_APDU (4 + 3 + 65536 + 3 + 2)
+
+/*
+ * SE05x (T=1 over I2C, see UM11225): handles I-block chaining in
+ * both directions, R-blocks, S(RESYNCH), S(IFS), S(SOFT RESET),
+ * S(RESET) and S(ATR).
+ */
+struct sim_se05x {
+	struct sim_i2c i2c;
+	/* Configuration */
+	size_t ifsc; /* IFSC reported in the ATR */
+	size_t proc_us; /* Processing time of an APDU */
+	/* Returns 0, -ve (6F00) or 1 (no response at all). */
+	int (*apdu)(const unsigned char *cmd, size_t cmd_len,
+		unsigned char *rsp, size_t *rsp_len);
+	/* Statistics */
+	size_t apdus;
+	size_t resets;
+	/* Protocol state */
+	size_t ifsd;
+	int host_ns; /* Expected N(S) of the next I-block of the host */
+	int ns; /* N(S) of our next I-block */
+	uint64_t ready_us; /* NACK until then */
+	unsigned char frame[3 + 254 + 2]; /* Pending block */
+	size_t frame_len;
+	size_t frame_off;
+	size_t rsp_off; /* Sent part of the response */
+	size_t cmd_len;
+	size_t rsp_len;
+	unsigned char cmd[SIM_MAX_APDU];
+	unsigned char rsp[SIM_MAX_APDU];
+};
+
+void sim_se05x_init(struct sim_se05x *se, const char *name);
+
+/*
+ * Kerkey: frames of up to 254 bytes, a chained frame is acknowledged
+ * with the header 8000 after ack_us, the response is ready proc_us
+ * after the last frame (header, then the data). A new command is only
+ * accepted once the response has been read.
+ */
+struct sim_kerkey {
+	struct sim_i2c i2c;
+	/* Configuration */
+	size_t ack_us; /* Time to buffer a chained frame */
+	size_t proc_us; /* Processing time of an APDU */
+	bool wtx; /* Answer 0000 (WTX) instead of NACK while processing */
+	int (*apdu)(const unsigned char *cmd, size_t cmd_len,
+		unsigned char *rsp, size_t *rsp_len);
+	/* Statistics */
+	size_t apdus;
+	size_t frames;
+	/* Protocol state */
+	uint64_t ready_us;
+	unsigned char out[2 + 254]; /* Pending header or data */
+	size_t out_len;
+	bool out_header; /* out holds a header (data follows) */
+	unsigned char data[254];
+	size_t data_len;
+	size_t rsp_off;
+	size_t cmd_len;
+	size_t rsp_len;
+	unsigned char cmd[SIM_MAX_APDU];
+	unsigned char rsp[SIM_MAX_APDU];
+};
+
+void sim_kerkey_init(struct sim_kerkey *kk, const char *name);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <debuglog.h>
+
+#include "helpers.h"
+#include "hali2c.h"
+#include "hali2c_kernel.h"
+#include "sim.h"
+
+#define MAX_SIM_DEVICES 8
+#define MAX_SIM_NAME_LEN 32
+
+static struct {
+	char name[MAX_SIM_NAME_LEN];
+	struct sim_i2c *sim;
+} sims[MAX_SIM_DEVICES];
+
+struct sim_i2c_dev
+{
+	/* Embed hali2c device */
+	struct hali2c_dev device;
+	struct sim_i2c *sim;
+};
+
+void sim_i2c_register(const char *name, struct sim_i2c *sim)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_SIM_DEVICES; i++) {
+		if (!sims[i].sim || strcmp(sims[i].name, name) == 0) {
+			snprintf(sims[i].name, sizeof(sims[i].name), "%s", name);
+			sims[i].sim = sim;
+			return;
+		}
+	}
+
+	fprintf(stderr, "Too many simulated I2C devices\n");
+	abort();
+}
+
+uint64_t sim_i2c_bus_us(const struct sim_i2c *sim, size_t len)
+{
+	/* Address byte plus data, 9 clocks (incl. ACK) each. */
+	if (!sim->bus_khz)
+		return 0;
+	return (uint64_t)(len + 1) * 9 * 1000 / sim->bus_khz;
+}
+
+/* Occupy the bus for the transfer of len bytes. */
+static void sim_i2c_bus(struct sim_i2c *sim, size_t len)
+{
+	uint64_t us = sim_i2c_bus_us(sim, len);
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	sim->bus_us += us;
+	if (us)
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+int hali2c_kernel_read(struct hali2c_dev* device, unsigned char* buf, size_t len)
+{
+	struct sim_i2c_dev *dev = container_of(device, struct sim_i2c_dev, device);
+	struct sim_i2c *sim = dev->sim;
+	int ret;
+
+	sim->reads++;
+	ret = sim->read(sim, buf, len);
+	if (ret < 0) {
+		sim->nacks++;
+		sim_i2c_bus(sim, 0);
+	} else {
+		sim_i2c_bus(sim, len);
+	}
+
+	return ret;
+}
+
+int hali2c_kernel_write(struct hali2c_dev* device, const unsigned char* buf, size_t len)
+{
+	struct sim_i2c_dev *dev = container_of(device, struct sim_i2c_dev, device);
+	struct sim_i2c *sim = dev->sim;
+	int ret;
+
+	sim->writes++;
+	ret = sim->write(sim, buf, len);
+	if (ret < 0) {
+		sim->nacks++;
+		sim_i2c_bus(sim, 0);
+	} else {
+		sim_i2c_bus(sim, len);
+	}
+
+	return ret;
+}
+
+int hali2c_kernel_slave_fd(struct hali2c_dev* device)
+{
+	(void)device;
+
+	return -ENOTSUP;
+}
+
+static void hali2c_sim_close(struct hali2c_dev* device)
+{
+	struct sim_i2c_dev *dev = container_of(device, struct sim_i2c_dev, device);
+
+	free(dev);
+}
+
+/*
+ * Open the simulated device, which was registered with the name
+ * in the pattern "<name>:<i2c_addr>" (the address is ignored).
+ */
+struct hali2c_dev* hali2c_open_kernel(char* config)
+{
+	struct sim_i2c_dev *dev;
+	size_t len;
+	size_t i;
+
+	if (!config)
+		return NULL;
+
+	len = strcspn(config, ":");
+	for (i = 0; i < MAX_SIM_DEVICES; i++) {
+		if (sims[i].sim && strlen(sims[i].name) == len &&
+		    strncmp(sims[i].name, config, len) == 0)
+			break;
+	}
+
+	if (i == MAX_SIM_DEVICES) {
+		Log2(PCSC_LOG_ERROR, "No simulated I2C device for '%s'", config);
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->sim = sims[i].sim;
+	dev->device.read = hali2c_kernel_read;
+	dev->device.write = hali2c_kernel_write;
+	dev->device.close = hali2c_sim_close;
+
+	return &dev->device;
+}
+
+int sim_apdu_echo(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	size_t n = 0;
+	size_t off = 5;
+
+	/* Data of a case 3/4 command (short or extended Lc) */
+	if (cmd_len > 5 && cmd[4] == 0 && cmd_len > 7) {
+		n = ((size_t)cmd[5] << 8) | cmd[6];
+		off = 7;
+	} else if (cmd_len > 5) {
+		n = cmd[4];
+	}
+	if (off + n > cmd_len)
+		n = 0;
+
+	memcpy(rsp, cmd + off, n);
+	rsp[n] = 0x90;
+	rsp[n + 1] = 0x00;
+	*rsp_len = n + 2;
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "helpers.h"
+#include "sim.h"
+
+#define KERKEY_CMD_TIMEOUT 0x75
+#define KERKEY_CMD_ATR 0x76
+
+#define FRAME_LENGTH_MAX 254
+#define HEADER_CHAIN 0x80
+
+/* Timeout reported by the Kerkey (ms) */
+#define SIM_KERKEY_TIMEOUT_MS 1000
+
+static const unsigned char sim_kerkey_atr[] = {
+	0x3B, 0x88, 0x80, 0x01, 'S', 'I', 'M', 'K', 'E', 'R', 'K', 'Y', 0x76,
+};
+
+/*
+ * Length of a complete command APDU, as far as it can be
+ * determined from the received part (0: not yet known).
+ */
+static size_t sim_kerkey_apdu_len(const unsigned char *cmd, size_t len)
+{
+	if (len <= 5)
+		return len < 4 ? 0 : len;
+	if (cmd[4])
+		return 5 + cmd[4]; /* Short Lc (Le is optional) */
+	if (len < 7)
+		return 0;
+	return 7 + (((size_t)cmd[5] << 8) | cmd[6]); /* Extended Lc */
+}
+
+/* Queue the next header (and chunk of the response). */
+static void sim_kerkey_next_chunk(struct sim_kerkey *kk)
+{
+	size_t n = kk->rsp_len - kk->rsp_off;
+
+	if (n > FRAME_LENGTH_MAX)
+		n = FRAME_LENGTH_MAX;
+
+	kk->out[0] = (unsigned char)(n >> 8);
+	if (kk->rsp_off + n < kk->rsp_len)
+		kk->out[0] |= HEADER_CHAIN;
+	kk->out[1] = (unsigned char)n;
+	kk->out_len = 2;
+	kk->out_header = true;
+	memcpy(kk->data, kk->rsp + kk->rsp_off, n);
+	kk->data_len = n;
+	kk->rsp_off += n;
+}
+
+static void sim_kerkey_respond(struct sim_kerkey *kk, const unsigned char *rsp,
+	size_t len, uint64_t ready_us)
+{
+	if (rsp != kk->rsp)
+		memcpy(kk->rsp, rsp, len);
+	kk->rsp_len = len;
+	kk->rsp_off = 0;
+	kk->ready_us = ready_us;
+	sim_kerkey_next_chunk(kk);
+}
+
+static int sim_kerkey_write(struct sim_i2c *sim, const unsigned char *buf, size_t len)
+{
+	struct sim_kerkey *kk = container_of(sim, struct sim_kerkey, i2c);
+	uint64_t now = monotonic_us();
+	uint64_t end = now + sim_i2c_bus_us(sim, len); /* End of the transfer */
+	size_t apdu_len;
+
+	if (now < kk->ready_us || len > FRAME_LENGTH_MAX)
+		return -ENXIO;
+
+	/* The response of the last command is still pending. */
+	if (kk->out_len && kk->rsp_len)
+		return -ENXIO;
+
+	kk->frames++;
+	kk->out_len = 0;
+
+	if (kk->cmd_len == 0 && len == 1 && buf[0] == KERKEY_CMD_TIMEOUT) {
+		const unsigned char rsp[] = {
+			SIM_KERKEY_TIMEOUT_MS >> 8, SIM_KERKEY_TIMEOUT_MS & 0xFF,
+		};
+		sim_kerkey_respond(kk, rsp, sizeof(rsp), end);
+		return (int)len;
+	}
+
+	if (kk->cmd_len == 0 && len == 1 && buf[0] == KERKEY_CMD_ATR) {
+		sim_kerkey_respond(kk, sim_kerkey_atr, sizeof(sim_kerkey_atr), end);
+		return (int)len;
+	}
+
+	if (kk->cmd_len + len > sizeof(kk->cmd))
+		return -EIO;
+
+	memcpy(kk->cmd + kk->cmd_len, buf, len);
+	kk->cmd_len += len;
+
+	apdu_len = sim_kerkey_apdu_len(kk->cmd, kk->cmd_len);
+	if (!apdu_len || kk->cmd_len < apdu_len) {
+		/* Acknowledge the chained frame, once it has been buffered. */
+		kk->out[0] = HEADER_CHAIN;
+		kk->out[1] = 0x00;
+		kk->out_len = 2;
+		kk->out_header = false;
+		kk->data_len = 0;
+		kk->rsp_len = 0;
+		kk->rsp_off = 0;
+		kk->ready_us = end + kk->ack_us;
+		return (int)len;
+	}
+
+	kk->apdus++;
+	if (kk->apdu(kk->cmd, kk->cmd_len, kk->rsp, &kk->rsp_len)) {
+		kk->rsp[0] = 0x6F;
+		kk->rsp[1] = 0x00;
+		kk->rsp_len = 2;
+	}
+	kk->cmd_len = 0;
+	sim_kerkey_respond(kk, kk->rsp, kk->rsp_len, end + kk->proc_us);
+
+	return (int)len;
+}
+
+static int sim_kerkey_read(struct sim_i2c *sim, unsigned char *buf, size_t len)
+{
+	struct sim_kerkey *kk = container_of(sim, struct sim_kerkey, i2c);
+
+	if (monotonic_us() < kk->ready_us && kk->wtx && kk->out_header && len == 2) {
+		buf[0] = 0x00;
+		buf[1] = 0x00;
+		return (int)len;
+	}
+
+	if (monotonic_us() < kk->ready_us || !kk->out_len)
+		return -ENXIO;
+
+	if (len > kk->out_len)
+		len = kk->out_len;
+	memcpy(buf, kk->out, len);
+
+	if (!kk->out_header) {
+		kk->out_len = 0;
+	} else if (kk->data_len) {
+		/* The data follows the header. */
+		memcpy(kk->out, kk->data, kk->data_len);
+		kk->out_len = kk->data_len;
+		kk->out_header = false;
+		kk->data_len = 0;
+	} else {
+		kk->out_len = 0;
+	}
+
+	/* More chunks follow the data. */
+	if (!kk->out_len && kk->rsp_off < kk->rsp_len)
+		sim_kerkey_next_chunk(kk);
+
+	return (int)len;
+}
+
+void sim_kerkey_init(struct sim_kerkey *kk, const char *name)
+{
+	memset(kk, 0, sizeof(*kk));
+	kk->i2c.read = sim_kerkey_read;
+	kk->i2c.write = sim_kerkey_write;
+	kk->apdu = sim_apdu_echo;
+	sim_i2c_register(name, &kk->i2c);
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "helpers.h"
+#include "sim.h"
+
+#define SE05X_NAD 0x5A
+#define HOST_NAD 0xA5
+
+#define I_BLOCK_MASK 0x80
+#define R_BLOCK 0x80
+#define R_BLOCK_MASK 0xC0
+#define S_BLOCK 0xC0
+#define S_RESPONSE 0x20
+
+#define CMD_RESYNC 0x00
+#define CMD_SET_IFC 0x01
+#define CMD_EOA 0x05
+#define CMD_RESET 0x06
+#define CMD_ATR 0x07
+#define CMD_SOFT_RESET 0x0F
+
+#define EE_CRC_ERROR 0x01
+
+#define SIZE_PROLOGUE 3
+#define SIZE_INF_MAX 254
+#define SIZE_EPILOGUE 2
+
+/*
+ * ATR (see UM11225): BWT 1000 ms, IFSC (replaced), MPOT 1 ms,
+ * SEGT 10 us, WUT 100 us.
+ */
+static const unsigned char sim_se05x_atr[] = {
+	0x00, /* PVER */
+	0x04, 0x00, 0x50, 0x00, 0x00, /* VID */
+	0x04, 0x03, 0xE8, 0x00, 0xFE, /* DLLP: BWT, IFSC */
+	0x02, /* PLID */
+	0x0B, 0x01, 0x90, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x0A, 0x00, 0x64, /* PLP */
+	0x08, 'S', 'I', 'M', 'S', 'E', '0', '5', 'X', /* HB */
+};
+#define ATR_IFSC_OFF 10
+
+static uint16_t sim_se05x_crc(const unsigned char *buf, size_t len)
+{
+	uint16_t crc = 0xFFFF;
+	size_t i, b;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (b = 0; b < 8; b++)
+			crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ 0x8408) : crc >> 1;
+	}
+
+	crc ^= 0xFFFF;
+	return swap_uint16(crc);
+}
+
+/* Queue a block, which can be read from ready_us on. */
+static void sim_se05x_send(struct sim_se05x *se, uint8_t pcb,
+	const unsigned char *inf, size_t len, uint64_t ready_us)
+{
+	uint16_t crc;
+
+	se->frame[0] = HOST_NAD;
+	se->frame[1] = pcb;
+	se->frame[2] = (unsigned char)len;
+	memcpy(&se->frame[SIZE_PROLOGUE], inf, len);
+	crc = sim_se05x_crc(se->frame, SIZE_PROLOGUE + len);
+	se->frame[SIZE_PROLOGUE + len] = crc >> 8;
+	se->frame[SIZE_PROLOGUE + len + 1] = crc & 0xFF;
+	se->frame_len = SIZE_PROLOGUE + len + SIZE_EPILOGUE;
+	se->frame_off = 0;
+	se->ready_us = ready_us;
+}
+
+/* Queue the next I-block of the response. */
+static void sim_se05x_send_chunk(struct sim_se05x *se, uint64_t ready_us)
+{
+	size_t n = se->rsp_len - se->rsp_off;
+	uint8_t pcb = (uint8_t)(se->ns << 6);
+
+	if (n > se->ifsd) {
+		n = se->ifsd;
+		pcb |= 1 << 5;
+	}
+
+	sim_se05x_send(se, pcb, se->rsp + se->rsp_off, n, ready_us);
+	se->rsp_off += n;
+	se->ns ^= 1;
+}
+
+static void sim_se05x_reset(struct sim_se05x *se)
+{
+	se->ifsd = SIZE_INF_MAX;
+	se->host_ns = 0;
+	se->ns = 0;
+	se->cmd_len = 0;
+	se->rsp_len = 0;
+	se->rsp_off = 0;
+	se->resets++;
+}
+
+static void sim_se05x_s_block(struct sim_se05x *se, uint8_t type,
+	const unsigned char *inf, size_t len, uint64_t end)
+{
+	unsigned char atr[sizeof(sim_se05x_atr)];
+
+	memcpy(atr, sim_se05x_atr, sizeof(atr));
+	atr[ATR_IFSC_OFF] = (unsigned char)se->ifsc;
+
+	switch (type) {
+		case CMD_RESYNC:
+			se->host_ns = 0;
+			se->ns = 0;
+			se->cmd_len = 0;
+			sim_se05x_send(se, S_BLOCK | S_RESPONSE | type, NULL, 0, end);
+			break;
+		case CMD_SET_IFC:
+			if (len == 1 && inf[0] && inf[0] <= SIZE_INF_MAX)
+				se->ifsd = inf[0];
+			sim_se05x_send(se, S_BLOCK | S_RESPONSE | type, inf, len, end);
+			break;
+		case CMD_SOFT_RESET:
+			sim_se05x_reset(se);
+			sim_se05x_send(se, S_BLOCK | S_RESPONSE | type, atr, sizeof(atr), end);
+			break;
+		case CMD_RESET:
+			sim_se05x_reset(se);
+			sim_se05x_send(se, S_BLOCK | S_RESPONSE | type, NULL, 0, end);
+			break;
+		case CMD_ATR:
+			sim_se05x_send(se, S_BLOCK | S_RESPONSE | type, atr, sizeof(atr), end);
+			break;
+		case CMD_EOA:
+			sim_se05x_send(se, S_BLOCK | S_RESPONSE | type, NULL, 0, end);
+			break;
+		default:
+			/* Unknown request: report an error. */
+			sim_se05x_send(se, R_BLOCK | (se->host_ns << 4) | 0x02, NULL, 0, end);
+			break;
+	}
+}
+
+static void sim_se05x_i_block(struct sim_se05x *se, uint8_t pcb,
+	const unsigned char *inf, size_t len, uint64_t end)
+{
+	int ret;
+
+	if (se->cmd_len + len > sizeof(se->cmd)) {
+		se->cmd_len = 0;
+		sim_se05x_send(se, R_BLOCK | (se->host_ns << 4) | 0x02, NULL, 0, end);
+		return;
+	}
+
+	memcpy(se->cmd + se->cmd_len, inf, len);
+	se->cmd_len += len;
+	se->host_ns ^= 1;
+
+	/* More blocks follow: acknowledge with N(R) of the next block. */
+	if (pcb & (1 << 5)) {
+		sim_se05x_send(se, R_BLOCK | (se->host_ns << 4), NULL, 0, end);
+		return;
+	}
+
+	se->apdus++;
+	ret = se->apdu(se->cmd, se->cmd_len, se->rsp, &se->rsp_len);
+	se->cmd_len = 0;
+	se->rsp_off = 0;
+	if (ret > 0) {
+		/* Mute: the host has to recover. */
+		se->rsp_len = 0;
+		se->frame_len = 0;
+		se->frame_off = 0;
+		return;
+	} else if (ret) {
+		se->rsp[0] = 0x6F;
+		se->rsp[1] = 0x00;
+		se->rsp_len = 2;
+	}
+	sim_se05x_send_chunk(se, end + se->proc_us);
+}
+
+static int sim_se05x_write(struct sim_i2c *sim, const unsigned char *buf, size_t len)
+{
+	struct sim_se05x *se = container_of(sim, struct sim_se05x, i2c);
+	uint64_t now = monotonic_us();
+	uint64_t end = now + sim_i2c_bus_us(sim, len); /* End of the transfer */
+	size_t inf_len;
+	uint8_t pcb;
+
+	if (now < se->ready_us)
+		return -ENXIO;
+
+	if (len < SIZE_PROLOGUE + SIZE_EPILOGUE || buf[0] != SE05X_NAD ||
+	    buf[2] > SIZE_INF_MAX || len != (size_t)SIZE_PROLOGUE + buf[2] + SIZE_EPILOGUE)
+		return -EIO;
+
+	pcb = buf[1];
+	inf_len = buf[2];
+
+	if (sim_se05x_crc(buf, SIZE_PROLOGUE + inf_len) !=
+	    (((uint16_t)buf[SIZE_PROLOGUE + inf_len] << 8) | buf[SIZE_PROLOGUE + inf_len + 1])) {
+		sim_se05x_send(se, R_BLOCK | (se->host_ns << 4) | EE_CRC_ERROR, NULL, 0, end);
+		return (int)len;
+	}
+
+	if (!(pcb & I_BLOCK_MASK)) {
+		sim_se05x_i_block(se, pcb, buf + SIZE_PROLOGUE, inf_len, end);
+	} else if ((pcb & R_BLOCK_MASK) == R_BLOCK) {
+		if (pcb & 0x03) {
+			/* Retransmission of the last block */
+			se->frame_off = 0;
+			se->ready_us = end;
+		} else if (se->rsp_off < se->rsp_len) {
+			sim_se05x_send_chunk(se, end);
+		}
+	} else if (pcb & S_RESPONSE) {
+		/* Response to a WTX request (never sent) */
+	} else {
+		sim_se05x_s_block(se, pcb & 0x1F, buf + SIZE_PROLOGUE, inf_len, end);
+	}
+
+	return (int)len;
+}
+
+static int sim_se05x_read(struct sim_i2c *sim, unsigned char *buf, size_t len)
+{
+	struct sim_se05x *se = container_of(sim, struct sim_se05x, i2c);
+	size_t n = se->frame_len - se->frame_off;
+
+	if (monotonic_us() < se->ready_us || !n)
+		return -ENXIO;
+
+	if (len > n)
+		len = n;
+	memcpy(buf, se->frame + se->frame_off, len);
+	se->frame_off += len;
+
+	return (int)len;
+}
+
+void sim_se05x_init(struct sim_se05x *se, const char *name)
+{
+	memset(se, 0, sizeof(*se));
+	se->i2c.read = sim_se05x_read;
+	se->i2c.write = sim_se05x_write;
+	se->ifsc = SIZE_INF_MAX;
+	se->ifsd = SIZE_INF_MAX;
+	se->apdu = sim_apdu_echo;
+	sim_i2c_register(name, &se->i2c);
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "halse.h"
+#include "halse_async.h"
+#include "halse_reactor.h"
+#include "halsched.h"
+
+/*
+ * Transfers to a busy device are queued and run in submission order,
+ * both in a loop and via the reactor. Devices with real-time settings
+ * don't share their reactor thread.
+ */
+
+#define N_XFERS 8
+
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char order[2 * N_XFERS];
+static size_t n_order;
+static size_t n_done;
+
+/* Takes a while and records the order, in which the APDUs have run. */
+static int fake_xfer(struct halse_dev *dev, unsigned char *tx_buf, size_t tx_len,
+	unsigned char *rx_buf, size_t *rx_len)
+{
+	(void)dev;
+	(void)tx_len;
+
+	if (halsched_sleep_us(2000))
+		return -EIO;
+
+	pthread_mutex_lock(&order_lock);
+	order[n_order++] = tx_buf[0];
+	pthread_mutex_unlock(&order_lock);
+
+	rx_buf[0] = 0x90;
+	rx_buf[1] = 0x00;
+	*rx_len = 2;
+	return 0;
+}
+
+static void done(struct halse_xfer *xfer)
+{
+	(void)xfer;
+	n_done++;
+}
+
+static int test_loop(void)
+{
+	struct halse_dev dev = { .xfer = fake_xfer };
+	struct halse_xfer xfers[N_XFERS];
+	unsigned char tx[N_XFERS];
+	unsigned char rx[N_XFERS][2];
+	struct halse_loop *loop;
+	size_t i;
+	int ret = 0;
+
+	loop = halse_loop_create();
+	if (!loop)
+		return 1;
+
+	n_order = 0;
+	for (i = 0; i < N_XFERS; i++) {
+		tx[i] = (unsigned char)i;
+		xfers[i] = (struct halse_xfer) {
+			.tx_buf = &tx[i],
+			.tx_len = 1,
+			.rx_buf = rx[i],
+			.rx_len = sizeof(rx[i]),
+			.done = done,
+		};
+		if (halse_xfer_submit(loop, &dev, &xfers[i])) {
+			fprintf(stderr, "loop: submit %zu failed\n", i);
+			ret = 1;
+		}
+	}
+
+	while (!ret && n_done < N_XFERS) {
+		if (halse_loop_dispatch(loop, 1000) < 0)
+			ret = 1;
+	}
+
+	for (i = 0; i < N_XFERS && !ret; i++) {
+		if (xfers[i].ret || xfers[i].rx_len != 2 || order[i] != i) {
+			fprintf(stderr, "loop: transfer %zu out of order\n", i);
+			ret = 1;
+		}
+	}
+
+	halse_async_release(&dev);
+	halse_loop_destroy(loop);
+	return ret;
+}
+
+struct client {
+	pthread_t thread;
+	struct halse_dev *dev;
+	unsigned char tx;
+	int ret;
+};
+
+static void *client_main(void *arg)
+{
+	struct client *c = arg;
+	unsigned char rx[2];
+	size_t rx_len = sizeof(rx);
+
+	c->ret = halse_reactor_xfer(c->dev, &c->tx, 1, rx, &rx_len);
+	return NULL;
+}
+
+static int test_reactor(void)
+{
+	struct halse_dev dev = { .xfer = fake_xfer };
+	struct client clients[N_XFERS];
+	size_t i;
+	int ret = 0;
+
+	if (halse_reactor_attach(&dev, 1))
+		return 1;
+
+	/* All clients share the device. */
+	n_order = 0;
+	for (i = 0; i < N_XFERS; i++) {
+		clients[i].dev = &dev;
+		clients[i].tx = (unsigned char)i;
+		pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+	}
+
+	for (i = 0; i < N_XFERS; i++) {
+		pthread_join(clients[i].thread, NULL);
+		if (clients[i].ret) {
+			fprintf(stderr, "reactor: transfer %zu failed: %d\n", i, clients[i].ret);
+			ret = 1;
+		}
+	}
+
+	if (n_order != N_XFERS) {
+		fprintf(stderr, "reactor: %zu of %d transfers\n", n_order, N_XFERS);
+		ret = 1;
+	}
+
+	halse_reactor_detach(&dev);
+	halse_async_release(&dev);
+	return ret;
+}
+
+static int test_reactor_rt(void)
+{
+	struct halse_dev shared[2] = { { .xfer = fake_xfer }, { .xfer = fake_xfer } };
+	struct halse_dev pinned[2] = { { .xfer = fake_xfer }, { .xfer = fake_xfer } };
+	unsigned char tx = 0, rx[2];
+	size_t rx_len = sizeof(rx), i;
+	int ret = 0;
+
+	for (i = 0; i < 2; i++) {
+		pinned[i].rt.cpumask = 1;
+		if (halse_reactor_attach(&shared[i], 1) || halse_reactor_attach(&pinned[i], 1))
+			return 1;
+	}
+
+	if (shared[0].reactor != shared[1].reactor ||
+	    pinned[0].reactor == shared[0].reactor ||
+	    pinned[1].reactor == shared[0].reactor ||
+	    pinned[0].reactor == pinned[1].reactor) {
+		fprintf(stderr, "reactor: pinned devices share a thread\n");
+		ret = 1;
+	}
+
+	if (halse_reactor_xfer(&pinned[0], &tx, 1, rx, &rx_len)) {
+		fprintf(stderr, "reactor: transfer on own thread failed\n");
+		ret = 1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		halse_reactor_detach(&shared[i]);
+		halse_reactor_detach(&pinned[i]);
+		halse_async_release(&shared[i]);
+		halse_async_release(&pinned[i]);
+	}
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= test_loop();
+	ret |= test_reactor();
+	ret |= test_reactor_rt();
+
+	return ret;
+}
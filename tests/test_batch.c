@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "halse.h"
+#include "halse_batch.h"
+#include "sim.h"
+
+/*
+ * Batched APDU execution with a simulated SE05x: malformed requests
+ * are rejected before anything is executed, STOP_ON_ERROR and a full
+ * response buffer end the batch.
+ */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+static struct sim_se05x se;
+
+/* INS 0x01: echo with 9000, INS 0x02: 6A82 */
+static int sim_applet(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	if (cmd_len >= 4 && cmd[1] == 0x02) {
+		rsp[0] = 0x6A;
+		rsp[1] = 0x82;
+		*rsp_len = 2;
+		return 0;
+	}
+
+	return sim_apdu_echo(cmd, cmd_len, rsp, rsp_len);
+}
+
+/* Returns the result of halse_batch() and the number of APDUs executed. */
+static int batch(struct halse_dev *dev, const unsigned char *req, size_t req_len,
+	unsigned char *rsp, size_t *rsp_len, size_t *apdus)
+{
+	unsigned char buf[64];
+	size_t before = se.apdus;
+	int ret;
+
+	memcpy(buf, req, req_len);
+	ret = halse_batch(dev, buf, req_len, rsp, rsp_len);
+	*apdus = se.apdus - before;
+
+	return ret;
+}
+
+static int test_malformed(struct halse_dev *dev)
+{
+	/* A valid item followed by a broken one */
+	static const unsigned char short_hdr[] = {
+		0x00, 0x00, 0x04, 0x80, 0x01, 0x00, 0x00,
+		0x00, 0x00,
+	};
+	static const unsigned char short_apdu[] = {
+		0x00, 0x00, 0x04, 0x80, 0x01, 0x00, 0x00,
+		0x00, 0x00, 0x03, 0x80, 0x01, 0x00,
+	};
+	static const unsigned char truncated[] = {
+		0x00, 0x00, 0x04, 0x80, 0x01, 0x00, 0x00,
+		0x00, 0x00, 0x06, 0x80, 0x01, 0x00, 0x00, 0x01,
+	};
+	static const unsigned char too_long[] = {
+		0x00, 0x00, 0x04, 0x80, 0x01, 0x00, 0x00,
+		0x00, 0xFF, 0xFF, 0x80, 0x01, 0x00, 0x00,
+	};
+	unsigned char rsp[64];
+	size_t rsp_len, apdus;
+
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, short_hdr, 0, rsp, &rsp_len, &apdus) == -EINVAL && apdus == 0);
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, short_hdr, sizeof(short_hdr), rsp, &rsp_len, &apdus) == -EINVAL);
+	CHECK(apdus == 0);
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, short_apdu, sizeof(short_apdu), rsp, &rsp_len, &apdus) == -EINVAL);
+	CHECK(apdus == 0);
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, truncated, sizeof(truncated), rsp, &rsp_len, &apdus) == -EINVAL);
+	CHECK(apdus == 0);
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, too_long, sizeof(too_long), rsp, &rsp_len, &apdus) == -EINVAL);
+	CHECK(apdus == 0);
+
+	/* No room for a single item header */
+	rsp_len = HALSE_BATCH_HDR_LEN - 1;
+	CHECK(batch(dev, short_hdr, 7, rsp, &rsp_len, &apdus) == -ENOSPC && apdus == 0);
+
+	return 0;
+}
+
+static int test_execution(struct halse_dev *dev)
+{
+	static const unsigned char req[] = {
+		0x00, 0x00, 0x06, 0x80, 0x01, 0x00, 0x00, 0x01, 0xAA,
+		0x00, 0x00, 0x04, 0x80, 0x02, 0x00, 0x00,
+		0x00, 0x00, 0x06, 0x80, 0x01, 0x00, 0x00, 0x01, 0xBB,
+	};
+	static const unsigned char rsp_all[] = {
+		HALSE_BATCH_OK, 0x00, 0x03, 0xAA, 0x90, 0x00,
+		HALSE_BATCH_OK, 0x00, 0x02, 0x6A, 0x82,
+		HALSE_BATCH_OK, 0x00, 0x03, 0xBB, 0x90, 0x00,
+	};
+	unsigned char stop[sizeof(req)];
+	unsigned char rsp[64];
+	size_t rsp_len, apdus;
+
+	/* Without STOP_ON_ERROR, the failing command doesn't end the batch. */
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, req, sizeof(req), rsp, &rsp_len, &apdus) == 0 && apdus == 3);
+	CHECK(rsp_len == sizeof(rsp_all) && !memcmp(rsp, rsp_all, rsp_len));
+
+	/* With STOP_ON_ERROR, it does. */
+	memcpy(stop, req, sizeof(req));
+	stop[9] = HALSE_BATCH_STOP_ON_ERROR;
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, stop, sizeof(stop), rsp, &rsp_len, &apdus) == 0 && apdus == 2);
+	CHECK(rsp_len == 11 && !memcmp(rsp, rsp_all, rsp_len));
+
+	/* STOP_ON_ERROR on a successful command */
+	stop[0] = HALSE_BATCH_STOP_ON_ERROR;
+	stop[9] = 0x00;
+	rsp_len = sizeof(rsp);
+	CHECK(batch(dev, stop, sizeof(stop), rsp, &rsp_len, &apdus) == 0 && apdus == 3);
+	CHECK(rsp_len == sizeof(rsp_all));
+
+	/* The command of a NO_SPACE item has been executed. */
+	rsp_len = 6 + HALSE_BATCH_HDR_LEN + 1;
+	CHECK(batch(dev, req, sizeof(req), rsp, &rsp_len, &apdus) == 0 && apdus == 2);
+	CHECK(rsp_len == 6 + HALSE_BATCH_HDR_LEN);
+	CHECK(rsp[6] == HALSE_BATCH_NO_SPACE && rsp[7] == 0x00 && rsp[8] == 0x00);
+
+	/* An item without room for its header isn't executed. */
+	rsp_len = 6 + HALSE_BATCH_HDR_LEN - 1;
+	CHECK(batch(dev, req, sizeof(req), rsp, &rsp_len, &apdus) == 0 && apdus == 1);
+	CHECK(rsp_len == 6);
+
+	return 0;
+}
+
+int main(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48";
+	struct halse_dev *dev;
+	int ret = 0;
+
+	sim_se05x_init(&se, "se05x");
+	se.apdu = sim_applet;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	ret |= test_malformed(dev);
+	ret |= test_execution(dev);
+
+	halse_destroy(dev);
+
+	return ret;
+}
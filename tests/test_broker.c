@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "helpers.h"
+#include "halse.h"
+#include "halse_broker.h"
+#include "halse_broker_client.h"
+#include "sim.h"
+
+/*
+ * SE broker and its clients (libifdse-client and the "broker" provider)
+ * with a simulated SE05x: requests, power counting, skipped resets,
+ * exclusive access and the end of sessions.
+ */
+
+static struct sim_se05x se;
+static char dir[] = "/tmp/test_broker.XXXXXX";
+static char path[64];
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+static void *broker_main(void *arg)
+{
+	halse_broker_run(arg);
+	return NULL;
+}
+
+/* Send an APDU with one byte of data, expect it back. */
+static int echo(struct halse_broker_client *c, unsigned char v)
+{
+	unsigned char cmd[] = { 0x80, 0x01, 0x00, 0x00, 0x01, v };
+	unsigned char rsp[8];
+	size_t rsp_len = sizeof(rsp);
+	int ret;
+
+	ret = halse_broker_xfer(c, cmd, sizeof(cmd), rsp, &rsp_len);
+	if (ret)
+		return ret;
+	if (rsp_len != 3 || rsp[0] != v || rsp[1] != 0x90 || rsp[2] != 0x00)
+		return -EIO;
+
+	return 0;
+}
+
+struct waiter {
+	pthread_t thread;
+	struct halse_broker_client *c;
+	volatile bool done;
+	int ret;
+};
+
+static void *waiter_main(void *arg)
+{
+	struct waiter *w = arg;
+
+	w->ret = echo(w->c, 0x42);
+	w->done = true;
+
+	return NULL;
+}
+
+static int test_client(void)
+{
+	struct halse_broker_client *a, *b, *c;
+	unsigned char atr[64];
+	size_t atr_len = sizeof(atr);
+	uint32_t delay_us = 7, v = 0;
+	size_t len = sizeof(v);
+	size_t resets;
+	struct waiter w;
+
+	CHECK(halse_broker_connect(path, 1, &a) == -ENODEV);
+	CHECK(!halse_broker_connect(path, 0, &a));
+	CHECK(!halse_broker_connect(path, 0, &b));
+
+	/* Transfers need a power up of the session. */
+	CHECK(echo(a, 1) == -EIO);
+	CHECK(!halse_broker_power_up(a));
+	CHECK(!echo(a, 2));
+	CHECK(echo(b, 3) == -EIO);
+	CHECK(!halse_broker_get_atr(a, atr, &atr_len) && atr_len > 0);
+
+	CHECK(!halse_broker_set_param(a, TAG_IFDSE_XFER_DELAY_US,
+		(unsigned char *)&delay_us, sizeof(delay_us)));
+	CHECK(!halse_broker_get_param(b, TAG_IFDSE_XFER_DELAY_US,
+		(unsigned char *)&v, &len));
+	CHECK(len == sizeof(v) && v == delay_us);
+
+	/* A reset is skipped while another session uses the SE. */
+	CHECK(!halse_broker_power_up(b));
+	resets = se.resets;
+	CHECK(!halse_broker_warm_reset(a));
+	CHECK(se.resets == resets);
+
+	/* The SE stays powered for b. */
+	CHECK(!halse_broker_power_down(a));
+	CHECK(!echo(b, 4));
+	CHECK(!halse_broker_warm_reset(b));
+	CHECK(se.resets != resets);
+	CHECK(!halse_broker_power_up(a));
+
+	/* The requests of b wait for the end of the exclusive access of a. */
+	CHECK(!halse_broker_begin(a));
+	CHECK(!halse_broker_begin(a));
+	w = (struct waiter){ .c = b };
+	CHECK(!pthread_create(&w.thread, NULL, waiter_main, &w));
+	usleep(100 * 1000);
+	CHECK(!w.done);
+	CHECK(!echo(a, 5));
+	CHECK(!halse_broker_end(a));
+	pthread_join(w.thread, NULL);
+	CHECK(w.done && !w.ret);
+
+	/* The end of a session ends its exclusive access. */
+	CHECK(!halse_broker_connect(path, 0, &c));
+	CHECK(!halse_broker_begin(c));
+	w = (struct waiter){ .c = a };
+	CHECK(!pthread_create(&w.thread, NULL, waiter_main, &w));
+	usleep(100 * 1000);
+	CHECK(!w.done);
+	halse_broker_disconnect(c);
+	pthread_join(w.thread, NULL);
+	CHECK(w.done && !w.ret);
+
+	halse_broker_disconnect(a);
+	halse_broker_disconnect(b);
+
+	return 0;
+}
+
+/* The "broker" provider of libifdse. */
+static int test_provider(void)
+{
+	char config[128];
+	unsigned char cmd[] = { 0x80, 0x01, 0x00, 0x00, 0x01, 0x17 };
+	unsigned char rsp[8];
+	size_t rsp_len = sizeof(rsp);
+	struct halse_dev *dev;
+	uint32_t v = 1;
+	size_t len = sizeof(v);
+
+	snprintf(config, sizeof(config), "se:broker@%s:0", path);
+	dev = halse_create(config);
+	CHECK(dev);
+
+	CHECK(!halse_power_up(dev));
+	CHECK(!halse_xfer(dev, cmd, sizeof(cmd), rsp, &rsp_len));
+	CHECK(rsp_len == 3 && rsp[0] == 0x17);
+
+	CHECK(!halse_set_param(dev, TAG_IFDSE_BROKER_EXCLUSIVE,
+		(unsigned char *)&v, sizeof(v)));
+	v = 0;
+	CHECK(!halse_get_param(dev, TAG_IFDSE_BROKER_EXCLUSIVE,
+		(unsigned char *)&v, &len));
+	CHECK(v == 1);
+	v = 2;
+	CHECK(halse_set_param(dev, TAG_IFDSE_BROKER_EXCLUSIVE,
+		(unsigned char *)&v, sizeof(v)) == -EINVAL);
+
+	/* A power down ends the exclusive access. */
+	CHECK(!halse_power_down(dev));
+	len = sizeof(v);
+	CHECK(!halse_get_param(dev, TAG_IFDSE_BROKER_EXCLUSIVE,
+		(unsigned char *)&v, &len));
+	CHECK(v == 0);
+
+	halse_destroy(dev);
+
+	return 0;
+}
+
+int main(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48";
+	struct halse_broker *broker;
+	struct halse_dev *dev;
+	pthread_t thread;
+	int ret = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/sock", dir);
+
+	sim_se05x_init(&se, "se05x");
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		rmdir(dir);
+		return 1;
+	}
+
+	broker = halse_broker_create(path, &dev, 1);
+	if (!broker || pthread_create(&thread, NULL, broker_main, broker)) {
+		fprintf(stderr, "Could not start the broker\n");
+		halse_broker_destroy(broker);
+		halse_destroy(dev);
+		rmdir(dir);
+		return 1;
+	}
+
+	ret |= test_client();
+	ret |= test_provider();
+
+	halse_broker_stop(broker);
+	pthread_join(thread, NULL);
+	halse_broker_destroy(broker);
+	halse_destroy(dev);
+	rmdir(dir);
+
+	return ret;
+}
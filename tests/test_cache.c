@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * Response cache ("cache") with a simulated SE05x: the key (channel,
+ * selected applet, command), the replacement of entries and the
+ * flushes on other commands, errors and power or reset actions.
+ * A command answered from the cache doesn't reach the SE.
+ */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+static struct sim_se05x se;
+static bool mute; /* The SE doesn't answer */
+
+static const unsigned char select_a[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x05, 0xA0, 0x00, 0x00, 0x00, 0x0A,
+};
+static const unsigned char select_b[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x05, 0xA0, 0x00, 0x00, 0x00, 0x0B,
+};
+static const unsigned char read_1[] = { 0x80, 0x02, 0x00, 0x00, 0x01, 0x11 };
+static const unsigned char read_2[] = { 0x80, 0x02, 0x00, 0x00, 0x01, 0x22 };
+static const unsigned char read_3[] = { 0x80, 0x02, 0x00, 0x00, 0x01, 0x33 };
+static const unsigned char read_ch1[] = { 0x81, 0x02, 0x00, 0x00, 0x01, 0x11 };
+static const unsigned char read_err[] = { 0x80, 0x02, 0x00, 0x00, 0x01, 0xEE };
+static const unsigned char write[] = { 0x80, 0x03, 0x00, 0x00, 0x01, 0x11 };
+
+/* Echo with 9000, 6A82 for the data byte EE */
+static int sim_applet(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	if (mute)
+		return 1;
+
+	if (cmd_len == 6 && cmd[5] == 0xEE) {
+		rsp[0] = 0x6A;
+		rsp[1] = 0x82;
+		*rsp_len = 2;
+		return 0;
+	}
+
+	return sim_apdu_echo(cmd, cmd_len, rsp, rsp_len);
+}
+
+/* Returns the number of APDUs which reached the SE (0: cached), or -1. */
+static int sent(struct halse_dev *dev, const unsigned char *cmd, size_t len)
+{
+	unsigned char rsp[32];
+	size_t rsp_len = sizeof(rsp);
+	size_t before = se.apdus;
+
+	if (halse_xfer(dev, (unsigned char *)cmd, len, rsp, &rsp_len))
+		return -1;
+
+	/* The response is the same, whether it's cached or not. */
+	if (len > 5 && (rsp_len != len - 5 + 2 || memcmp(rsp, &cmd[5], len - 5)))
+		if (rsp_len != 2 || rsp[0] != 0x6A)
+			return -1;
+
+	return (int)(se.apdus - before);
+}
+
+#define SENT(cmd) sent(dev, cmd, sizeof(cmd))
+
+static int test_key(struct halse_dev *dev)
+{
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(read_1) == 0);
+	CHECK(SENT(select_a) == 0);
+	CHECK(SENT(read_1) == 0);
+
+	/* Other data, another channel or another applet: another key */
+	CHECK(SENT(read_2) == 1);
+	CHECK(SENT(read_ch1) == 1);
+	CHECK(SENT(read_ch1) == 0);
+	CHECK(SENT(select_b) == 1);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(read_1) == 0);
+
+	/* The entries of applet A are still valid once it is selected again. */
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 0);
+	CHECK(SENT(read_2) == 0);
+
+	/* Only successful responses are cached. */
+	CHECK(SENT(read_err) == 1);
+	CHECK(SENT(read_err) == 1);
+
+	return 0;
+}
+
+static int test_eviction(struct halse_dev *dev)
+{
+	uint32_t entries = 2;
+
+	CHECK(halse_set_param(dev, TAG_IFDSE_CACHE_ENTRIES,
+		(unsigned char *)&entries, sizeof(entries)) == 0);
+
+	/* The oldest entry (the SELECT, then read_1) is replaced. */
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(read_2) == 1);
+	CHECK(SENT(read_3) == 1);
+	CHECK(SENT(read_2) == 0);
+	CHECK(SENT(read_3) == 0);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(select_a) == 1);
+
+	entries = 32;
+	CHECK(halse_set_param(dev, TAG_IFDSE_CACHE_ENTRIES,
+		(unsigned char *)&entries, sizeof(entries)) == 0);
+
+	return 0;
+}
+
+static int test_flush(struct halse_dev *dev)
+{
+	unsigned char rsp[2];
+	size_t rsp_len = sizeof(rsp);
+	uint32_t bwt_ms = 20, rnak = 1;
+
+	/* A command which isn't allowlisted */
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(write) == 1);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(select_a) == 1);
+
+	/* A response which doesn't fit */
+	CHECK(SENT(read_1) == 1);
+	CHECK(halse_xfer(dev, (unsigned char *)read_2, sizeof(read_2), rsp, &rsp_len) != 0);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(select_a) == 1);
+
+	/* A failed transfer */
+	halse_set_param(dev, TAG_IFDSE_RESPONSE_TIMEOUT_MS,
+		(unsigned char *)&bwt_ms, sizeof(bwt_ms));
+	halse_set_param(dev, TAG_IFDSE_MAX_RNAK, (unsigned char *)&rnak, sizeof(rnak));
+	CHECK(SENT(read_1) == 1);
+	mute = true;
+	CHECK(SENT(read_2) == -1);
+	mute = false;
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 1);
+
+	/* A reset */
+	CHECK(halse_warm_reset(dev) == 0);
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 1);
+	CHECK(SENT(read_1) == 0);
+
+	/* A power cycle */
+	CHECK(halse_power_down(dev) == 0);
+	CHECK(halse_power_up(dev) == 0);
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(read_1) == 1);
+
+	return 0;
+}
+
+int main(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48@cache:00A40400@cache:80020000@cache:81020000";
+	struct halse_dev *dev;
+	int ret = 0;
+
+	sim_se05x_init(&se, "se05x");
+	se.apdu = sim_applet;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	ret |= test_key(dev);
+	ret |= test_eviction(dev);
+	ret |= test_flush(dev);
+
+	halse_destroy(dev);
+
+	return ret;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * Kerkey protocol: chaining of commands and responses at the
+ * frame boundaries, APDU deadlines and the recovery from aborted
+ * exchanges.
+ */
+
+static struct sim_kerkey kk;
+static unsigned char cmd[SIM_MAX_APDU];
+static unsigned char rsp[SIM_MAX_APDU];
+
+static const size_t sizes[] = {
+	0, 1, 200, 247, 248, 255, 256, 500, 501, 502, 1000, 2048, 4096, 65535,
+};
+
+/* Build a command APDU with size bytes of data, returns its length. */
+static size_t build_cmd(size_t size)
+{
+	size_t cmd_len, off;
+	size_t i;
+
+	cmd[0] = 0x80;
+	cmd[1] = 0x01;
+	if (size == 0) {
+		cmd_len = 4; /* Case 1 */
+		off = 4;
+	} else if (size <= 255) {
+		cmd[4] = (unsigned char)size; /* Case 3 short */
+		cmd_len = 5 + size;
+		off = 5;
+	} else {
+		cmd[4] = 0x00; /* Case 4 extended */
+		cmd[5] = (unsigned char)(size >> 8);
+		cmd[6] = (unsigned char)size;
+		cmd_len = 7 + size + 2;
+		off = 7;
+		cmd[cmd_len - 2] = 0x00;
+		cmd[cmd_len - 1] = 0x00;
+	}
+	for (i = 0; i < size; i++)
+		cmd[off + i] = (unsigned char)(i * 7);
+
+	return cmd_len;
+}
+
+static int check_size(struct halse_dev *dev, size_t size)
+{
+	size_t cmd_len = build_cmd(size);
+	size_t rsp_len = sizeof(rsp);
+	size_t i;
+	int ret;
+
+	ret = halse_xfer(dev, cmd, cmd_len, rsp, &rsp_len);
+	if (ret) {
+		fprintf(stderr, "%zu bytes: xfer failed: %d\n", size, ret);
+		return 1;
+	}
+
+	if (rsp_len != size + 2 || rsp[size] != 0x90 || rsp[size + 1] != 0x00) {
+		fprintf(stderr, "%zu bytes: wrong response (%zu bytes)\n", size, rsp_len);
+		return 1;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (rsp[i] != (unsigned char)(i * 7)) {
+			fprintf(stderr, "%zu bytes: wrong data at %zu\n", size, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	char config[] = "se:kerkey@i2c:kernel:kerkey:0x20";
+	struct halse_dev *dev;
+	unsigned char atr[MAX_ATR_SIZE];
+	size_t atr_len = sizeof(atr);
+	uint32_t apdu_timeout_ms = 50;
+	size_t rsp_len;
+	size_t i;
+	int ret = 0;
+
+	sim_kerkey_init(&kk, "kerkey");
+	kk.ack_us = 100;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated Kerkey\n");
+		return 1;
+	}
+
+	if (dev->get_atr(dev, atr, &atr_len) || atr_len != 13 || atr[0] != 0x3B) {
+		fprintf(stderr, "Wrong ATR\n");
+		ret = 1;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		ret |= check_size(dev, sizes[i]);
+
+	/* Response doesn't fit into the buffer */
+	rsp_len = 100;
+	if (halse_xfer(dev, cmd, build_cmd(1000), rsp, &rsp_len) != -ENOSPC) {
+		fprintf(stderr, "Small buffer not detected\n");
+		ret = 1;
+	}
+
+	/* The response of an aborted APDU doesn't end up with the next one. */
+	if (check_size(dev, 10))
+		ret = 1;
+
+	/* An APDU, which is still WTX at its deadline, times out. */
+	kk.wtx = true;
+	kk.proc_us = 300 * 1000;
+	halse_set_param(dev, TAG_IFDSE_APDU_TIMEOUT_MS,
+		(unsigned char *)&apdu_timeout_ms, sizeof(apdu_timeout_ms));
+	rsp_len = sizeof(rsp);
+	if (halse_xfer(dev, cmd, build_cmd(20), rsp, &rsp_len) != -ETIMEDOUT) {
+		fprintf(stderr, "APDU deadline not reported as timeout\n");
+		ret = 1;
+	}
+	kk.proc_us = 0;
+	apdu_timeout_ms = 0;
+	halse_set_param(dev, TAG_IFDSE_APDU_TIMEOUT_MS,
+		(unsigned char *)&apdu_timeout_ms, sizeof(apdu_timeout_ms));
+	if (check_size(dev, 30))
+		ret = 1;
+
+	halse_destroy(dev);
+
+	return ret;
+}
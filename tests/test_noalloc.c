@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * Steady state without heap allocations: after opening a SE (with and
+ * without the reactor), transfers and resets must not allocate memory.
+ *
+ * malloc() and friends are interposed by the definitions below, which
+ * forward to glibc and count the calls made while counting is armed
+ * (in any thread, e.g. the reactor threads).
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile bool counting;
+static volatile size_t allocs;
+
+void *malloc(size_t size)
+{
+	if (counting)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	if (counting)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	if (counting && ptr)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	__libc_free(ptr);
+}
+
+static struct sim_se05x se;
+static struct sim_kerkey kk;
+static unsigned char cmd[5 + 1000];
+static unsigned char rsp[1000 + 2];
+
+static int run(const char *name, const char *device)
+{
+	char config[128];
+	struct halse_dev *dev;
+	size_t i;
+	int ret = 0;
+
+	snprintf(config, sizeof(config), "%s", device);
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "%s: could not open the simulated SE\n", name);
+		return 1;
+	}
+
+	/* No warm-up: the first transfer must not allocate either. */
+	allocs = 0;
+	counting = true;
+
+	for (i = 0; i < 100 && !ret; i++) {
+		/* Short and chained (extended length) commands. */
+		size_t size = i % 2 ? 16 : 1000;
+		size_t cmd_len = 7 + size;
+		size_t rsp_len = sizeof(rsp);
+
+		cmd[0] = 0x80;
+		cmd[1] = 0x01;
+		cmd[4] = 0x00;
+		cmd[5] = (unsigned char)(size >> 8);
+		cmd[6] = (unsigned char)size;
+
+		if (halse_xfer(dev, cmd, cmd_len, rsp, &rsp_len) || rsp_len != size + 2) {
+			fprintf(stderr, "%s: APDU %zu failed\n", name, i);
+			ret = 1;
+		}
+
+		if (i % 25 == 10 && halse_warm_reset(dev)) {
+			fprintf(stderr, "%s: reset %zu failed\n", name, i);
+			ret = 1;
+		}
+
+		if (i % 50 == 40 && (halse_power_down(dev) || halse_power_up(dev))) {
+			fprintf(stderr, "%s: power cycle %zu failed\n", name, i);
+			ret = 1;
+		}
+	}
+
+	counting = false;
+
+	if (allocs) {
+		fprintf(stderr, "%s: %zu heap allocations in steady state\n", name, allocs);
+		ret = 1;
+	}
+
+	halse_destroy(dev);
+
+	return ret;
+}
+
+int main(void)
+{
+	void * volatile p;
+	int ret = 0;
+
+	/* Make sure, the interposition works. */
+	counting = true;
+	p = malloc(16);
+	free(p);
+	counting = false;
+	if (allocs != 2) {
+		fprintf(stderr, "malloc() isn't interposed\n");
+		return 1;
+	}
+
+	sim_se05x_init(&se, "se05x");
+	sim_kerkey_init(&kk, "kerkey");
+
+	ret |= run("se05x", "se:se05x@i2c:kernel:se05x:0x48");
+	ret |= run("se05x, reactor", "se:se05x@i2c:kernel:se05x:0x48@reactor");
+	ret |= run("kerkey, reactor", "se:kerkey@i2c:kernel:kerkey:0x20@reactor");
+
+	return ret;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * SE pool ("pool") with two simulated SE05x: allowlisted APDUs are
+ * spread over the members with the SELECT of the primary replayed,
+ * everything else (and everything while the selection of the primary
+ * is unknown) goes to the primary.
+ */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+struct applet {
+	bool iot; /* IoT applet selected */
+	size_t selects;
+	size_t getrandoms;
+	size_t others;
+};
+
+static struct sim_se05x se[2];
+static struct applet applets[2];
+
+static const unsigned char select_iot[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x10,
+	0xA0, 0x00, 0x00, 0x03, 0x96, 0x54, 0x53, 0x00,
+	0x00, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00, 0x00,
+};
+static const unsigned char select_other[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x08,
+	0xA0, 0x00, 0x00, 0x01, 0x51, 0x00, 0x00, 0x00,
+};
+static const unsigned char select_missing[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x05, 0xFF, 0x00, 0x00, 0x00, 0x00,
+};
+static const unsigned char getrandom[] = {
+	0x80, 0x04, 0x00, 0x49, 0x04, 0x41, 0x02, 0x00, 0x08, 0x00,
+};
+/* Same CLA:INS as GetRandom, but a management command */
+static const unsigned char mgmt[] = { 0x80, 0x04, 0x00, 0x2F, 0x00 };
+/* GetRandom on a logical channel */
+static const unsigned char getrandom_ch1[] = {
+	0x81, 0x04, 0x00, 0x49, 0x04, 0x41, 0x02, 0x00, 0x08, 0x00,
+};
+
+static int applet(struct applet *a, const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	size_t n = 0;
+
+	if (cmd_len < 4)
+		return -1;
+
+	if (cmd[1] == 0xA4) {
+		a->selects++;
+		if (cmd_len > 5 && cmd[5] == 0xFF) {
+			rsp[0] = 0x6A;
+			rsp[1] = 0x82;
+			*rsp_len = 2;
+			return 0;
+		}
+		a->iot = cmd[4] == sizeof(select_iot) - 5;
+	} else if ((cmd[0] & 0xFC) == 0x80 && cmd[1] == 0x04 && cmd[3] == 0x49) {
+		a->getrandoms++;
+		if (!a->iot) {
+			rsp[0] = 0x69;
+			rsp[1] = 0x85;
+			*rsp_len = 2;
+			return 0;
+		}
+		rsp[n++] = 0x41;
+		rsp[n++] = 8;
+		memset(rsp + n, 0x5A, 8);
+		n += 8;
+	} else {
+		a->others++;
+	}
+
+	rsp[n++] = 0x90;
+	rsp[n++] = 0x00;
+	*rsp_len = n;
+	return 0;
+}
+
+static int applet0(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	return applet(&applets[0], cmd, cmd_len, rsp, rsp_len);
+}
+
+static int applet1(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	return applet(&applets[1], cmd, cmd_len, rsp, rsp_len);
+}
+
+/* Returns the status word of the response, or -1. */
+static int send_apdu(struct halse_dev *dev, const unsigned char *cmd, size_t len)
+{
+	unsigned char rsp[64];
+	size_t rsp_len = sizeof(rsp);
+
+	if (halse_xfer(dev, (unsigned char *)cmd, len, rsp, &rsp_len) || rsp_len < 2)
+		return -1;
+
+	return (rsp[rsp_len - 2] << 8) | rsp[rsp_len - 1];
+}
+
+static int test_config(void)
+{
+	char no_ins[] = "se:pool@se:se05x@i2c:kernel:se05x0:0x48|allow:80";
+	char no_p2[] = "se:pool@se:se05x@i2c:kernel:se05x0:0x48|allow:80:04:00";
+	char too_long[] = "se:pool@se:se05x@i2c:kernel:se05x0:0x48|allow:80:04:00:49:00";
+	char bad_byte[] = "se:pool@se:se05x@i2c:kernel:se05x0:0x48|allow:80:104";
+
+	CHECK(!halse_create(no_ins));
+	CHECK(!halse_create(no_p2));
+	CHECK(!halse_create(too_long));
+	CHECK(!halse_create(bad_byte));
+
+	return 0;
+}
+
+static int test_dispatch(void)
+{
+	char config[] = "se:pool@se:se05x@i2c:kernel:se05x0:0x48"
+		"|se:se05x@i2c:kernel:se05x1:0x48|allow:80:04:00:49";
+	struct halse_dev *dev;
+	size_t i;
+
+	dev = halse_create(config);
+	CHECK(dev);
+
+	/* The SELECT goes to the primary only... */
+	CHECK(send_apdu(dev, select_iot, sizeof(select_iot)) == 0x9000);
+	CHECK(applets[0].selects == 1 && applets[1].selects == 0);
+
+	/* ...and is replayed once on the member, before its first GetRandom. */
+	for (i = 0; i < 4; i++)
+		CHECK(send_apdu(dev, getrandom, sizeof(getrandom)) == 0x9000);
+	CHECK(applets[0].getrandoms == 2 && applets[1].getrandoms == 2);
+	CHECK(applets[1].selects == 1 && applets[1].iot);
+
+	/* P1/P2 and the logical channel are part of the match. */
+	CHECK(send_apdu(dev, mgmt, sizeof(mgmt)) == 0x9000);
+	CHECK(send_apdu(dev, mgmt, sizeof(mgmt)) == 0x9000);
+	CHECK(applets[0].others == 2 && applets[1].others == 0);
+	CHECK(send_apdu(dev, getrandom_ch1, sizeof(getrandom_ch1)) == 0x9000);
+	CHECK(send_apdu(dev, getrandom_ch1, sizeof(getrandom_ch1)) == 0x9000);
+	CHECK(applets[0].getrandoms == 4 && applets[1].getrandoms == 2);
+
+	/* Another selection of the primary is taken over, too
+	 * (the member with the fewest transfers gets both APDUs). */
+	CHECK(send_apdu(dev, select_other, sizeof(select_other)) == 0x9000);
+	for (i = 0; i < 2; i++)
+		CHECK(send_apdu(dev, getrandom, sizeof(getrandom)) == 0x6985);
+	CHECK(applets[0].getrandoms == 4 && applets[1].getrandoms == 4);
+	CHECK(applets[1].selects == 2 && !applets[1].iot);
+
+	/* While the selection of the primary is unknown, everything goes there. */
+	CHECK(send_apdu(dev, select_iot, sizeof(select_iot)) == 0x9000);
+	CHECK(send_apdu(dev, select_missing, sizeof(select_missing)) == 0x6A82);
+	for (i = 0; i < 2; i++)
+		send_apdu(dev, getrandom, sizeof(getrandom));
+	CHECK(applets[0].getrandoms == 6 && applets[1].getrandoms == 4);
+	CHECK(applets[1].selects == 2);
+
+	/* After a reset, nothing is selected and nothing is replayed. */
+	CHECK(halse_warm_reset(dev) == 0);
+	applets[0].iot = applets[1].iot = false;
+	for (i = 0; i < 2; i++)
+		CHECK(send_apdu(dev, getrandom, sizeof(getrandom)) == 0x6985);
+	CHECK(applets[0].getrandoms == 6 && applets[1].getrandoms == 6);
+	CHECK(applets[1].selects == 2);
+
+	halse_destroy(dev);
+
+	return 0;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	sim_se05x_init(&se[0], "se05x0");
+	se[0].apdu = applet0;
+	sim_se05x_init(&se[1], "se05x1");
+	se[1].apdu = applet1;
+
+	ret |= test_config();
+	ret |= test_dispatch();
+
+	return ret;
+}
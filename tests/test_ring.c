@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "halse_ring.h"
+
+/*
+ * SPSC ring of the SE broker: order, full and empty ring, wrap around
+ * of the indices, detection of corrupt indices and a producer and a
+ * consumer thread.
+ */
+
+#define N_MSGS 200000
+
+static struct halse_ring ring;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+/* Fill the ring with the ops first..., then empty it again. */
+static int fill_and_drain(uint32_t first)
+{
+	struct halse_ring_msg *msg;
+	int corrupt;
+	uint32_t i;
+
+	for (i = 0; i < HALSE_RING_SLOTS; i++) {
+		msg = halse_ring_reserve(&ring);
+		CHECK(msg);
+		msg->op = first + i;
+		halse_ring_push(&ring);
+	}
+	CHECK(!halse_ring_reserve(&ring));
+
+	for (i = 0; i < HALSE_RING_SLOTS; i++) {
+		msg = halse_ring_peek(&ring, &corrupt);
+		CHECK(msg && !corrupt);
+		CHECK(msg->op == first + i);
+		halse_ring_pop(&ring);
+	}
+	CHECK(!halse_ring_peek(&ring, &corrupt) && !corrupt);
+
+	return 0;
+}
+
+static void *consumer_main(void *arg)
+{
+	struct halse_ring_msg *msg;
+	uint64_t seq = 0;
+	int corrupt;
+
+	(void)arg;
+
+	while (seq < N_MSGS) {
+		msg = halse_ring_peek(&ring, &corrupt);
+		if (corrupt)
+			return (void *)"corrupt ring";
+		if (!msg) {
+			sched_yield();
+			continue;
+		}
+		if (msg->seq != seq || msg->len != (uint32_t)(seq % 251) ||
+		    msg->data[msg->len] != (unsigned char)seq)
+			return (void *)"message out of order or torn";
+		halse_ring_pop(&ring);
+		seq++;
+	}
+
+	return NULL;
+}
+
+static int threads(void)
+{
+	struct halse_ring_msg *msg;
+	pthread_t consumer;
+	uint64_t seq;
+	void *err;
+
+	halse_ring_init(&ring);
+	CHECK(!pthread_create(&consumer, NULL, consumer_main, NULL));
+
+	for (seq = 0; seq < N_MSGS; seq++) {
+		while (!(msg = halse_ring_reserve(&ring)))
+			sched_yield();
+		msg->seq = seq;
+		msg->len = seq % 251;
+		msg->data[msg->len] = (unsigned char)seq;
+		halse_ring_push(&ring);
+	}
+
+	pthread_join(consumer, &err);
+	if (err) {
+		fprintf(stderr, "consumer: %s\n", (const char *)err);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int corrupt;
+
+	halse_ring_init(&ring);
+	CHECK(!halse_ring_peek(&ring, &corrupt) && !corrupt);
+	CHECK(!fill_and_drain(1));
+	CHECK(!fill_and_drain(100));
+
+	/* Free running indices wrap around. */
+	ring.head = ring.tail = UINT32_MAX - 1;
+	CHECK(!fill_and_drain(200));
+	CHECK(ring.head == HALSE_RING_SLOTS - 2);
+
+	/* A misbehaving producer (head too far ahead of tail). */
+	ring.tail = 10;
+	ring.head = 10 + HALSE_RING_SLOTS + 1;
+	CHECK(!halse_ring_peek(&ring, &corrupt) && corrupt);
+	ring.head = 9;
+	CHECK(!halse_ring_peek(&ring, &corrupt) && corrupt);
+
+	CHECK(!threads());
+
+	return 0;
+}
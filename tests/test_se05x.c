@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * SE05x protocol (T=1 over I2C): ATR, chaining of commands and
+ * responses at the block boundaries, IFS negotiation.
+ */
+
+static struct sim_se05x se;
+static unsigned char cmd[SIM_MAX_APDU];
+static unsigned char rsp[SIM_MAX_APDU];
+
+static const size_t sizes[] = {
+	1, 2, 200, 247, 248, 249, 250, 255, 256, 500, 501, 502, 1000, 2048, 65535,
+};
+
+/* Build a case 3 command APDU with size bytes of data, returns its length. */
+static size_t build_cmd(size_t size)
+{
+	size_t off;
+	size_t i;
+
+	cmd[0] = 0x80;
+	cmd[1] = 0x01;
+	cmd[2] = 0x00;
+	cmd[3] = 0x00;
+	if (size <= 255) {
+		cmd[4] = (unsigned char)size;
+		off = 5;
+	} else {
+		cmd[4] = 0x00;
+		cmd[5] = (unsigned char)(size >> 8);
+		cmd[6] = (unsigned char)size;
+		off = 7;
+	}
+	for (i = 0; i < size; i++)
+		cmd[off + i] = (unsigned char)(i * 7);
+
+	return off + size;
+}
+
+static int check_size(struct halse_dev *dev, const char *name, size_t size)
+{
+	size_t rsp_len = sizeof(rsp);
+	size_t i;
+	int ret;
+
+	ret = halse_xfer(dev, cmd, build_cmd(size), rsp, &rsp_len);
+	if (ret) {
+		fprintf(stderr, "%s: %zu bytes: xfer failed: %d\n", name, size, ret);
+		return 1;
+	}
+
+	if (rsp_len != size + 2 || rsp[size] != 0x90 || rsp[size + 1] != 0x00) {
+		fprintf(stderr, "%s: %zu bytes: wrong response (%zu bytes)\n", name, size, rsp_len);
+		return 1;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (rsp[i] != (unsigned char)(i * 7)) {
+			fprintf(stderr, "%s: %zu bytes: wrong data at %zu\n", name, size, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_config(const char *name, const char *opts, size_t card_ifsc,
+	size_t ifsc, size_t ifsd)
+{
+	char config[128];
+	struct halse_dev *dev;
+	unsigned char atr[MAX_ATR_SIZE];
+	size_t atr_len = sizeof(atr);
+	size_t rsp_len;
+	size_t i;
+	int ret = 0;
+
+	sim_se05x_init(&se, "se05x");
+	se.ifsc = card_ifsc;
+
+	snprintf(config, sizeof(config), "se:se05x@i2c:kernel:se05x:0x48%s", opts);
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "%s: could not open the simulated SE05x\n", name);
+		return 1;
+	}
+
+	/* The synthesized ATR reports the IFSC in TA(3). */
+	if (dev->get_atr(dev, atr, &atr_len) || atr_len < 8 || atr[7] != ifsc) {
+		fprintf(stderr, "%s: wrong ATR\n", name);
+		ret = 1;
+	}
+
+	if (se.ifsd != ifsd) {
+		fprintf(stderr, "%s: IFSD %zu instead of %zu\n", name, se.ifsd, ifsd);
+		ret = 1;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		ret |= check_size(dev, name, sizes[i]);
+
+	/* Response doesn't fit into the buffer, the next APDU still works. */
+	rsp_len = 100;
+	if (halse_xfer(dev, cmd, build_cmd(1000), rsp, &rsp_len) != -ENOSPC) {
+		fprintf(stderr, "%s: small buffer not detected\n", name);
+		ret = 1;
+	}
+	ret |= check_size(dev, name, 300);
+
+	halse_destroy(dev);
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= check_config("default", "", 254, 254, 254);
+	ret |= check_config("card ifsc", "", 100, 100, 254);
+	ret |= check_config("ifs", "@ifs:64", 254, 64, 64);
+
+	return ret;
+}
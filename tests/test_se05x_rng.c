@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * SE05x GetRandom prefetch ("rng"): nothing is prefetched within a
+ * command chain or before the GET RESPONSE of a 61xx response, the
+ * buffer is only used while the IoT applet is selected and a failed
+ * prefetch doesn't reset the SE05x.
+ */
+
+#define IDLE_US (60 * 1000) /* Longer than the idle time of the prefetch */
+
+static struct sim_se05x se;
+static size_t getrandoms; /* Updated by the SE (under the device lock) */
+static bool mute_getrandom; /* The SE doesn't answer GetRandom */
+
+static const unsigned char select_iot[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x10,
+	0xA0, 0x00, 0x00, 0x03, 0x96, 0x54, 0x53, 0x00,
+	0x00, 0x00, 0x01, 0x03, 0x00, 0x00, 0x00, 0x00,
+};
+static const unsigned char select_other[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x08,
+	0xA0, 0x00, 0x00, 0x01, 0x51, 0x00, 0x00, 0x00,
+};
+static const unsigned char getrandom[] = {
+	0x80, 0x04, 0x00, 0x49, 0x04, 0x41, 0x02, 0x00, 0x10, 0x00,
+};
+static const unsigned char cmd_61xx[] = { 0x80, 0x02, 0x00, 0x00, 0x00 };
+static const unsigned char get_response[] = { 0x00, 0xC0, 0x00, 0x00, 0x10 };
+static const unsigned char cmd_chained[] = { 0x90, 0x03, 0x00, 0x00, 0x01, 0xAA };
+static const unsigned char cmd_last[] = { 0x80, 0x03, 0x00, 0x00, 0x01, 0xBB };
+
+static int sim_applet(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	size_t n;
+
+	if (cmd_len < 4)
+		return -1;
+
+	switch (cmd[1]) {
+		case 0x04: /* GetRandom */
+			if (__atomic_load_n(&mute_getrandom, __ATOMIC_RELAXED))
+				return 1;
+			n = ((size_t)cmd[7] << 8) | cmd[8];
+			if (n > 127)
+				n = 127;
+			rsp[0] = 0x41;
+			rsp[1] = (unsigned char)n;
+			memset(&rsp[2], 0x5A, n);
+			rsp[2 + n] = 0x90;
+			rsp[3 + n] = 0x00;
+			*rsp_len = n + 4;
+			__atomic_add_fetch(&getrandoms, 1, __ATOMIC_RELAXED);
+			return 0;
+		case 0x02: /* Response is available via GET RESPONSE */
+			rsp[0] = 0x61;
+			rsp[1] = 0x10;
+			*rsp_len = 2;
+			return 0;
+		default:
+			rsp[0] = 0x90;
+			rsp[1] = 0x00;
+			*rsp_len = 2;
+			return 0;
+	}
+}
+
+static size_t fetched_while_idle(struct halse_dev *dev, const unsigned char *cmd, size_t len)
+{
+	unsigned char rsp[32];
+	size_t rsp_len = sizeof(rsp);
+	size_t before;
+
+	if (halse_xfer(dev, (unsigned char *)cmd, len, rsp, &rsp_len))
+		return (size_t)-1;
+
+	before = __atomic_load_n(&getrandoms, __ATOMIC_RELAXED);
+	usleep(IDLE_US);
+	return __atomic_load_n(&getrandoms, __ATOMIC_RELAXED) - before;
+}
+
+static int send_apdu(struct halse_dev *dev, const unsigned char *cmd, size_t len)
+{
+	unsigned char rsp[32];
+	size_t rsp_len = sizeof(rsp);
+
+	return halse_xfer(dev, (unsigned char *)cmd, len, rsp, &rsp_len);
+}
+
+static int test_pending(void)
+{
+	/* The buffer expires quickly, so that every APDU triggers a refill. */
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48@rng:256:30";
+	struct halse_dev *dev;
+	int ret = 0;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	if (fetched_while_idle(dev, select_iot, sizeof(select_iot)) == 0) {
+		fprintf(stderr, "Nothing prefetched after selecting the applet\n");
+		ret = 1;
+	}
+
+	if (fetched_while_idle(dev, cmd_61xx, sizeof(cmd_61xx)) != 0) {
+		fprintf(stderr, "Prefetched before GET RESPONSE\n");
+		ret = 1;
+	}
+	fetched_while_idle(dev, get_response, sizeof(get_response));
+
+	if (fetched_while_idle(dev, cmd_chained, sizeof(cmd_chained)) != 0) {
+		fprintf(stderr, "Prefetched within a command chain\n");
+		ret = 1;
+	}
+	fetched_while_idle(dev, cmd_last, sizeof(cmd_last));
+
+	halse_destroy(dev);
+
+	return ret;
+}
+
+/* GetRandom is only answered from the buffer while the applet is selected. */
+static int test_selected(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48@rng:256";
+	struct halse_dev *dev;
+	size_t before;
+	int ret = 0;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	fetched_while_idle(dev, select_iot, sizeof(select_iot));
+	before = __atomic_load_n(&getrandoms, __ATOMIC_RELAXED);
+	if (send_apdu(dev, getrandom, sizeof(getrandom)) ||
+	    __atomic_load_n(&getrandoms, __ATOMIC_RELAXED) != before) {
+		fprintf(stderr, "GetRandom not answered from the buffer\n");
+		ret = 1;
+	}
+
+	send_apdu(dev, select_other, sizeof(select_other));
+	before = __atomic_load_n(&getrandoms, __ATOMIC_RELAXED);
+	if (send_apdu(dev, getrandom, sizeof(getrandom)) ||
+	    __atomic_load_n(&getrandoms, __ATOMIC_RELAXED) != before + 1) {
+		fprintf(stderr, "Buffer used with another applet selected\n");
+		ret = 1;
+	}
+
+	halse_destroy(dev);
+
+	return ret;
+}
+
+/* A failed prefetch must not reset the SE05x under the feet of the client. */
+static int test_failed(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48@rng:256";
+	uint32_t bwt_ms = 20, rnak = 1;
+	struct halse_dev *dev;
+	size_t resets;
+	int ret = 0;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+	halse_set_param(dev, TAG_IFDSE_RESPONSE_TIMEOUT_MS,
+		(unsigned char *)&bwt_ms, sizeof(bwt_ms));
+	halse_set_param(dev, TAG_IFDSE_MAX_RNAK, (unsigned char *)&rnak, sizeof(rnak));
+
+	resets = se.resets;
+	__atomic_store_n(&mute_getrandom, true, __ATOMIC_RELAXED);
+	send_apdu(dev, select_iot, sizeof(select_iot));
+	usleep(10 * IDLE_US);
+	__atomic_store_n(&mute_getrandom, false, __ATOMIC_RELAXED);
+
+	if (se.resets != resets) {
+		fprintf(stderr, "Failed prefetch has reset the SE05x\n");
+		ret = 1;
+	}
+
+	if (send_apdu(dev, select_iot, sizeof(select_iot)) || se.resets != resets) {
+		fprintf(stderr, "No resync after a failed prefetch\n");
+		ret = 1;
+	}
+
+	halse_destroy(dev);
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	sim_se05x_init(&se, "se05x");
+	se.apdu = sim_applet;
+
+	ret |= test_pending();
+	ret |= test_selected();
+	ret |= test_failed();
+
+	return ret;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "halse.h"
+#include "sim.h"
+
+/*
+ * SELECT elision ("elide-select") with a simulated SE05x: a repeated
+ * SELECT doesn't reach the SE (and gets the same response), anything
+ * which might change the selection makes the next SELECT reach the SE.
+ */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+static struct sim_se05x se;
+static bool mute; /* The SE doesn't answer */
+
+static const unsigned char select_a[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x05, 0xA0, 0x00, 0x00, 0x00, 0x0A,
+};
+static const unsigned char select_b[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x05, 0xA0, 0x00, 0x00, 0x00, 0x0B,
+};
+static const unsigned char select_missing[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x05, 0xFF, 0x00, 0x00, 0x00, 0x00,
+};
+static const unsigned char select_b_ch1[] = {
+	0x01, 0xA4, 0x04, 0x00, 0x05, 0xA0, 0x00, 0x00, 0x00, 0x0B,
+};
+static const unsigned char select_missing_ch1[] = {
+	0x01, 0xA4, 0x04, 0x00, 0x05, 0xFF, 0x00, 0x00, 0x00, 0x00,
+};
+static const unsigned char command[] = { 0x80, 0x02, 0x00, 0x00, 0x01, 0x11 };
+static const unsigned char open_channel[] = { 0x00, 0x70, 0x00, 0x00, 0x01 };
+
+/*
+ * SELECT: FCI with the last byte of the AID and a counter (6A82 for
+ * AIDs starting with FF), MANAGE CHANNEL: channel 1, others: echo.
+ */
+static int sim_applet(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	static unsigned char selects;
+
+	if (mute)
+		return 1;
+
+	if (cmd_len >= 10 && cmd[1] == 0xA4) {
+		if (cmd[5] == 0xFF) {
+			rsp[0] = 0x6A;
+			rsp[1] = 0x82;
+			*rsp_len = 2;
+			return 0;
+		}
+		rsp[0] = 0x6F;
+		rsp[1] = 0x02;
+		rsp[2] = cmd[9];
+		rsp[3] = ++selects;
+		rsp[4] = 0x90;
+		rsp[5] = 0x00;
+		*rsp_len = 6;
+		return 0;
+	}
+
+	if (cmd_len >= 4 && cmd[1] == 0x70) {
+		rsp[0] = 0x01;
+		rsp[1] = 0x90;
+		rsp[2] = 0x00;
+		*rsp_len = 3;
+		return 0;
+	}
+
+	return sim_apdu_echo(cmd, cmd_len, rsp, rsp_len);
+}
+
+static unsigned char last_rsp[32];
+static size_t last_rsp_len;
+
+/* Returns the number of APDUs which reached the SE (0: elided), or -1. */
+static int sent(struct halse_dev *dev, const unsigned char *cmd, size_t len)
+{
+	size_t before = se.apdus;
+
+	last_rsp_len = sizeof(last_rsp);
+	if (halse_xfer(dev, (unsigned char *)cmd, len, last_rsp, &last_rsp_len))
+		return -1;
+
+	return (int)(se.apdus - before);
+}
+
+#define SENT(cmd) sent(dev, cmd, sizeof(cmd))
+
+static int test_elide(struct halse_dev *dev)
+{
+	unsigned char rsp[32];
+	size_t rsp_len;
+
+	/* The repeated SELECT gets the response of the first one. */
+	CHECK(SENT(select_a) == 1);
+	rsp_len = last_rsp_len;
+	memcpy(rsp, last_rsp, rsp_len);
+	CHECK(SENT(select_a) == 0);
+	CHECK(last_rsp_len == rsp_len && !memcmp(last_rsp, rsp, rsp_len));
+
+	/* Other commands don't change the selection. */
+	CHECK(SENT(command) == 1);
+	CHECK(SENT(select_a) == 0);
+
+	/* Another SELECT does. */
+	CHECK(SENT(select_b) == 1);
+	CHECK(SENT(select_a) == 1);
+	CHECK(last_rsp_len == rsp_len && memcmp(last_rsp, rsp, rsp_len));
+	CHECK(SENT(select_a) == 0);
+
+	/* So does a failed SELECT. */
+	CHECK(SENT(select_missing) == 1);
+	CHECK(last_rsp_len == 2 && last_rsp[0] == 0x6A);
+	CHECK(SENT(select_missing) == 1);
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(select_a) == 0);
+
+	return 0;
+}
+
+static int test_channels(struct halse_dev *dev)
+{
+	CHECK(SENT(select_a) == 0);
+	CHECK(SENT(select_b_ch1) == 1);
+	CHECK(SENT(select_b_ch1) == 0);
+	CHECK(SENT(select_a) == 0);
+
+	/* A failed SELECT only affects its channel. */
+	CHECK(SENT(select_missing_ch1) == 1);
+	CHECK(SENT(select_a) == 0);
+	CHECK(SENT(select_b_ch1) == 1);
+
+	/* MANAGE CHANNEL affects all channels. */
+	CHECK(SENT(open_channel) == 1);
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(select_b_ch1) == 1);
+	CHECK(SENT(select_a) == 0);
+	CHECK(SENT(select_b_ch1) == 0);
+
+	return 0;
+}
+
+static int test_reset(struct halse_dev *dev)
+{
+	uint32_t bwt_ms = 20, rnak = 1;
+
+	/* A failed transfer */
+	halse_set_param(dev, TAG_IFDSE_RESPONSE_TIMEOUT_MS,
+		(unsigned char *)&bwt_ms, sizeof(bwt_ms));
+	halse_set_param(dev, TAG_IFDSE_MAX_RNAK, (unsigned char *)&rnak, sizeof(rnak));
+	CHECK(SENT(select_a) == 0);
+	mute = true;
+	CHECK(SENT(command) == -1);
+	mute = false;
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(select_a) == 0);
+
+	/* A reset */
+	CHECK(halse_warm_reset(dev) == 0);
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(select_a) == 0);
+
+	/* A power cycle */
+	CHECK(halse_power_down(dev) == 0);
+	CHECK(halse_power_up(dev) == 0);
+	CHECK(SENT(select_a) == 1);
+	CHECK(SENT(select_a) == 0);
+
+	return 0;
+}
+
+int main(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48@elide-select";
+	struct halse_dev *dev;
+	int ret = 0;
+
+	sim_se05x_init(&se, "se05x");
+	se.apdu = sim_applet;
+
+	dev = halse_create(config);
+	if (!dev) {
+		fprintf(stderr, "Could not open the simulated SE05x\n");
+		return 1;
+	}
+
+	ret |= test_elide(dev);
+	ret |= test_channels(dev);
+	ret |= test_reset(dev);
+
+	halse_destroy(dev);
+
+	return ret;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Christoph Muellner
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "halse.h"
+#include "halse_slots.h"
+#include "sim.h"
+
+/*
+ * Slots on the logical channels of a simulated SE05x: the CLA bytes of
+ * all slots carry their channel, the channels are opened and closed
+ * with the power state of the slots and slot 0 isn't reset under the
+ * feet of the other slots.
+ */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return 1; \
+	} \
+} while (0)
+
+static struct sim_se05x se;
+static bool channels[4]; /* Open logical channels of the SE */
+static unsigned char last_cla; /* CLA of the last other APDU */
+static size_t manage_channels;
+
+static int sim_applet(const unsigned char *cmd, size_t cmd_len,
+	unsigned char *rsp, size_t *rsp_len)
+{
+	size_t n = 0;
+	unsigned char i;
+
+	if (cmd_len < 4)
+		return -1;
+
+	if (cmd[1] == 0x70) {
+		manage_channels++;
+		if (cmd[2] == 0x00) {
+			for (i = 1; i < 4 && channels[i]; i++)
+				;
+			if (i == 4) {
+				rsp[0] = 0x6A;
+				rsp[1] = 0x81;
+				*rsp_len = 2;
+				return 0;
+			}
+			channels[i] = true;
+			rsp[n++] = i;
+		} else {
+			channels[cmd[3] & 0x03] = false;
+		}
+	} else {
+		last_cla = cmd[0];
+	}
+
+	rsp[n++] = 0x90;
+	rsp[n++] = 0x00;
+	*rsp_len = n;
+	return 0;
+}
+
+/* Returns the CLA seen by the SE, or -1. */
+static int send_cla(struct halse_dev *dev, unsigned char cla)
+{
+	unsigned char cmd[] = { cla, 0x02, 0x00, 0x00 };
+	unsigned char rsp[8];
+	size_t rsp_len = sizeof(rsp);
+
+	last_cla = 0xFF;
+	if (halse_xfer(dev, cmd, sizeof(cmd), rsp, &rsp_len))
+		return -1;
+
+	return last_cla;
+}
+
+int main(void)
+{
+	char config[] = "se:se05x@i2c:kernel:se05x:0x48";
+	unsigned char manage[] = { 0x00, 0x70, 0x00, 0x00, 0x01 };
+	struct halse_dev *base, *slots[3];
+	unsigned char rsp[8];
+	size_t rsp_len = sizeof(rsp), resets;
+
+	sim_se05x_init(&se, "se05x");
+	se.apdu = sim_applet;
+
+	base = halse_create(config);
+	CHECK(base);
+	CHECK(halse_slots_create(base, 3, slots) == 0);
+
+	/* Slot 0 is forced to the basic channel. */
+	CHECK(halse_power_up(slots[0]) == 0);
+	CHECK(send_cla(slots[0], 0x00) == 0x00);
+	CHECK(send_cla(slots[0], 0x01) == 0x00);
+	CHECK(send_cla(slots[0], 0x83) == 0x80);
+	CHECK(send_cla(slots[0], 0x40) == -1);
+	CHECK(send_cla(slots[0], 0xFF) == -1);
+
+	/* The other slots get their own channels. */
+	CHECK(halse_power_up(slots[1]) == 0 && channels[1]);
+	CHECK(halse_power_up(slots[2]) == 0 && channels[2]);
+	CHECK(send_cla(slots[1], 0x00) == 0x01);
+	CHECK(send_cla(slots[2], 0x81) == 0x82);
+	CHECK(send_cla(slots[1], 0x43) == -1);
+	CHECK(send_cla(slots[2], 0xFF) == -1);
+
+	/* MANAGE CHANNEL of a client doesn't reach the SE. */
+	CHECK(halse_xfer(slots[1], manage, sizeof(manage), rsp, &rsp_len) == 0);
+	CHECK(rsp_len == 2 && rsp[0] == 0x68 && rsp[1] == 0x81);
+	CHECK(manage_channels == 2);
+
+	/* A reset of another slot reopens its channel. */
+	CHECK(halse_warm_reset(slots[2]) == 0);
+	CHECK(manage_channels == 4 && channels[2]);
+	CHECK(send_cla(slots[2], 0x00) == 0x02);
+
+	/* A power down closes the channel. */
+	CHECK(halse_power_down(slots[1]) == 0 && !channels[1]);
+	CHECK(send_cla(slots[1], 0x00) == -1);
+
+	/* Slot 0 can't be reset while another slot is in use... */
+	resets = se.resets;
+	CHECK(halse_warm_reset(slots[0]) != 0);
+	CHECK(se.resets == resets && channels[2]);
+	CHECK(send_cla(slots[2], 0x00) == 0x02);
+
+	/* ...but once it is alone. */
+	CHECK(halse_power_down(slots[2]) == 0 && !channels[2]);
+	CHECK(halse_warm_reset(slots[0]) == 0);
+	CHECK(se.resets > resets);
+	CHECK(send_cla(slots[0], 0x00) == 0x00);
+
+	halse_destroy(slots[0]);
+
+	return 0;
+}